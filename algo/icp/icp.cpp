@@ -26,6 +26,7 @@ struct SingleICP : public ICP {
     std::unique_ptr<PointCloudKDT> m_kds;
 
     std::vector<Corresponence> m_result;
+    std::vector<glm::vec3> m_transformed;
 
     float m_d{100};
 };
@@ -44,13 +45,14 @@ double SingleICP::step()
     const glm::mat4 mat = m_object->m_model_matrix;
 
     m_result.resize(m_src->size());
+    transform_src(mat, *m_src, m_transformed);
 
-    auto nnr = find_nn(*m_kds, mat, *m_src, max_correspondence_distance_sqr,
+    auto nnr = find_nn(*m_kds, m_transformed, max_correspondence_distance_sqr,
                        m_result, m_tp);
     if (nnr.m_num_corres < 100)
         return NAN;
 
-    auto upd = umeyama(*m_reference, mat, *m_src, m_result,
+    auto upd = umeyama(*m_reference, mat, m_transformed, m_result,
                        max_correspondence_distance_sqr, nnr.m_num_corres);
     m_object->m_model_matrix = upd;
     return nnr.rmse();
@@ -5,6 +5,7 @@
 #include "thread_pool.hpp"
 
 #include "3dglue/vertexbuffer.hpp"
+#include "3dglue/transform.hpp"
 
 #include <mutex>
 
@@ -79,9 +80,20 @@ struct PointCloudKDT {
     }
 };
 
+// Source positions with the current estimate applied
+static inline void transform_src(const glm::mat4& transform,
+                                 const VertexBuffer& src,
+                                 std::vector<glm::vec3>& out)
+{
+    out.resize(src.size());
+    transformPositions(transform,
+                       src.get_attributes(VertexAttribute::Position),
+                       src.get_stride(VertexAttribute::Position), out.data(),
+                       src.size());
+}
+
 static inline NNResult find_nn(const PointCloudKDT& ref,
-                               const glm::mat4& transform,
-                               const VertexBuffer& src,
+                               const std::vector<glm::vec3>& src,
                                float max_correspondence_distance_sqr,
                                std::vector<Corresponence>& result,
                                thread_pool& tp)
@@ -96,11 +108,10 @@ static inline NNResult find_nn(const PointCloudKDT& ref,
             float error2 = 0.0;
             size_t num_corres = 0;
             for (long i = start; i < end; i++) {
-                auto p = transform * glm::vec4{src.position(i), 1};
                 nanoflann::KNNResultSet<float> resultSet(1);
                 resultSet.init(&result[i].ref_idx, &result[i].dist_sqr);
 
-                ref.m_kd.findNeighbors(resultSet, &p[0],
+                ref.m_kd.findNeighbors(resultSet, &src[i][0],
                                        nanoflann::SearchParams());
                 if (result[i].dist_sqr > max_correspondence_distance_sqr)
                     continue;
@@ -116,8 +127,9 @@ static inline NNResult find_nn(const PointCloudKDT& ref,
     return NNResult{error2_acc, num_corres_acc};
 }
 
+// src is the source transformed by t, as from transform_src()
 static inline glm::mat4 umeyama(const VertexBuffer& ref, const glm::mat4& t,
-                                const VertexBuffer& src,
+                                const std::vector<glm::vec3>& src,
                                 const std::vector<Corresponence>& corr,
                                 float max_correspondence_distance_sqr,
                                 size_t num_corr)
@@ -129,8 +141,7 @@ static inline glm::mat4 umeyama(const VertexBuffer& ref, const glm::mat4& t,
         if (corr[i].dist_sqr > max_correspondence_distance_sqr)
             continue;
 
-        const glm::vec3 p = t * glm::vec4{src.position(i), 1};
-        our_centroid += p;
+        our_centroid += src[i];
         ref_centroid += ref.position(corr[i].ref_idx);
     }
 
@@ -143,8 +154,7 @@ static inline glm::mat4 umeyama(const VertexBuffer& ref, const glm::mat4& t,
         if (corr[i].dist_sqr > max_correspondence_distance_sqr)
             continue;
 
-        const glm::vec3 p = t * glm::vec4{src.position(i), 1};
-        auto o_pt = p - our_centroid;
+        auto o_pt = src[i] - our_centroid;
         auto r_pt = ref.position(corr[i].ref_idx) - ref_centroid;
         for (int j = 0; j < 3; j++) {
             H[j].x += o_pt[j] * r_pt[0];
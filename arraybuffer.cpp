@@ -1,95 +1,683 @@
 #include "arraybuffer.hpp"
 
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+#include "drawstate.hpp"
+#include "parallel.hpp"
+
 namespace g3d {
 
+namespace {
+
+// Every attribute, and so the stride, is a multiple of four bytes
+size_t
+formatBytes(VertexFormat format, size_t elements)
+{
+    size_t bytes;
+    switch(format) {
+    case VertexFormat::Half:
+    case VertexFormat::UNorm16:
+    case VertexFormat::SNorm16:
+        bytes = elements * 2;
+        break;
+    case VertexFormat::UNorm8:
+        bytes = elements;
+        break;
+    case VertexFormat::SNorm10:
+        bytes = 4;
+        break;
+    default:
+        bytes = elements * 4;
+        break;
+    }
+    return (bytes + 3) & ~size_t{3};
+}
+
+GLenum
+glType(VertexFormat format)
+{
+    switch(format) {
+    case VertexFormat::Half:
+        return GL_HALF_FLOAT;
+    case VertexFormat::UNorm8:
+        return GL_UNSIGNED_BYTE;
+    case VertexFormat::UNorm16:
+        return GL_UNSIGNED_SHORT;
+    case VertexFormat::SNorm16:
+        return GL_SHORT;
+    case VertexFormat::SNorm10:
+        return GL_INT_2_10_10_10_REV;
+    default:
+        return GL_FLOAT;
+    }
+}
+
+#ifndef __F16C__
+
+// Round to nearest even, overflow goes to infinity
+uint16_t
+toHalf(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    const uint16_t sign = (x >> 16) & 0x8000;
+    const uint32_t a = x & 0x7fffffff;
+
+    if(a > 0x7f800000)
+        return sign | 0x7e00;  // NaN
+    if(a >= 0x477ff000)
+        return sign | 0x7c00;
+    if(a < 0x38800000) {
+        // Subnormal, in units of 2^-24
+        float af;
+        memcpy(&af, &a, sizeof(af));
+        return sign | (uint16_t)lrintf(af * 16777216.0f);
+    }
+    return sign | ((a + 0xfff + ((a >> 13) & 1) - 0x38000000) >> 13);
+}
+
+#endif
+
+#ifdef __SSE2__
+
+// Up to four elements, without reading past the last one
+inline __m128
+load4(const float *s, size_t elements)
+{
+    if(elements >= 4)
+        return _mm_loadu_ps(s);
+    float t[4] = {0, 0, 0, 0};
+    memcpy(t, s, elements * sizeof(float));
+    return _mm_loadu_ps(t);
+}
+
+// Clamped to [lo, 1], scaled and rounded, NaN becomes lo
+inline __m128i
+quantize(__m128 v, float lo, float scale)
+{
+    v = _mm_min_ps(_mm_max_ps(v, _mm_set1_ps(lo)), _mm_set1_ps(1.0f));
+    return _mm_cvtps_epi32(_mm_mul_ps(v, _mm_set1_ps(scale)));
+}
+
+#else
+
+inline int32_t
+quantize(float v, float lo, float scale)
+{
+    v = v > lo ? v < 1.0f ? v : 1.0f : lo;
+    return (int32_t)lrintf(v * scale);
+}
+
+#endif
+
+// Converts one attribute of count vertices, elements floats every
+// src_stride floats, to format at dst every dst_stride bytes
 void
-VertexAttribBuffer::load(const VertexBuffer &src)
+convert(VertexFormat format, const float *src, size_t src_stride,
+        size_t elements, size_t count, uint8_t *dst, size_t dst_stride)
+{
+    const size_t bytes = formatBytes(format, elements);
+
+    if(format == VertexFormat::Float) {
+        for(size_t i = 0; i < count; i++)
+            memcpy(dst + i * dst_stride, src + i * src_stride, bytes);
+        return;
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        const float *s = src + i * src_stride;
+        uint8_t *d = dst + i * dst_stride;
+        alignas(16) uint8_t out[16] = {};
+
+#ifdef __SSE2__
+        const __m128 v = load4(s, elements);
+        switch(format) {
+        case VertexFormat::Half:
+#ifdef __F16C__
+            _mm_storel_epi64((__m128i *)out,
+                             _mm_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+#else
+            for(size_t e = 0; e < elements; e++) {
+                const uint16_t h = toHalf(s[e]);
+                memcpy(out + e * 2, &h, 2);
+            }
+#endif
+            break;
+        case VertexFormat::UNorm8: {
+            __m128i q = quantize(v, 0, 255.0f);
+            q = _mm_packus_epi16(_mm_packs_epi32(q, q), q);
+            const int32_t w = _mm_cvtsi128_si32(q);
+            memcpy(out, &w, 4);
+            break;
+        }
+        case VertexFormat::UNorm16: {
+            // Biased so the signed saturating pack keeps the full range
+            __m128i q = _mm_sub_epi32(quantize(v, 0, 65535.0f),
+                                      _mm_set1_epi32(32768));
+            q = _mm_xor_si128(_mm_packs_epi32(q, q), _mm_set1_epi16(-32768));
+            _mm_storel_epi64((__m128i *)out, q);
+            break;
+        }
+        case VertexFormat::SNorm16: {
+            const __m128i q = quantize(v, -1.0f, 32767.0f);
+            _mm_storel_epi64((__m128i *)out, _mm_packs_epi32(q, q));
+            break;
+        }
+        case VertexFormat::SNorm10: {
+            alignas(16) int32_t q[4];
+            _mm_store_si128((__m128i *)q, quantize(v, -1.0f, 511.0f));
+            const uint32_t w = (q[0] & 0x3ff) | (q[1] & 0x3ff) << 10 |
+                               (q[2] & 0x3ff) << 20;
+            memcpy(out, &w, 4);
+            break;
+        }
+        default:
+            break;
+        }
+#else
+        for(size_t e = 0; e < elements; e++) {
+            switch(format) {
+            case VertexFormat::Half: {
+                const uint16_t h = toHalf(s[e]);
+                memcpy(out + e * 2, &h, 2);
+                break;
+            }
+            case VertexFormat::UNorm8:
+                out[e] = quantize(s[e], 0, 255.0f);
+                break;
+            case VertexFormat::UNorm16: {
+                const uint16_t q = quantize(s[e], 0, 65535.0f);
+                memcpy(out + e * 2, &q, 2);
+                break;
+            }
+            case VertexFormat::SNorm16: {
+                const int16_t q = quantize(s[e], -1.0f, 32767.0f);
+                memcpy(out + e * 2, &q, 2);
+                break;
+            }
+            case VertexFormat::SNorm10: {
+                uint32_t w;
+                memcpy(&w, out, 4);
+                w |= (quantize(s[e], -1.0f, 511.0f) & 0x3ff) << (e * 10);
+                memcpy(out, &w, 4);
+                break;
+            }
+            default:
+                break;
+            }
+        }
+#endif
+        memcpy(d, out, bytes);
+    }
+}
+
+constexpr size_t SMALL_VERTICES = 65536;
+constexpr size_t STAGING_BYTES = 16 * 1024 * 1024;
+
+}  // namespace
+
+void
+packAttribute(VertexFormat format, const float *src, size_t src_stride,
+              size_t elements, size_t count, uint8_t *dst, size_t dst_stride)
 {
+    const size_t bytes = formatBytes(format, elements);
+    if(format == VertexFormat::Float && src_stride * sizeof(float) == bytes &&
+       dst_stride == bytes) {
+        memcpy(dst, src, count * bytes);
+        return;
+    }
+
+    parallelFor(count, [&](size_t begin, size_t end, size_t) {
+        convert(format, src + begin * src_stride, src_stride, elements,
+                end - begin, dst + begin * dst_stride, dst_stride);
+    });
+}
+
+// Pack vertices [first, first + count) of src into dst as described by ose
+// and formats
+static void
+interleave(const VertexBuffer &src, size_t first, size_t count,
+           const std::vector<std::tuple<size_t, size_t>> &ose,
+           const std::array<VertexFormat, 8> &formats, size_t byte_stride,
+           uint8_t *dst)
+{
+    parallelFor(count, [&](size_t begin, size_t end, size_t) {
+        for(size_t i = 0; i < ose.size(); i++) {
+            const size_t elements = std::get<1>(ose[i]);
+            if(elements == 0)
+                continue;
+            const VertexAttribute va = (VertexAttribute)i;
+            const size_t src_stride = src.get_stride(va);
+            convert(i < formats.size() ? formats[i] : VertexFormat::Float,
+                    src.get_attributes(va) + (first + begin) * src_stride,
+                    src_stride, elements, end - begin,
+                    dst + std::get<0>(ose[i]) + begin * byte_stride,
+                    byte_stride);
+        }
+    });
+}
+
+// Decides the layout for vb and the formats of its attributes. The
+// offsets in sv.m_ose are within a vertex if interleaved, else 0.
+void
+VertexAttribBuffer::plan(const VertexBuffer &vb, size_t vertices,
+                         VertexLayout layout, StagedVertices &sv)
+{
+    const float *data = vb.get_attributes(VertexAttribute::Position);
+    size_t elements_per_vertex = 0;
+    bool packed = true;
+    for(size_t i = 0; i < 32; i++) {
+        const VertexAttribute va = (VertexAttribute)i;
+        const size_t elements = vb.get_elements(va);
+        if(elements == 0)
+            continue;
+        if(vb.get_attributes(va) != data + elements_per_vertex)
+            packed = false;
+        elements_per_vertex += elements;
+    }
+
+    switch(layout) {
+    case VertexLayout::Interleaved:
+        sv.m_separate = false;
+        break;
+    case VertexLayout::Separate:
+        sv.m_separate = true;
+        break;
+    default:
+        sv.m_separate = !packed && vertices >= SMALL_VERTICES;
+        break;
+    }
+
+    size_t offset = 0;
+    sv.m_formats = vb.get_formats();
+    sv.m_ose.clear();
+    sv.m_streams.clear();
+
+    for(size_t i = 0; i < 32; i++) {
+        const VertexAttribute va = (VertexAttribute)i;
+        const size_t elements = vb.get_elements(va);
+        if(elements == 0) {
+            sv.m_ose.push_back(std::make_tuple(0, 0));
+            continue;
+        }
+
+        VertexFormat format = vb.get_format(va);
+        if(elements > 4)
+            format = VertexFormat::Float;
+        else if(format == VertexFormat::SNorm10 && elements != 3)
+            format = VertexFormat::SNorm16;
+        if(i < sv.m_formats.size())
+            sv.m_formats[i] = format;
+
+        const size_t bytes = formatBytes(format, elements);
+        sv.m_ose.push_back(
+            std::make_tuple(sv.m_separate ? 0 : offset, elements));
+        offset += bytes;
+
+        if(sv.m_separate) {
+            sv.m_streams.resize(i + 1);
+            sv.m_streams[i].first = bytes;
+        }
+    }
+    sv.m_byte_stride = offset;
+    if(!sv.m_separate)
+        sv.m_streams.emplace_back(offset, nullptr);
+}
+
+void
+VertexAttribBuffer::adopt(const StagedVertices &sv)
+{
+    m_separate = sv.m_separate;
+    m_byte_stride = sv.m_byte_stride;
+    m_ose = sv.m_ose;
+    set_formats(sv.m_formats);
+
+    m_streams.clear();
+    if(!m_separate)
+        return;
+    m_streams.resize(sv.m_streams.size());
+    for(size_t i = 0; i < m_streams.size(); i++) {
+        if(sv.m_streams[i].first)
+            m_streams[i] =
+                std::make_unique<ArrayBuffer>(GL_ARRAY_BUFFER, m_usage);
+    }
+}
+
+ArrayBuffer &
+VertexAttribBuffer::stream(size_t index)
+{
+    return m_separate ? *m_streams[index] : m_buf;
+}
+
+// Vertices [first, first + count) of one attribute of src to vertex at of
+// its stream, which must be large enough
+void
+VertexAttribBuffer::writeStream(size_t index, const VertexBuffer &src,
+                                size_t first, size_t count, size_t at)
+{
+    const VertexAttribute va = (VertexAttribute)index;
+    const VertexFormat format = get_format(va);
+    const size_t elements = get_elements(va);
+    const size_t bytes = formatBytes(format, elements);
+    const size_t src_stride = src.get_stride(va);
+    const float *s = src.get_attributes(va) + first * src_stride;
+    ArrayBuffer &buf = *m_streams[index];
+
+    if(format == VertexFormat::Float && src_stride * sizeof(float) == bytes) {
+        buf.write(at * bytes, s, count * bytes);
+        return;
+    }
+
+    const size_t slab = std::max<size_t>(1, STAGING_BYTES / bytes);
+    for(size_t i = 0; i < count; i += slab) {
+        const size_t n = std::min(slab, count - i);
+        m_staging.resize(n * bytes);
+        packAttribute(format, s + i * src_stride, src_stride, elements, n,
+                      m_staging.data(), bytes);
+        buf.write((at + i) * bytes, m_staging.data(), n * bytes);
+    }
+}
+
+VertexAttribBuffer::~VertexAttribBuffer()
+{
+    if(m_vao)
+        DrawState::deleteVertexArray(m_vao);
+}
+
+std::shared_ptr<StagedVertices>
+VertexAttribBuffer::stage(const VertexBuffer &src, VertexLayout layout)
+{
+    auto sv = std::make_shared<StagedVertices>();
+    const size_t vertices = src.size();
+    plan(src, vertices, layout, *sv);
+    sv->m_count = vertices;
+
+    if(sv->m_separate) {
+        // Float attributes already tightly packed are uploaded as they are
+        for(size_t i = 0; i < sv->m_streams.size(); i++) {
+            auto &[bytes, data] = sv->m_streams[i];
+            if(bytes == 0)
+                continue;
+            const VertexAttribute va = (VertexAttribute)i;
+            const VertexFormat format = i < sv->m_formats.size()
+                                            ? sv->m_formats[i]
+                                            : VertexFormat::Float;
+            const size_t src_stride = src.get_stride(va);
+            const float *s = src.get_attributes(va);
+
+            if(format == VertexFormat::Float &&
+               src_stride * sizeof(float) == bytes) {
+                data = (const uint8_t *)s;
+                continue;
+            }
+            auto &buf = sv->m_storage.emplace_back(vertices * bytes);
+            packAttribute(format, s, src_stride, std::get<1>(sv->m_ose[i]),
+                          vertices, buf.data(), bytes);
+            data = buf.data();
+        }
+        return sv;
+    }
+
     const float *data = src.get_attributes(VertexAttribute::Position);
     size_t elements_per_vertex = src.get_elements(VertexAttribute::Position);
 
-    bool packed = true;
+    // Already interleaved floats are uploaded as they are
+    bool packed = sv->m_formats[0] == VertexFormat::Float;
     for(size_t i = 1; i < 32; i++) {
         const float *n = src.get_attributes((VertexAttribute)i);
         if(n == NULL)
             continue;  // Not in use
 
-        if(n != data + elements_per_vertex) {
+        if(n != data + elements_per_vertex ||
+           (i < sv->m_formats.size() &&
+            sv->m_formats[i] != VertexFormat::Float)) {
             packed = false;
         }
 
         elements_per_vertex += src.get_elements((VertexAttribute)i);
     }
+    for(size_t i = 0; packed && i < 32; i++) {
+        const VertexAttribute va = (VertexAttribute)i;
+        if(src.get_elements(va) && src.get_stride(va) != elements_per_vertex)
+            packed = false;
+    }
 
-    std::vector<float> copybuf;
+    if(packed) {
+        sv->m_streams[0].second = (const uint8_t *)data;
+    } else {
+        auto &buf = sv->m_storage.emplace_back(vertices * sv->m_byte_stride);
+        interleave(src, 0, vertices, sv->m_ose, sv->m_formats,
+                   sv->m_byte_stride, buf.data());
+        sv->m_streams[0].second = buf.data();
+    }
+    return sv;
+}
 
-    const size_t vertices = src.size();
-    m_byte_stride = elements_per_vertex * sizeof(float);
+bool
+VertexAttribBuffer::upload(StagedVertices &sv, size_t budget)
+{
+    const size_t n =
+        std::min(sv.m_count - sv.m_uploaded,
+                 std::max<size_t>(1, budget / std::max<size_t>(
+                                                  1, sv.m_byte_stride)));
 
-    if(!packed) {
-        copybuf.resize(elements_per_vertex * vertices);
+    if(!sv.m_adopted) {
+        adopt(sv);
+        sv.m_adopted = true;
+        m_count = 0;
 
-        float *dst = copybuf.data();
-        size_t offset = 0;
+        // All at once is a plain glBufferData()
+        const bool whole = n == sv.m_count;
+        for(size_t i = 0; i < sv.m_streams.size(); i++) {
+            const auto &[bytes, data] = sv.m_streams[i];
+            if(bytes == 0)
+                continue;
+            if(whole)
+                stream(i).write(data, sv.m_count * bytes);
+            else
+                stream(i).reserve(sv.m_count * bytes);
+        }
+        if(whole) {
+            sv.m_uploaded = m_count = sv.m_count;
+            return true;
+        }
+    }
 
-        for(size_t i = 0; i < 32; i++) {
-            const float *s = src.get_attributes((VertexAttribute)i);
-            if(s == NULL) {
-                m_ose.push_back(std::make_tuple(0, 0));
-                continue;  // Not in use
-            }
-            const size_t elements = src.get_elements((VertexAttribute)i);
-            const size_t src_stride = src.get_stride((VertexAttribute)i);
-            assert(src_stride != 0);
-
-            for(size_t j = 0; j < vertices; j++) {
-                for(size_t k = 0; k < elements; k++) {
-                    dst[j * elements_per_vertex + k] = s[j * src_stride + k];
-                }
-            }
+    for(size_t i = 0; i < sv.m_streams.size(); i++) {
+        const auto &[bytes, data] = sv.m_streams[i];
+        if(bytes)
+            stream(i).write(sv.m_uploaded * bytes,
+                            data + sv.m_uploaded * bytes, n * bytes);
+    }
+    sv.m_uploaded += n;
+    m_count = sv.m_uploaded;
+    return sv.m_uploaded == sv.m_count;
+}
 
-            m_ose.push_back(std::make_tuple(offset, elements));
+void
+VertexAttribBuffer::load(const VertexBuffer &src)
+{
+    upload(*stage(src, m_layout), SIZE_MAX);
+}
 
-            dst += elements;
-            offset += elements;
-        }
-        data = copybuf.data();
-    } else {
-        size_t offset = 0;
+void
+VertexAttribBuffer::reserve(const VertexBuffer &layout_vb, size_t capacity)
+{
+    capacity = std::max<size_t>(1, capacity);
+    StagedVertices sv;
+    plan(layout_vb, capacity, m_layout, sv);
+    adopt(sv);
+    m_count = 0;
 
-        m_ose.clear();
+    for(size_t i = 0; i < sv.m_streams.size(); i++) {
+        if(sv.m_streams[i].first)
+            stream(i).reserve(capacity * sv.m_streams[i].first);
+    }
+}
 
-        for(size_t i = 0; i < 32; i++) {
-            const float *s = src.get_attributes((VertexAttribute)i);
-            if(s == NULL) {
-                m_ose.push_back(std::make_tuple(0, 0));
+void
+VertexAttribBuffer::append(const VertexBuffer &vb, size_t first, size_t count)
+{
+    if(m_separate) {
+        for(size_t i = 0; i < m_streams.size(); i++) {
+            if(!m_streams[i])
                 continue;
-            }
+            const VertexAttribute va = (VertexAttribute)i;
+            ArrayBuffer &buf = *m_streams[i];
+            const size_t bytes =
+                formatBytes(get_format(va), get_elements(va));
+            const size_t used = m_count * bytes;
+            const size_t needed = used + count * bytes;
+            if(needed > buf.capacity())
+                buf.reserve(std::max(needed, buf.capacity() * 2), used);
+            writeStream(i, vb, first, count, m_count);
+        }
+        m_count += count;
+        return;
+    }
 
-            const size_t elements = src.get_elements((VertexAttribute)i);
-            assert(src.get_stride((VertexAttribute)i) == elements_per_vertex);
+    const size_t used = m_count * m_byte_stride;
+    const size_t needed = used + count * m_byte_stride;
+    if(needed > m_buf.capacity())
+        m_buf.reserve(std::max(needed, m_buf.capacity() * 2), used);
+
+    m_staging.resize(count * m_byte_stride);
+    interleave(vb, first, count, m_ose, get_formats(), m_byte_stride,
+               m_staging.data());
+
+    m_buf.write(used, m_staging.data(), count * m_byte_stride);
+    m_count += count;
+}
+
+bool
+VertexAttribBuffer::update(const VertexBuffer &src,
+                           const std::vector<VertexRange> &ranges)
+{
+    if(src.size() != m_count ||
+       src.get_attribute_mask() != get_attribute_mask())
+        return false;
 
-            m_ose.push_back(std::make_tuple(offset, elements));
-            offset += elements;
+    if(m_separate) {
+        for(const auto &r : ranges) {
+            const size_t i = (size_t)r.va;
+            if(r.first >= m_count || i >= m_streams.size() || !m_streams[i])
+                continue;
+            writeStream(i, src, r.first, std::min(r.count, m_count - r.first),
+                        r.first);
         }
+        return true;
     }
 
-    m_buf.write((const float *)data,
-                vertices * elements_per_vertex * sizeof(float));
-    m_count = vertices;
+    // Attributes share vertices here, so merge over all of them
+    std::vector<VertexRange> spans(ranges);
+    std::sort(spans.begin(), spans.end(),
+              [](const auto &a, const auto &b) { return a.first < b.first; });
+
+    for(size_t i = 0; i < spans.size();) {
+        const size_t first = spans[i].first;
+        size_t end = first + spans[i].count;
+        for(i++; i < spans.size() && spans[i].first <= end; i++)
+            end = std::max(end, spans[i].first + spans[i].count);
+
+        end = std::min(end, m_count);
+        if(first >= end)
+            continue;
+        const size_t count = end - first;
+        m_staging.resize(count * m_byte_stride);
+        interleave(src, first, count, m_ose, get_formats(), m_byte_stride,
+                   m_staging.data());
+        m_buf.write(first * m_byte_stride, m_staging.data(),
+                    count * m_byte_stride);
+    }
+    return true;
+}
+
+void
+VertexAttribBuffer::setUsage(GLenum usage)
+{
+    m_usage = usage;
+    m_buf.setUsage(usage);
 }
 
 bool
 VertexAttribBuffer::bind()
 {
+    if(m_separate)
+        return !m_streams.empty() && m_streams[0] && m_streams[0]->bind();
     return m_buf.bind();
 }
 
 void
 VertexAttribBuffer::ptr(GLuint index, VertexAttribute va) const
 {
-    glVertexAttribPointer(index, get_elements(va), GL_FLOAT, GL_TRUE,
-                          m_byte_stride, get_attributes(va));
+    const VertexFormat format = get_format(va);
+    const GLint size =
+        format == VertexFormat::SNorm10 ? 4 : (GLint)get_elements(va);
+    const GLboolean normalized =
+        format != VertexFormat::Float && format != VertexFormat::Half;
+
+    // The pointer refers to whatever is bound to GL_ARRAY_BUFFER
+    if(m_separate)
+        m_streams[(size_t)va]->bind();
+
+    glVertexAttribPointer(index, size, glType(format), normalized,
+                          get_stride(va) * sizeof(float), get_attributes(va));
+}
+
+bool
+VertexAttribBuffer::bindArray(std::initializer_list<VertexAttribute> locations,
+                              const ArrayBuffer *elements)
+{
+    const ArrayBuffer *first =
+        m_separate ? m_streams.empty() ? nullptr : m_streams[0].get()
+                   : &m_buf;
+    if(first == nullptr || !first->id())
+        return false;
+
+    // Everything the attribute setup depends on
+    std::vector<uint64_t> key;
+    key.reserve(2 + m_streams.size() + locations.size() * 2);
+    key.push_back(m_buf.serial());
+    for(const auto &s : m_streams)
+        key.push_back(s ? s->serial() : 0);
+    for(VertexAttribute va : locations) {
+        key.push_back((uint64_t)get_elements(va) << 32 |
+                      (uint64_t)get_format(va) << 16 | get_stride(va));
+        key.push_back((uintptr_t)get_attributes(va));
+    }
+    key.push_back(elements ? elements->serial() : 0);
+
+    if(!m_vao)
+        glGenVertexArrays(1, &m_vao);
+    DrawState::bindVertexArray(m_vao);
+    if(key == m_vao_key)
+        return true;
+
+    bind();
+    GLuint index = 0;
+    for(VertexAttribute va : locations) {
+        if(get_elements(va)) {
+            glEnableVertexAttribArray(index);
+            ptr(index, va);
+        } else {
+            glDisableVertexAttribArray(index);
+        }
+        index++;
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, elements ? elements->id() : 0);
+    m_vao_key = std::move(key);
+    return true;
 }
 
 size_t
@@ -104,12 +692,14 @@ VertexAttribBuffer::get_attributes(VertexAttribute va) const
     const size_t index = (size_t)va;
     if(index >= m_ose.size() || std::get<1>(m_ose[index]) == 0)
         return nullptr;
-    return (const float *)(intptr_t)(std::get<0>(m_ose[index]) * sizeof(float));
+    return (const float *)(intptr_t)std::get<0>(m_ose[index]);
 }
 
 size_t
 VertexAttribBuffer::get_stride(VertexAttribute va) const
 {
+    if(m_separate)
+        return formatBytes(get_format(va), get_elements(va)) / sizeof(float);
     return m_byte_stride / sizeof(float);
 }
 
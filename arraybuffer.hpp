@@ -2,6 +2,10 @@
 
 #include <GL/glew.h>
 
+#include <initializer_list>
+#include <memory>
+#include <utility>
+
 #include "vertexbuffer.hpp"
 
 namespace g3d {
@@ -10,7 +14,11 @@ struct ArrayBuffer {
     ArrayBuffer(const ArrayBuffer &) = delete;
     ArrayBuffer &operator=(const ArrayBuffer &) = delete;
 
-    ArrayBuffer(GLenum target) : m_target(target) {}
+    // usage is the hint for glBufferData(), see setUsage()
+    ArrayBuffer(GLenum target, GLenum usage = GL_STATIC_DRAW)
+      : m_target(target), m_usage(usage)
+    {
+    }
 
     ~ArrayBuffer()
     {
@@ -28,25 +36,187 @@ struct ArrayBuffer {
 
     void write(const void *ptr, size_t len)
     {
-        if(!m_buffer)
+        if(!m_buffer) {
             glGenBuffers(1, &m_buffer);
+            m_serial = nextSerial();
+        }
 
-        glBindBuffer(m_target, m_buffer);
-        glBufferData(m_target, len, ptr, GL_STATIC_DRAW);
+        glBindBuffer(writeTarget(), m_buffer);
+        glBufferData(writeTarget(), len, ptr, m_usage);
+        m_capacity = len;
     }
 
+    // Overwrite part of the buffer, which must already be large enough
+    void write(size_t offset, const void *ptr, size_t len)
+    {
+        glBindBuffer(writeTarget(), m_buffer);
+        glBufferSubData(writeTarget(), offset, len, ptr);
+    }
+
+    // Reallocate to len bytes, preserving the first keep bytes
+    void reserve(size_t len, size_t keep = 0)
+    {
+        GLuint buffer;
+        glGenBuffers(1, &buffer);
+        glBindBuffer(writeTarget(), buffer);
+        glBufferData(writeTarget(), len, NULL, m_usage);
+
+        if(m_buffer) {
+            if(keep) {
+                glBindBuffer(GL_COPY_READ_BUFFER, m_buffer);
+                glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+                glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                                    0, 0, keep);
+            }
+            glDeleteBuffers(1, &m_buffer);
+        }
+        m_buffer = buffer;
+        m_serial = nextSerial();
+        m_capacity = len;
+    }
+
+    size_t capacity() const { return m_capacity; }
+
+    GLuint id() const { return m_buffer; }
+
+    // Changes whenever the GL buffer is replaced. Unlike id(), which GL
+    // may hand out again, it identifies the buffer for cached state.
+    uint64_t serial() const { return m_serial; }
+
+    // GL_STATIC_DRAW, GL_DYNAMIC_DRAW or GL_STREAM_DRAW. Applies from the
+    // next allocation.
+    void setUsage(GLenum usage) { m_usage = usage; }
+
 private:
+    // Binding an index buffer would also change the bound vertex array
+    // object, so those are written through another target
+    GLenum writeTarget() const
+    {
+        return m_target == GL_ELEMENT_ARRAY_BUFFER ? GL_COPY_WRITE_BUFFER
+                                                   : m_target;
+    }
+
+    static uint64_t nextSerial()
+    {
+        static uint64_t serial;
+        return ++serial;
+    }
+
     const GLenum m_target;
+    GLenum m_usage;
     GLuint m_buffer{0};
+    uint64_t m_serial{0};
+    size_t m_capacity{0};
 };
 
+// Converts count vertices of one attribute, elements floats every
+// src_stride floats, to format at dst every dst_stride bytes. Each vertex
+// takes a multiple of four bytes. Split across threads.
+void packAttribute(VertexFormat format, const float *src, size_t src_stride,
+                   size_t elements, size_t count, uint8_t *dst,
+                   size_t dst_stride);
+
+// Object::set("usage", v) to a GL usage hint: 0 static, 1 dynamic (data
+// changed now and then, see VertexBuffer::invalidate()), 2 stream
+inline GLenum
+bufferUsage(float v)
+{
+    return v >= 2 ? GL_STREAM_DRAW : v >= 1 ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW;
+}
+
+enum class VertexLayout {
+    Auto,         // Interleaved if already packed or small, else Separate
+    Interleaved,  // One buffer, all attributes of a vertex together
+    Separate,     // One buffer per attribute, written from the source as is
+};
+
+// Vertices packed by VertexAttribBuffer::stage(), in the layout and
+// formats they take on the GPU, for VertexAttribBuffer::upload()
+struct StagedVertices {
+    size_t m_count{0};
+    size_t m_uploaded{0};  // Vertices, by VertexAttribBuffer::upload()
+    bool m_adopted{false};
+
+    bool m_separate{false};
+    size_t m_byte_stride{0};
+    std::vector<std::tuple<size_t, size_t>> m_ose;
+    std::array<VertexFormat, 8> m_formats;
+
+    // <bytes per vertex, data> of each GL buffer: the interleaved one, or
+    // one per attribute with 0 bytes where unused. The data is in
+    // m_storage or, if no conversion was needed, in the source.
+    std::vector<std::pair<size_t, const uint8_t *>> m_streams;
+    std::vector<std::vector<uint8_t>> m_storage;
+};
+
+// Vertices on the GPU. Each attribute is stored in the format
+// vb.get_format() asks for (see VertexFormat), converted from float while
+// packing.
+//
+// Separate buffers skip the interleaving copy: float attributes that are
+// tightly packed in the source are uploaded straight from it and the
+// rest are converted a slab at a time. Interleaving suits small meshes
+// drawn many times.
 struct VertexAttribBuffer : public VertexBuffer {
+    explicit VertexAttribBuffer(VertexLayout layout = VertexLayout::Auto)
+      : m_layout(layout)
+    {
+    }
+
+    ~VertexAttribBuffer();
+
     void load(const VertexBuffer &vb);
 
+    // The CPU half of load(): converts and interleaves vb as layout
+    // asks. Makes no GL calls, so it can run on a worker thread. The
+    // result may point into vb, which must then outlive it.
+    static std::shared_ptr<StagedVertices> stage(const VertexBuffer &vb,
+                                                 VertexLayout layout);
+
+    // The GPU half: the first call replaces the contents, then each call
+    // uploads about budget bytes more. size() counts the vertices
+    // uploaded so far. Returns true once all are.
+    bool upload(StagedVertices &staged, size_t budget);
+
+    VertexLayout layout() const { return m_layout; }
+
+    // Start over with no vertices, the attribute layout of vb and room
+    // for capacity vertices
+    void reserve(const VertexBuffer &layout, size_t capacity);
+
+    // Append vertices [first, first + count) of vb, which must have the
+    // layout given to reserve(). The buffer grows as needed.
+    void append(const VertexBuffer &vb, size_t first, size_t count);
+
+    // Uploads ranges of src again, src being what was last given to
+    // load() and since changed in place (see VertexBuffer::invalidate()).
+    // Separate buffers write just the attribute, interleaved ones whole
+    // vertices. Returns false if src no longer matches, load() it then.
+    bool update(const VertexBuffer &src,
+                const std::vector<VertexRange> &ranges);
+
+    // See ArrayBuffer::setUsage(), applies from the next load()/reserve()
+    void setUsage(GLenum usage);
+
+    // Bytes per vertex, over all attributes
+    size_t byte_stride() const { return m_byte_stride; }
+
+    bool separate() const { return m_separate; }
+
     bool bind();
 
     void ptr(GLuint index, VertexAttribute va) const;
 
+    // Binds this buffer's vertex array object, in which attribute index i
+    // is fed from locations[i] (disabled if absent) and elements, if
+    // given, is the index buffer. It is set up again only when a buffer
+    // is replaced or the layout changes. Returns false if nothing is
+    // loaded.
+    bool bindArray(std::initializer_list<VertexAttribute> locations,
+                   const ArrayBuffer *elements = nullptr);
+
+    GLuint vertexArray() const { return m_vao; }
+
     size_t size() const override;
 
     const float *get_attributes(VertexAttribute va) const override;
@@ -56,10 +226,28 @@ struct VertexAttribBuffer : public VertexBuffer {
     size_t get_elements(VertexAttribute va) const override;
 
 private:
+    static void plan(const VertexBuffer &vb, size_t vertices,
+                     VertexLayout layout, StagedVertices &sv);
+
+    void adopt(const StagedVertices &sv);
+
+    ArrayBuffer &stream(size_t index);
+
+    void writeStream(size_t index, const VertexBuffer &src, size_t first,
+                     size_t count, size_t at);
+
+    const VertexLayout m_layout;
+    GLenum m_usage{GL_STATIC_DRAW};
+    bool m_separate{false};
     ArrayBuffer m_buf{GL_ARRAY_BUFFER};
+    std::vector<std::unique_ptr<ArrayBuffer>> m_streams;  // If m_separate
     size_t m_count{0};
     size_t m_byte_stride{0};
-    std::vector<std::tuple<size_t, size_t>> m_ose;  // <offset, elements>
+    std::vector<std::tuple<size_t, size_t>> m_ose;  // <byte offset, elements>
+    std::vector<uint8_t> m_staging;
+
+    GLuint m_vao{0};
+    std::vector<uint64_t> m_vao_key;  // What m_vao was set up for
 };
 
 }  // namespace g3d
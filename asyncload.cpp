@@ -0,0 +1,393 @@
+#include "asyncload.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+
+#include "arraybuffer.hpp"
+#include "opengl.hpp"
+#include "transform.hpp"
+
+namespace g3d {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+Clock::time_point upload_deadline = Clock::time_point::max();
+
+// Workers for StagedUpload, started on first use. Half the cores, so
+// loaders and the render thread keep some.
+struct StagingPool {
+    ~StagingPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_all();
+        for(auto &t : m_threads)
+            t.join();
+    }
+
+    void post(std::function<void()> job)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.push_back(std::move(job));
+        const size_t max =
+            std::max(1u, std::thread::hardware_concurrency() / 2);
+        if(m_threads.size() < std::min(max, m_jobs.size() + m_busy))
+            m_threads.emplace_back([this] { work(); });
+        m_cond.notify_one();
+    }
+
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while(1) {
+            m_cond.wait(lock, [&] { return m_stop || !m_jobs.empty(); });
+            if(m_stop)
+                return;
+            auto job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+            m_busy++;
+            lock.unlock();
+            job();
+            lock.lock();
+            m_busy--;
+        }
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<std::function<void()>> m_jobs;
+    std::vector<std::thread> m_threads;
+    size_t m_busy{0};
+    bool m_stop{false};
+};
+
+StagingPool &
+stagingPool()
+{
+    static StagingPool pool;
+    return pool;
+}
+
+uint64_t next_ticket = 1;
+uint64_t last_served;  // Ticket given the extra slice last
+bool served;           // The extra slice is taken this frame
+bool refused;          // Some uploader was turned away this frame
+
+}  // namespace
+
+void
+UploadClock::beginFrame(double budget_ms)
+{
+    // Only tickets at or below the last one served asked, start over
+    if(refused && !served)
+        last_served = 0;
+    served = false;
+    refused = false;
+
+    upload_deadline =
+        Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                           std::chrono::duration<double, std::milli>(
+                               budget_ms));
+}
+
+bool
+UploadClock::available()
+{
+    return Clock::now() < upload_deadline;
+}
+
+uint64_t
+UploadClock::ticket()
+{
+    return next_ticket++;
+}
+
+bool
+UploadClock::claim(uint64_t ticket)
+{
+    if(available())
+        return true;
+    if(!served && ticket > last_served) {
+        served = true;
+        last_served = ticket;
+        return true;
+    }
+    refused = true;
+    return false;
+}
+
+AsyncLoad::~AsyncLoad()
+{
+    cancel();
+    if(m_thread.joinable())
+        m_thread.join();
+}
+
+void
+AsyncLoad::push(LoadChunk &&chunk)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cond.wait(lock, [&] {
+        return m_cancelled || m_queue.size() < m_max_queued;
+    });
+    if(m_cancelled)
+        throw Cancelled{};
+    m_queue.push_back(std::move(chunk));
+}
+
+std::optional<LoadChunk>
+AsyncLoad::pop()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_queue.empty())
+        return std::nullopt;
+    LoadChunk c = std::move(m_queue.front());
+    m_queue.pop_front();
+    m_cond.notify_all();
+    return c;
+}
+
+void
+AsyncLoad::cancel()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_cancelled = true;
+    m_queue.clear();
+    m_cond.notify_all();
+}
+
+bool
+AsyncLoad::finished()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_cancelled || (m_producer_done && m_queue.empty());
+}
+
+std::optional<std::string>
+AsyncLoad::error()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_error;
+}
+
+bool
+AsyncUpload::update(VertexAttribBuffer &vab, ArrayBuffer *ib, size_t budget)
+{
+    if(ib && ib->capacity() == 0) {
+        // Allocate up front so the index buffer binds (and draws nothing)
+        // before the first triangles arrive
+        ib->reserve(65536 * sizeof(glm::ivec3));
+    }
+
+    for(bool first = true;
+        budget > 0 && (first ? UploadClock::claim(m_ticket)
+                             : UploadClock::available());
+        first = false) {
+        if(!m_chunk) {
+            m_chunk = m_load->pop();
+            if(!m_chunk)
+                break;
+            m_chunk_vertices = 0;
+            m_chunk_triangles = 0;
+            if(m_chunk->m_vb) {
+                glm::vec3 lo, hi;
+                positionBounds(
+                    m_chunk->m_vb->get_attributes(VertexAttribute::Position),
+                    m_chunk->m_vb->get_stride(VertexAttribute::Position),
+                    m_chunk->m_vb->size(), lo, hi);
+                m_lo = glm::min(m_lo, lo);
+                m_hi = glm::max(m_hi, hi);
+            }
+            if(m_keep) {
+                if(m_chunk->m_vb)
+                    m_kept_vb.push_back(m_chunk->m_vb);
+                m_kept_ib.insert(m_kept_ib.end(),
+                                 m_chunk->m_triangles.begin(),
+                                 m_chunk->m_triangles.end());
+            }
+        }
+
+        const LoadChunk &c = *m_chunk;
+
+        if(c.m_vb && m_chunk_vertices < c.m_vb->size()) {
+            if(m_vertices == 0) {
+                vab.reserve(*c.m_vb,
+                            std::max(m_load->expectedVertices(),
+                                     c.m_vb->size()));
+            }
+            const size_t stride = vab.byte_stride();
+            const size_t n =
+                std::min(c.m_vb->size() - m_chunk_vertices,
+                         std::max<size_t>(1, budget / stride));
+            vab.append(*c.m_vb, m_chunk_vertices, n);
+            m_chunk_vertices += n;
+            m_vertices += n;
+            budget -= std::min(budget, n * stride);
+            continue;
+        }
+
+        if(ib && m_chunk_triangles < c.m_triangles.size()) {
+            const size_t stride = sizeof(glm::ivec3);
+            const size_t n =
+                std::min(c.m_triangles.size() - m_chunk_triangles,
+                         std::max<size_t>(1, budget / stride));
+            const size_t used = m_triangles * stride;
+            const size_t needed = used + n * stride;
+            if(needed > ib->capacity())
+                ib->reserve(std::max(needed, ib->capacity() * 2), used);
+            ib->write(used, c.m_triangles.data() + m_chunk_triangles,
+                      n * stride);
+            m_chunk_triangles += n;
+            m_triangles += n;
+            budget -= std::min(budget, n * stride);
+            continue;
+        }
+
+        m_chunk.reset();
+    }
+
+    if(m_chunk || !m_load->finished())
+        return true;
+
+    if(m_keep && !m_kept_vb.empty())
+        merge();
+    return false;
+}
+
+void
+AsyncUpload::merge()
+{
+    const VertexBuffer &layout = *m_kept_vb[0];
+
+    size_t count = 0;
+    for(const auto &vb : m_kept_vb)
+        count += vb->size();
+
+    size_t stride = 0;
+    std::vector<VertexAttribView> views;
+    for(size_t i = 0; i < 32; i++) {
+        const auto va = (VertexAttribute)i;
+        const size_t elements = layout.get_elements(va);
+        if(elements == 0)
+            continue;
+        views.push_back(VertexAttribView{va, (const float *)stride, 0,
+                                         elements});
+        stride += elements;
+    }
+
+    auto buf = std::make_shared<std::vector<float>>(count * stride);
+    for(auto &v : views) {
+        const size_t offset = (size_t)v.data;
+        float *dst = buf->data() + offset;
+        for(const auto &vb : m_kept_vb) {
+            const float *src = vb->get_attributes(v.va);
+            const size_t src_stride = vb->get_stride(v.va);
+            for(size_t j = 0; j < vb->size(); j++) {
+                std::copy_n(src + j * src_stride, v.elements, dst);
+                dst += stride;
+            }
+        }
+        v.data = buf->data() + offset;
+        v.stride = stride;
+    }
+
+    m_vb = VertexBuffer::make(count, views, buf);
+    m_vb->set_formats(layout.get_formats());
+    m_ib = std::make_shared<std::vector<glm::ivec3>>(std::move(m_kept_ib));
+    m_kept_vb.clear();
+}
+
+// Shared with the worker, which may outlive the StagedUpload
+struct StagedUpload::Packing {
+    std::mutex m_mutex;
+    bool m_done{false};
+    std::shared_ptr<StagedVertices> m_result;
+    std::exception_ptr m_error;
+    std::atomic<bool> m_cancelled{false};
+};
+
+StagedUpload::StagedUpload(const std::shared_ptr<VertexBuffer> &vb,
+                           const std::shared_ptr<std::vector<glm::ivec3>> &ib,
+                           VertexLayout layout)
+  : m_vb(vb), m_ib(ib), m_packing(std::make_shared<Packing>())
+{
+    stagingPool().post([p = m_packing, vb, layout] {
+        if(p->m_cancelled)
+            return;
+        std::shared_ptr<StagedVertices> sv;
+        std::exception_ptr error;
+        try {
+            sv = VertexAttribBuffer::stage(*vb, layout);
+        } catch(...) {
+            error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(p->m_mutex);
+        p->m_result = std::move(sv);
+        p->m_error = error;
+        p->m_done = true;
+    });
+}
+
+StagedUpload::~StagedUpload()
+{
+    m_packing->m_cancelled = true;
+}
+
+bool
+StagedUpload::update(VertexAttribBuffer &vab, ArrayBuffer *ib)
+{
+    if(!m_staged) {
+        std::lock_guard<std::mutex> lock(m_packing->m_mutex);
+        if(!m_packing->m_done)
+            return true;
+        if(m_packing->m_error)
+            std::rethrow_exception(m_packing->m_error);
+        m_staged = std::move(m_packing->m_result);
+    }
+
+    const size_t stride = sizeof(glm::ivec3);
+    for(bool first = true; first ? UploadClock::claim(m_ticket)
+                                 : UploadClock::available();
+        first = false) {
+        if(!m_vertices_done) {
+            m_vertices_done =
+                vab.upload(*m_staged, UploadClock::SLICE_BYTES);
+            continue;
+        }
+        if(!ib || !m_ib)
+            return false;
+
+        if(m_triangles == 0)
+            ib->reserve(std::max<size_t>(1, m_ib->size()) * stride);
+        const size_t n = std::min(m_ib->size() - m_triangles,
+                                  UploadClock::SLICE_BYTES / stride);
+        ib->write(m_triangles * stride, m_ib->data() + m_triangles,
+                  n * stride);
+        m_triangles += n;
+        if(m_triangles == m_ib->size())
+            return false;
+    }
+    return true;
+}
+
+void
+AsyncUpload::ui()
+{
+    if(!m_load->finished()) {
+        ImGui::ProgressBar(m_load->progress(), ImVec2(-80, 0));
+        ImGui::SameLine();
+        if(ImGui::Button("Cancel"))
+            m_load->cancel();
+    } else if(auto err = m_load->error()) {
+        ImGui::Text("Loading failed: %s", err->c_str());
+    } else if(m_load->cancelled()) {
+        ImGui::Text("Loading cancelled");
+    }
+}
+
+}  // namespace g3d
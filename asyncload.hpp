@@ -0,0 +1,209 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "vertexbuffer.hpp"
+
+namespace g3d {
+
+struct VertexAttribBuffer;
+struct ArrayBuffer;
+struct StagedVertices;
+enum class VertexLayout;
+
+// Render thread time for uploads, shared by everything drawn in a frame.
+// Scenes call beginFrame() before drawing; without it there is no limit.
+// Uploaders work in slices of about SLICE_BYTES. Once the time is used up
+// one more slice is allowed per frame, given to the uploaders in turn, so
+// each makes progress without many of them overrunning the budget.
+struct UploadClock {
+    static constexpr size_t SLICE_BYTES = 4 * 1024 * 1024;
+
+    static void beginFrame(double budget_ms);
+
+    // True while this frame has upload time left
+    static bool available();
+
+    // Identifies an uploader to claim()
+    static uint64_t ticket();
+
+    // For an uploader's first slice in a frame: available(), or else the
+    // frame's extra slice if it is this uploader's turn
+    static bool claim(uint64_t ticket);
+};
+
+struct LoadChunk {
+    // Vertices following those of all previous chunks, may be null
+    std::shared_ptr<VertexBuffer> m_vb;
+
+    // May reference any vertex delivered so far, including in this chunk
+    std::vector<glm::ivec3> m_triangles;
+};
+
+// A loader running on its own thread, handing over chunks through a
+// short queue. The loader blocks when the queue is full so memory use
+// stays bounded no matter how large the file is.
+struct AsyncLoad {
+    AsyncLoad(const AsyncLoad &) = delete;
+    AsyncLoad &operator=(const AsyncLoad &) = delete;
+
+    AsyncLoad(const char *name, size_t max_queued = 4)
+      : m_name(name), m_max_queued(max_queued)
+    {
+    }
+
+    // Cancels and waits for the loader thread
+    ~AsyncLoad();
+
+    // Runs fn(*this) on the loader thread
+    template <typename F>
+    void start(F &&fn)
+    {
+        m_thread = std::thread([this, fn = std::forward<F>(fn)]() {
+            try {
+                fn(*this);
+            } catch(const Cancelled &) {
+            } catch(const std::exception &e) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_error = e.what();
+            }
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_producer_done = true;
+            m_cond.notify_all();
+        });
+    }
+
+    // Loader side
+
+    struct Cancelled {};
+
+    // Blocks while the queue is full. Throws Cancelled if cancel() has
+    // been called, which start() takes care of.
+    void push(LoadChunk &&chunk);
+
+    void setExpectedVertices(size_t count) { m_expected_vertices = count; }
+
+    void setProgress(float progress) { m_progress = progress; }
+
+    // Consumer side
+
+    std::optional<LoadChunk> pop();
+
+    void cancel();
+
+    // All chunks have been popped, or the load failed or was cancelled
+    bool finished();
+
+    bool cancelled() const { return m_cancelled; }
+
+    std::optional<std::string> error();
+
+    size_t expectedVertices() const { return m_expected_vertices; }
+
+    float progress() const { return m_progress; }
+
+    const std::string m_name;
+
+private:
+    const size_t m_max_queued;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<LoadChunk> m_queue;
+    bool m_producer_done{false};
+    std::optional<std::string> m_error;
+
+    std::atomic<bool> m_cancelled{false};
+    std::atomic<size_t> m_expected_vertices{0};
+    std::atomic<float> m_progress{0};
+
+    std::thread m_thread;
+};
+
+// Render thread side of an AsyncLoad. Moves chunks into GPU buffers,
+// splitting them as needed to stay within a per call byte budget.
+struct AsyncUpload {
+    AsyncUpload(const std::shared_ptr<AsyncLoad> &load, bool keep)
+      : m_load(load), m_keep(keep)
+    {
+    }
+
+    // Triangles go to ib, and are dropped if it is NULL. Returns false
+    // once there is nothing more to upload.
+    bool update(VertexAttribBuffer &vab, ArrayBuffer *ib, size_t budget);
+
+    // Progress bar and cancel button
+    void ui();
+
+    size_t m_vertices{0};   // Uploaded so far
+    size_t m_triangles{0};  // Uploaded so far
+
+    // Bounds of the vertices received so far, final once update() returns
+    // false
+    glm::vec3 m_lo{INFINITY};
+    glm::vec3 m_hi{-INFINITY};
+
+    // With keep set, everything loaded is merged here once done so
+    // interactive objects can build their intersector
+    std::shared_ptr<VertexBuffer> m_vb;
+    std::shared_ptr<std::vector<glm::ivec3>> m_ib;
+
+private:
+    void merge();
+
+    std::shared_ptr<AsyncLoad> m_load;
+    const bool m_keep;
+
+    std::optional<LoadChunk> m_chunk;
+    size_t m_chunk_vertices{0};   // Uploaded from m_chunk
+    size_t m_chunk_triangles{0};  // Uploaded from m_chunk
+
+    std::vector<std::shared_ptr<VertexBuffer>> m_kept_vb;
+    std::vector<glm::ivec3> m_kept_ib;
+
+    const uint64_t m_ticket{UploadClock::ticket()};
+};
+
+// Uploads a whole VertexBuffer, and optionally its triangles, without
+// stalling the render thread: VertexAttribBuffer::stage() runs on a small
+// pool of workers shared by all staged uploads, and update() uploads the
+// result a slice at a time for as long as UploadClock allows.
+struct StagedUpload {
+    StagedUpload(const std::shared_ptr<VertexBuffer> &vb,
+                 const std::shared_ptr<std::vector<glm::ivec3>> &ib,
+                 VertexLayout layout);
+
+    // Does not wait. Packing not yet started is skipped, packing under
+    // way finishes on its worker and is thrown away.
+    ~StagedUpload();
+
+    // Triangles go to ib once all vertices are uploaded. Returns false
+    // once everything is. Rethrows errors from staging.
+    bool update(VertexAttribBuffer &vab, ArrayBuffer *ib);
+
+    const std::shared_ptr<VertexBuffer> m_vb;
+    const std::shared_ptr<std::vector<glm::ivec3>> m_ib;
+
+    struct Packing;
+
+private:
+    std::shared_ptr<Packing> m_packing;
+    std::shared_ptr<StagedVertices> m_staged;
+    bool m_vertices_done{false};
+    size_t m_triangles{0};  // Uploaded so far
+
+    const uint64_t m_ticket{UploadClock::ticket()};
+};
+
+}  // namespace g3d
@@ -9,6 +9,7 @@
 #include <atomic>
 #include <mutex>
 #include <condition_variable>
+#include <stdexcept>
 
 #include "vertexbuffer.hpp"
 #include "bvh.hpp"
@@ -21,7 +22,8 @@ struct ThreadedIntersector : public Intersector {
     std::thread m_thread;
 
     bool m_run{true};
-    std::atomic<int> m_start{-1};
+    std::atomic<int> m_start{-1};  // Root node, -1 while building or empty
+    bool m_done{false};
 
     std::mutex m_mutex;
     std::condition_variable m_cond;
@@ -29,23 +31,31 @@ struct ThreadedIntersector : public Intersector {
     ~ThreadedIntersector()
     {
         m_run = false;
-        m_thread.join();
+        if(m_thread.joinable())
+            m_thread.join();
     }
 
     void wait() override
     {
         std::unique_lock lock(m_mutex);
-        while(m_start.load() == -1) {
+        while(!m_done) {
             m_cond.wait(lock);
         }
     }
 
-    void init(int rootnode)
+    BvhBlob flattened() const override { return m_blob; }
+
+    void init(int rootnode, const BvhBlob &blob)
     {
+        m_blob = blob;
         std::unique_lock lock(m_mutex);
         m_start = rootnode;
+        m_done = true;
         m_cond.notify_all();
     }
+
+    BvhBlob m_blob{nullptr, 0, -1, 0};
+    std::shared_ptr<const void> m_owner;
 };
 
 struct Ray {
@@ -150,7 +160,7 @@ public:
             return;
         }
 
-        const auto& n = m_nodes[index];
+        const auto& n = m_node_data[index];
 
         if(n.left_box.hit(origin, invD)) {
             hit(ray, rec, n.left, origin, invD);
@@ -160,7 +170,38 @@ public:
         }
     }
 
+    BvhBlob finish(int root)
+    {
+        m_node_data = m_nodes.data();
+        return BvhBlob{m_nodes.data(), m_nodes.size() * sizeof(BvhNode), root,
+                       sizeof(BvhNode), T::KIND};
+    }
+
+    // Children come before their parent, as build() makes them, so a
+    // tree from a file can neither index out of bounds nor loop
+    void adopt(const BvhBlob& blob)
+    {
+        if(blob.kind != T::KIND)
+            throw std::runtime_error{"BVH kind mismatch"};
+        if(blob.node_size != sizeof(BvhNode))
+            throw std::runtime_error{"BVH node layout mismatch"};
+
+        const auto* nodes = (const BvhNode*)blob.nodes;
+        const int64_t count = blob.size / sizeof(BvhNode);
+        const int64_t primitives = this->primitives();
+        if(blob.root < -1 || blob.root >= count)
+            throw std::runtime_error{"Corrupt BVH"};
+        for(int64_t i = 0; i < count; i++) {
+            for(const int64_t c : {nodes[i].left, nodes[i].right}) {
+                if(c >= i || -c - 1 >= primitives)
+                    throw std::runtime_error{"Corrupt BVH"};
+            }
+        }
+        m_node_data = nodes;
+    }
+
     std::vector<BvhNode> m_nodes;
+    const BvhNode* m_node_data{nullptr};
 };
 
 class Points {
@@ -168,8 +209,12 @@ class Points {
     float m_radii_sq{m_radii * m_radii};
 
 protected:
+    static constexpr BvhKind KIND = BvhKind::Points;
+
     int push(int primitive) { return primitive; }
 
+    size_t primitives() const { return m_vb->size(); }
+
     void hit_primitive(int primitive, const Ray& ray, HitRecord& rec) const
     {
         float distance;
@@ -209,20 +254,40 @@ public:
 struct PointIntersector : public ThreadedIntersector {
     BVH<Points> m_bvh;
 
+    PointIntersector(const std::shared_ptr<VertexBuffer>& vb,
+                     const BvhBlob& blob,
+                     const std::shared_ptr<const void>& owner)
+    {
+        m_bvh.m_vb = vb;
+        m_bvh.adopt(blob);
+        m_owner = owner;
+        init(blob.root, blob);
+    }
+
     PointIntersector(const std::shared_ptr<VertexBuffer>& vb)
     {
         m_bvh.m_vb = vb;
-        if(vb->size() == 0)
+        if(vb->size() == 0) {
+            init(-1, m_bvh.finish(-1));
             return;
+        }
         m_thread = std::thread([&]() {
+            // Invalid (NaN) points, as in organized clouds, are left out
             std::vector<int> primitives;
             size_t size = m_bvh.m_vb->size();
             primitives.reserve(size);
             for(size_t i = 0; i < size; i++) {
-                primitives.push_back(i);
+                const glm::vec3 p = m_bvh.point(i);
+                if(!std::isnan(p.x) && !std::isnan(p.y) && !std::isnan(p.z))
+                    primitives.push_back(i);
+            }
+            if(primitives.empty()) {
+                init(-1, m_bvh.finish(-1));
+                return;
             }
 
-            init(m_bvh.build(primitives, 2, &m_run));
+            const int root = m_bvh.build(primitives, 2, &m_run);
+            init(root, m_bvh.finish(root));
         });
     }
 
@@ -244,8 +309,12 @@ struct PointIntersector : public ThreadedIntersector {
 
 class Triangles {
 protected:
+    static constexpr BvhKind KIND = BvhKind::Triangles;
+
     int push(int primitive) { return primitive; }
 
+    size_t primitives() const { return m_ib->size(); }
+
     void hit_primitive(int primitive, const Ray& ray, HitRecord& rec) const
     {
         float distance;
@@ -310,13 +379,27 @@ public:
 struct TriangleIntersector : public ThreadedIntersector {
     BVH<Triangles> m_bvh;
 
+    TriangleIntersector(const std::shared_ptr<VertexBuffer>& vb,
+                        const std::shared_ptr<std::vector<glm::ivec3>>& ib,
+                        const BvhBlob& blob,
+                        const std::shared_ptr<const void>& owner)
+    {
+        m_bvh.m_vb = vb;
+        m_bvh.m_ib = ib;
+        m_bvh.adopt(blob);
+        m_owner = owner;
+        init(blob.root, blob);
+    }
+
     TriangleIntersector(const std::shared_ptr<VertexBuffer>& vb,
                         const std::shared_ptr<std::vector<glm::ivec3>>& ib)
     {
         m_bvh.m_vb = vb;
         m_bvh.m_ib = ib;
-        if(vb->size() == 0 || ib->size() == 0)
+        if(vb->size() == 0 || ib->size() == 0) {
+            init(-1, m_bvh.finish(-1));
             return;
+        }
         m_thread = std::thread([&]() {
             std::vector<int> primitives;
             size_t size = m_bvh.m_ib->size();
@@ -324,7 +407,8 @@ struct TriangleIntersector : public ThreadedIntersector {
             for(size_t i = 0; i < size; i++) {
                 primitives.push_back(i);
             }
-            init(m_bvh.build(primitives, 2, &m_run));
+            const int root = m_bvh.build(primitives, 2, &m_run);
+            init(root, m_bvh.finish(root));
         });
     }
 
@@ -348,6 +432,13 @@ std::shared_ptr<Intersector>
 Intersector::make(const std::shared_ptr<VertexBuffer>& vb,
                   IntersectionMode mode)
 {
+    if(const BvhBlob* blob = vb->get_bvh()) {
+        try {
+            return std::make_shared<PointIntersector>(vb, *blob, nullptr);
+        } catch(const std::runtime_error&) {
+            // Of triangles, or corrupt, so build our own
+        }
+    }
     return std::make_shared<PointIntersector>(vb);
 }
 
@@ -355,7 +446,32 @@ std::shared_ptr<Intersector>
 Intersector::make(const std::shared_ptr<VertexBuffer>& vb,
                   const std::shared_ptr<std::vector<glm::ivec3>>& ib)
 {
+    if(const BvhBlob* blob = vb->get_bvh()) {
+        try {
+            return std::make_shared<TriangleIntersector>(vb, ib, *blob,
+                                                         nullptr);
+        } catch(const std::runtime_error&) {
+            // Of points, or corrupt, so build our own
+        }
+    }
     return std::make_shared<TriangleIntersector>(vb, ib);
 }
 
+std::shared_ptr<Intersector>
+Intersector::make(const std::shared_ptr<VertexBuffer>& vb,
+                  IntersectionMode mode, const BvhBlob& blob,
+                  const std::shared_ptr<const void>& owner)
+{
+    return std::make_shared<PointIntersector>(vb, blob, owner);
+}
+
+std::shared_ptr<Intersector>
+Intersector::make(const std::shared_ptr<VertexBuffer>& vb,
+                  const std::shared_ptr<std::vector<glm::ivec3>>& ib,
+                  const BvhBlob& blob,
+                  const std::shared_ptr<const void>& owner)
+{
+    return std::make_shared<TriangleIntersector>(vb, ib, blob, owner);
+}
+
 }  // namespace g3d
@@ -10,6 +10,19 @@ namespace g3d {
 
 enum class IntersectionMode { POINT };
 
+// What the primitives of a BVH are, so a tree is only reused for its own
+enum class BvhKind : uint32_t { None, Points, Triangles };
+
+// Flattened tree as produced by a finished Intersector, for serialization.
+// Root is -1 for an empty tree.
+struct BvhBlob {
+    const void *nodes;
+    size_t size;  // In bytes
+    int root;
+    uint32_t node_size;
+    BvhKind kind{BvhKind::None};
+};
+
 struct Intersector {
     virtual ~Intersector(){};
 
@@ -18,12 +31,30 @@ struct Intersector {
 
     virtual void wait() = 0;
 
+    // Only valid after wait() has returned
+    virtual BvhBlob flattened() const = 0;
+
     static std::shared_ptr<Intersector> make(
         const std::shared_ptr<VertexBuffer> &vb, IntersectionMode mode);
 
     static std::shared_ptr<Intersector> make(
         const std::shared_ptr<VertexBuffer> &vb,
         const std::shared_ptr<std::vector<glm::ivec3>> &ib);
+
+    // The two above reuse vb->get_bvh() if it is of the right kind and
+    // valid, else build a new tree.
+
+    // Reuse a tree from flattened() instead of building a new one. The
+    // nodes are referenced in place and owner is kept alive with them.
+    // Throws std::runtime_error if it is of the wrong kind or corrupt.
+    static std::shared_ptr<Intersector> make(
+        const std::shared_ptr<VertexBuffer> &vb, IntersectionMode mode,
+        const BvhBlob &blob, const std::shared_ptr<const void> &owner);
+
+    static std::shared_ptr<Intersector> make(
+        const std::shared_ptr<VertexBuffer> &vb,
+        const std::shared_ptr<std::vector<glm::ivec3>> &ib,
+        const BvhBlob &blob, const std::shared_ptr<const void> &owner);
 };
 
 }  // namespace g3d
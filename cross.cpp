@@ -5,11 +5,9 @@
 #include "camera.hpp"
 
 static const char *cross_vertex_shader = R"glsl(
-#version 330 core
 layout (location = 0) in vec3 vtx;
 layout (location = 1) in vec4 col;
 
-uniform mat4 PV;
 uniform mat4 model;
 
 out vec4 fragmentColor;
@@ -25,8 +23,6 @@ void main()
 
 static const char *cross_fragment_shader = R"glsl(
 
-#version 330 core
-
 out vec4 FragColor;
 in vec4 fragmentColor;
 
@@ -54,12 +50,14 @@ struct Cross : public Object {
               const glm::mat4 &pt) override
     {
         if(!s_shader) {
-            s_shader = new Shader("cross", NULL, cross_vertex_shader, -1,
+            s_shader = new Shader("cross",
+                                  "#version 330 core\n" FRAME_UNIFORMS_GLSL,
+                                  cross_vertex_shader, -1,
                                   cross_fragment_shader, -1);
         }
 
         s_shader->use();
-        s_shader->setMat4("PV", cam.m_P * cam.m_V);
+        DrawState::bindVertexArray(0);
         s_shader->setMat4("model", pt * m_model_matrix);
 
         glEnableVertexAttribArray(0);
@@ -0,0 +1,182 @@
+#include "depth.hpp"
+
+#include <math.h>
+#include <string.h>
+
+#include <stdexcept>
+
+#include "parallel.hpp"
+#include "transform.hpp"
+
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+
+namespace g3d {
+
+namespace {
+
+constexpr size_t POOL_SIZE = 3;
+
+#ifdef __AVX2__
+
+inline __m256
+load8(const uint16_t *d)
+{
+    return _mm256_cvtepi32_ps(
+        _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)d)));
+}
+
+inline __m256
+load8(const float *d)
+{
+    return _mm256_loadu_ps(d);
+}
+
+#endif
+
+// One row of depth to xyz
+template <typename T>
+void
+unprojectRow(const T *d, size_t w, float scale, const float *kx, float ky,
+             float *out)
+{
+    size_t x = 0;
+
+#ifdef __AVX2__
+    const __m256 vscale = _mm256_set1_ps(scale);
+    const __m256 vky = _mm256_set1_ps(ky);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 inf = _mm256_set1_ps(INFINITY);
+    const __m256 nan = _mm256_set1_ps(NAN);
+
+    for(; x + 8 <= w; x += 8) {
+        const __m256 z = _mm256_mul_ps(load8(d + x), vscale);
+        const __m256 ok = _mm256_and_ps(_mm256_cmp_ps(z, zero, _CMP_GT_OQ),
+                                        _mm256_cmp_ps(z, inf, _CMP_LT_OQ));
+        const __m256 px = _mm256_mul_ps(z, _mm256_loadu_ps(kx + x));
+        const __m256 py = _mm256_mul_ps(z, vky);
+        storeXYZ(out + x * 3, _mm256_blendv_ps(nan, px, ok),
+                 _mm256_blendv_ps(nan, py, ok), _mm256_blendv_ps(nan, z, ok));
+    }
+#endif
+
+    for(; x < w; x++) {
+        const float z = d[x] * scale;
+        float *p = out + x * 3;
+        if(z > 0 && z < INFINITY) {
+            p[0] = z * kx[x];
+            p[1] = z * ky;
+            p[2] = z;
+        } else {
+            p[0] = p[1] = p[2] = NAN;
+        }
+    }
+}
+
+// One row of RGB8 to normalized RGBA
+void
+colorRow(const uint8_t *rgb, size_t w, float *out)
+{
+    size_t x = 0;
+
+#ifdef __SSE4_1__
+    const __m128 s = _mm_set1_ps(1.0f / 255.0f);
+    const __m128 one = _mm_set1_ps(1.0f);
+
+    // Each load takes four bytes, the last one belonging to the next pixel
+    for(; x + 1 < w; x++) {
+        int32_t v;
+        memcpy(&v, rgb + x * 3, sizeof(v));
+        const __m128 c = _mm_mul_ps(
+            _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v))), s);
+        _mm_storeu_ps(out + x * 4, _mm_blend_ps(c, one, 8));
+    }
+#endif
+
+    for(; x < w; x++) {
+        out[x * 4 + 0] = rgb[x * 3 + 0] / 255.0f;
+        out[x * 4 + 1] = rgb[x * 3 + 1] / 255.0f;
+        out[x * 4 + 2] = rgb[x * 3 + 2] / 255.0f;
+        out[x * 4 + 3] = 1.0f;
+    }
+}
+
+}  // namespace
+
+std::shared_ptr<std::vector<float>>
+DepthUnprojector::buffer(size_t floats)
+{
+    // Only the pool refers to a buffer whose frames have all been dropped
+    for(auto &b : m_pool) {
+        if(b.use_count() == 1) {
+            b->resize(floats);
+            return b;
+        }
+    }
+    auto b = std::make_shared<std::vector<float>>(floats);
+    if(m_pool.size() < POOL_SIZE)
+        m_pool.push_back(b);
+    return b;
+}
+
+std::shared_ptr<VertexBuffer>
+DepthUnprojector::unproject(const Image2D &depth, const DepthCamera &cam,
+                            const Image2D *color)
+{
+    if(depth.m_format != PixelFormat::DEPTH16 &&
+       depth.m_format != PixelFormat::DEPTH32F)
+        throw std::invalid_argument{"Not a depth image"};
+    if(color && (color->m_format != PixelFormat::RGB8 ||
+                 color->m_width != depth.m_width ||
+                 color->m_height != depth.m_height))
+        throw std::invalid_argument{"Color image does not match depth"};
+
+    const size_t w = depth.m_width;
+    const size_t h = depth.m_height;
+    const size_t count = w * h;
+
+    if(m_kx.size() != w || m_fx != cam.fx || m_cx != cam.cx) {
+        m_kx.resize(w);
+        for(size_t x = 0; x < w; x++)
+            m_kx[x] = (x - cam.cx) / cam.fx;
+        m_fx = cam.fx;
+        m_cx = cam.cx;
+    }
+
+    auto buf = buffer(count * (color ? 7 : 3));
+    float *pos = buf->data();
+    float *col = pos + count * 3;
+    const float scale =
+        depth.m_format == PixelFormat::DEPTH16 ? cam.depth_scale : 1.0f;
+
+    parallelFor(
+        h,
+        [&](size_t begin, size_t end, size_t chunk) {
+            for(size_t y = begin; y < end; y++) {
+                const float ky = (y - cam.cy) / cam.fy;
+                if(depth.m_format == PixelFormat::DEPTH16)
+                    unprojectRow((const uint16_t *)depth.m_data + y * w, w,
+                                 scale, m_kx.data(), ky, pos + y * w * 3);
+                else
+                    unprojectRow((const float *)depth.m_data + y * w, w,
+                                 scale, m_kx.data(), ky, pos + y * w * 3);
+                if(color)
+                    colorRow((const uint8_t *)color->m_data + y * w * 3, w,
+                             col + y * w * 4);
+            }
+        },
+        std::max<size_t>(1, 65536 / std::max<size_t>(1, w)));
+
+    std::vector<VertexAttribView> views{
+        {VertexAttribute::Position, pos, 3, 3}};
+    if(color)
+        views.push_back(VertexAttribView{VertexAttribute::Color, col, 4, 4});
+
+    auto vb = VertexBuffer::make(count, views, buf);
+    vb->set_grid(glm::uvec2(w, h));
+    vb->set_format(VertexAttribute::Color, VertexFormat::UNorm8);
+    return vb;
+}
+
+}  // namespace g3d
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "image.hpp"
+#include "vertexbuffer.hpp"
+
+namespace g3d {
+
+// Pinhole camera, in pixels. Points come out in the camera frame: x to
+// the right, y down and z forward along the optical axis.
+struct DepthCamera {
+    float fx, fy;
+    float cx, cy;
+    float depth_scale{0.001f};  // Units per DEPTH16 step, DEPTH32F is as is
+};
+
+// Turns depth frames into organized point clouds (VertexBuffer::get_grid()),
+// with NaN where there is no depth. Rows are split across threads and
+// vectorized with AVX2 when available.
+//
+// Output memory is recycled: a frame reuses the buffer of an earlier one
+// once all references to its VertexBuffer are gone, so a steady stream of
+// frames does not allocate.
+struct DepthUnprojector {
+    // color, if given, is RGB8 of the same size as depth and registered to
+    // it. Throws std::invalid_argument on format or size mismatch.
+    std::shared_ptr<VertexBuffer> unproject(const Image2D &depth,
+                                            const DepthCamera &cam,
+                                            const Image2D *color = nullptr);
+
+private:
+    std::shared_ptr<std::vector<float>> buffer(size_t floats);
+
+    std::vector<std::shared_ptr<std::vector<float>>> m_pool;
+
+    // (x - cx) / fx per column
+    std::vector<float> m_kx;
+    float m_fx{0}, m_cx{0};
+};
+
+}  // namespace g3d
@@ -0,0 +1,121 @@
+#include "drawstate.hpp"
+
+#include "camera.hpp"
+
+namespace g3d {
+
+namespace {
+
+GLuint default_vao;
+GLuint bound_program;
+GLuint bound_vao;
+
+uint64_t frames;
+DrawStats frame;
+DrawStats last_frame;
+
+// As laid out by std140
+struct FrameBlock {
+    glm::mat4 P;
+    glm::mat4 V;
+    glm::mat4 PV;
+    glm::mat4 VI;
+    glm::vec4 lightPos;
+};
+
+GLuint frame_ubo;
+
+}  // namespace
+
+void
+DrawState::beginFrame(GLuint vao)
+{
+    frames++;
+    last_frame = frame;
+    frame = DrawStats{};
+    default_vao = vao;
+    bound_program = 0;
+    bound_vao = 0;
+    bindVertexArray(0);
+}
+
+void
+DrawState::useProgram(GLuint program)
+{
+    if(program == bound_program) {
+        frame.m_skipped++;
+        return;
+    }
+    glUseProgram(program);
+    bound_program = program;
+    frame.m_programs++;
+}
+
+void
+DrawState::bindVertexArray(GLuint vao)
+{
+    if(vao == 0)
+        vao = default_vao;
+    if(vao == bound_vao) {
+        frame.m_skipped++;
+        return;
+    }
+    glBindVertexArray(vao);
+    bound_vao = vao;
+    frame.m_vertex_arrays++;
+}
+
+void
+DrawState::deleteProgram(GLuint program)
+{
+    if(program == bound_program)
+        bound_program = 0;
+    glDeleteProgram(program);
+}
+
+void
+DrawState::deleteVertexArray(GLuint vao)
+{
+    if(vao == bound_vao)
+        bound_vao = 0;
+    glDeleteVertexArrays(1, &vao);
+}
+
+void
+DrawState::countObject(bool culled, bool occluded)
+{
+    if(culled)
+        frame.m_culled++;
+    else if(occluded)
+        frame.m_occluded++;
+    else
+        frame.m_drawn++;
+}
+
+uint64_t
+DrawState::frameNumber()
+{
+    return frames;
+}
+
+DrawStats
+DrawState::lastFrame()
+{
+    return last_frame;
+}
+
+void
+FrameUniforms::update(const Camera &cam,
+                      const std::optional<glm::vec3> &lightpos)
+{
+    const FrameBlock b{cam.m_P, cam.m_V, cam.m_P * cam.m_V, cam.m_VI,
+                       lightpos ? glm::vec4{*lightpos, 1} : glm::vec4{0}};
+
+    if(!frame_ubo)
+        glGenBuffers(1, &frame_ubo);
+    glBindBuffer(GL_UNIFORM_BUFFER, frame_ubo);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(b), &b, GL_STREAM_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UNIFORMS_BINDING, frame_ubo);
+}
+
+}  // namespace g3d
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <GL/glew.h>
+
+#include <stddef.h>
+
+#include <optional>
+
+#include <glm/glm.hpp>
+
+// The per frame uniform block, for inclusion in shader sources after
+// #version. Programs declaring it are bound to FRAME_UNIFORMS_BINDING.
+#define FRAME_UNIFORMS_GLSL             \
+    "layout (std140) uniform Frame {\n" \
+    "    mat4 P;\n"                     \
+    "    mat4 V;\n"                     \
+    "    mat4 PV;\n"                    \
+    "    mat4 VI;\n"                    \
+    "    vec4 lightPos;\n"              \
+    "};\n"
+
+namespace g3d {
+
+struct Camera;
+
+constexpr GLuint FRAME_UNIFORMS_BINDING = 0;
+
+struct DrawStats {
+    size_t m_programs{0};       // glUseProgram() calls made
+    size_t m_vertex_arrays{0};  // glBindVertexArray() calls made
+    size_t m_skipped{0};        // Binds of what was already bound
+    size_t m_drawn{0};          // Objects drawn by drawObjects()
+    size_t m_culled{0};         // Objects outside the frustum
+    size_t m_occluded{0};       // Objects hidden behind occluders
+};
+
+// Program and vertex array bindings of the render thread. Binding through
+// here skips what is already bound and counts the rest, per frame.
+struct DrawState {
+    // Forgets what is bound, as others (ImGui) bind behind our back.
+    // default_vao is what bindVertexArray(0) binds, shared by objects
+    // that set up their attributes as they draw.
+    static void beginFrame(GLuint default_vao);
+
+    static void useProgram(GLuint program);
+
+    static void bindVertexArray(GLuint vao);
+
+    // Call before deleting something that may be bound
+    static void deleteProgram(GLuint program);
+
+    static void deleteVertexArray(GLuint vao);
+
+    static void countObject(bool culled, bool occluded);
+
+    // Counts calls to beginFrame(), for what is cached per frame
+    static uint64_t frameNumber();
+
+    // Of the previous frame
+    static DrawStats lastFrame();
+};
+
+// Fills the Frame uniform block, once per frame instead of every object
+// setting its own camera matrices. lightPos.w is 1 if there is a light.
+struct FrameUniforms {
+    static void update(const Camera &cam,
+                       const std::optional<glm::vec3> &lightpos);
+};
+
+}  // namespace g3d
@@ -5,7 +5,6 @@
 #include "camera.hpp"
 
 static const char *viewport_vertex_shader = R"glsl(
-#version 330 core
 layout (location = 0) in vec2 vtx;
 out vec2 coord;
 
@@ -19,8 +18,6 @@ void main()
 
 static const char *skybox_fragment_shader = R"glsl(
 
-#version 330 core
-
 uniform mat4 PVinv;
 
 out vec4 FragColor;
@@ -55,14 +52,10 @@ void main()
 
 __attribute__((unused)) static const char *ground_fragment_shader = R"glsl(
 
-#version 330 core
-
 uniform mat4 PVinv;
-uniform mat4 PV;
 
 out vec4 FragColor;
 in vec2 coord;
-uniform vec3 cam;
 uniform float scale;
 
 float checkerboard(vec2 p,float size){
@@ -76,6 +69,7 @@ void main()
   vec4 p = PVinv * vec4(coord, 0, 1);
 
   vec3 dir = normalize(p.xyz);
+  vec3 cam = VI[3].xyz;
 
   vec3 ground = vec3(0, 0, -1);
   float t = -(dot(ground, cam) + 0) / dot(ground, dir);
@@ -129,11 +123,13 @@ struct Skybox : public Object {
               const glm::mat4 &pt) override
     {
         if(!s_shader) {
-            s_shader = new Shader("skybox", NULL, viewport_vertex_shader, -1,
+            s_shader = new Shader("skybox", "#version 330 core\n",
+                                  viewport_vertex_shader, -1,
                                   skybox_fragment_shader, -1);
         }
 
         s_shader->use();
+        DrawState::bindVertexArray(0);
 
         auto p = cam.m_P;
         p[2].z = 0;
@@ -165,19 +161,20 @@ struct Ground : public Object {
     void draw(const Scene &s, const Camera &cam, const glm::mat4 &pt) override
     {
         if(!s_shader) {
-            s_shader = new Shader("ground", NULL, viewport_vertex_shader, -1,
+            s_shader = new Shader("ground",
+                                  "#version 330 core\n" FRAME_UNIFORMS_GLSL,
+                                  viewport_vertex_shader, -1,
                                   ground_fragment_shader, -1);
         }
 
         s_shader->use();
+        DrawState::bindVertexArray(0);
 
-        s_shader->setVec3("cam", cam.m_VI[3]);
         auto p = cam.m_P;
         p[2].z = 0;
 
         s_shader->setMat4("PVinv", glm::inverse(p * cam.m_V));
         s_shader->setFloat("scale", 0.5f / m_checkersize);
-        s_shader->setMat4("PV", cam.m_P * cam.m_V);
 
         if(!m_attrib_buf.bind()) {
             m_attrib_buf.write((void *)&attribs[0][0], sizeof(attribs));
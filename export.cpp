@@ -0,0 +1,319 @@
+#include "export.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include "parallel.hpp"
+#include "transform.hpp"
+
+namespace g3d {
+
+namespace {
+
+constexpr size_t SLAB_BYTES = 16 * 1024 * 1024;
+constexpr size_t ALIGNMENT = 4096;
+
+struct Attrib {
+    const float *data;
+    size_t stride;
+    size_t elements;
+};
+
+Attrib
+attrib(const VertexBuffer &vb, VertexAttribute va)
+{
+    const size_t elements = vb.get_elements(va);
+    return Attrib{elements ? vb.get_attributes(va) : nullptr,
+                  vb.get_stride(va), elements};
+}
+
+inline uint8_t
+u8(float v)
+{
+    return v > 0 ? v < 1 ? (uint8_t)(v * 255.0f + 0.5f) : 255 : 0;
+}
+
+// Unbuffered output to path.tmp, renamed to path by commit()
+struct OutputFile {
+    explicit OutputFile(const char *path)
+      : m_path(path), m_tmp(std::string(path) + ".tmp")
+    {
+        m_fd = open(m_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if(m_fd == -1)
+            throw std::system_error(errno, std::system_category(), m_tmp);
+    }
+
+    ~OutputFile()
+    {
+        if(m_fd != -1) {
+            close(m_fd);
+            unlink(m_tmp.c_str());
+        }
+    }
+
+    void write(const void *data, size_t size)
+    {
+        const uint8_t *p = (const uint8_t *)data;
+        while(size) {
+            const ssize_t r = ::write(m_fd, p, size);
+            if(r < 0) {
+                if(errno == EINTR)
+                    continue;
+                throw std::system_error(errno, std::system_category(), m_tmp);
+            }
+            p += r;
+            size -= r;
+        }
+    }
+
+    void commit()
+    {
+        const int fd = m_fd;
+        m_fd = -1;
+        if(close(fd)) {
+            const int err = errno;
+            unlink(m_tmp.c_str());
+            throw std::system_error(err, std::system_category(), m_tmp);
+        }
+        if(rename(m_tmp.c_str(), m_path.c_str()) == -1) {
+            const int err = errno;
+            unlink(m_tmp.c_str());
+            throw std::system_error(err, std::system_category(), m_path);
+        }
+    }
+
+    const std::string m_path;
+    const std::string m_tmp;
+    int m_fd;
+};
+
+// Packs fixed size vertex records, SLAB_BYTES at a time
+struct VertexPacker {
+    VertexPacker(const VertexBuffer &vb, const glm::mat4 &transform,
+                 bool packed_color)
+      : m_pos(attrib(vb, VertexAttribute::Position)),
+        m_normal(attrib(vb, VertexAttribute::Normal)),
+        m_color(attrib(vb, VertexAttribute::Color)),
+        m_aux(attrib(vb, VertexAttribute::Aux)),
+        m_transform(transform),
+        m_normal_matrix(glm::transpose(glm::inverse(glm::mat3(transform)))),
+        m_identity(transform == glm::mat4{1}),
+        m_packed_color(packed_color)
+    {
+        if(m_color.elements > 4)
+            m_color.elements = 4;
+        if(m_normal.elements > 3)
+            m_normal.elements = 3;
+
+        m_record = 12 + m_normal.elements * 4 + m_aux.elements * 4;
+        if(m_color.elements) {
+            m_record +=
+                packed_color ? 4 : std::max<size_t>(3, m_color.elements);
+        }
+
+        m_slab_points = std::max<size_t>(1, SLAB_BYTES / m_record);
+        m_positions.resize(m_slab_points);
+        m_buf.reset((uint8_t *)aligned_alloc(
+            ALIGNMENT, (m_slab_points * m_record + ALIGNMENT - 1) &
+                           ~(ALIGNMENT - 1)));
+        if(!m_buf)
+            throw std::bad_alloc();
+    }
+
+    // Packs [first, first + count) into the slab, returns its size in bytes
+    size_t pack(size_t first, size_t count)
+    {
+        transformPositions(m_transform, m_pos.data + first * m_pos.stride,
+                           m_pos.stride, m_positions.data(), count);
+
+        parallelFor(
+            count,
+            [&](size_t begin, size_t end, size_t) {
+                for(size_t i = begin; i < end; i++)
+                    packOne(first + i, m_positions[i],
+                            m_buf.get() + i * m_record);
+            },
+            16384);
+        return count * m_record;
+    }
+
+    void packOne(size_t i, const glm::vec3 &pos, uint8_t *out) const
+    {
+        memcpy(out, &pos, 12);
+        out += 12;
+
+        if(m_normal.elements) {
+            const float *s = m_normal.data + i * m_normal.stride;
+            glm::vec3 n{0};
+            for(size_t e = 0; e < m_normal.elements; e++)
+                n[e] = s[e];
+            if(!m_identity)
+                n = glm::normalize(m_normal_matrix * n);
+            memcpy(out, &n, m_normal.elements * 4);
+            out += m_normal.elements * 4;
+        }
+
+        if(m_color.elements) {
+            const float *s = m_color.data + i * m_color.stride;
+            uint8_t rgba[4] = {0, 0, 0, 255};
+            for(size_t e = 0; e < m_color.elements; e++)
+                rgba[e] = u8(s[e]);
+            if(m_packed_color) {
+                // PCL layout, 0xAARRGGBB in a little endian uint32
+                const uint8_t bgra[4] = {rgba[2], rgba[1], rgba[0],
+                                         m_color.elements == 4 ? rgba[3]
+                                                               : uint8_t{0}};
+                memcpy(out, bgra, 4);
+                out += 4;
+            } else {
+                const size_t n = std::max<size_t>(3, m_color.elements);
+                memcpy(out, rgba, n);
+                out += n;
+            }
+        }
+
+        if(m_aux.elements)
+            memcpy(out, m_aux.data + i * m_aux.stride, m_aux.elements * 4);
+    }
+
+    void write(OutputFile &out, size_t count)
+    {
+        for(size_t i = 0; i < count; i += m_slab_points) {
+            const size_t n = std::min(m_slab_points, count - i);
+            out.write(m_buf.get(), pack(i, n));
+        }
+    }
+
+    Attrib m_pos, m_normal, m_color, m_aux;
+    const glm::mat4 m_transform;
+    const glm::mat3 m_normal_matrix;
+    const bool m_identity;
+    const bool m_packed_color;
+
+    size_t m_record;
+    size_t m_slab_points;
+    std::vector<glm::vec3> m_positions;
+    std::unique_ptr<uint8_t, decltype(&free)> m_buf{nullptr, free};
+};
+
+}  // namespace
+
+void
+savePCD(const char *path, const VertexBuffer &vb, const glm::mat4 &transform)
+{
+    VertexPacker vp(vb, transform, true);
+
+    std::string fields = "x y z";
+    std::string sizes = "4 4 4";
+    std::string types = "F F F";
+    std::string counts = "1 1 1";
+    auto add = [&](const std::string &name, char size, char type) {
+        fields += " " + name;
+        sizes += std::string(" ") + size;
+        types += std::string(" ") + type;
+        counts += " 1";
+    };
+
+    static const char *normals[3] = {"normal_x", "normal_y", "normal_z"};
+    for(size_t e = 0; e < vp.m_normal.elements; e++)
+        add(normals[e], '4', 'F');
+    if(vp.m_color.elements)
+        add(vp.m_color.elements == 4 ? "rgba" : "rgb", '4', 'U');
+    for(size_t e = 0; e < vp.m_aux.elements; e++)
+        add("aux" + std::to_string(e), '4', 'F');
+
+    const size_t count = vb.size();
+    const bool organized = vb.organized();
+    const size_t width = organized ? vb.get_grid().x : count;
+    const size_t height = organized ? vb.get_grid().y : 1;
+
+    char hdr[1024];
+    const int len = snprintf(hdr, sizeof(hdr),
+                             "# .PCD v0.7 - Point Cloud Data file format\n"
+                             "VERSION 0.7\n"
+                             "FIELDS %s\n"
+                             "SIZE %s\n"
+                             "TYPE %s\n"
+                             "COUNT %s\n"
+                             "WIDTH %zu\n"
+                             "HEIGHT %zu\n"
+                             "VIEWPOINT 0 0 0 1 0 0 0\n"
+                             "POINTS %zu\n"
+                             "DATA binary\n",
+                             fields.c_str(), sizes.c_str(), types.c_str(),
+                             counts.c_str(), width, height, count);
+    if(len < 0 || (size_t)len >= sizeof(hdr))
+        throw std::runtime_error{"PCD header too long"};
+
+    OutputFile out(path);
+    out.write(hdr, len);
+    vp.write(out, count);
+    out.commit();
+}
+
+void
+savePLY(const char *path, const VertexBuffer &vb,
+        const std::vector<glm::ivec3> *triangles, const glm::mat4 &transform)
+{
+    VertexPacker vp(vb, transform, false);
+
+    const size_t count = vb.size();
+    std::string hdr =
+        "ply\n"
+        "format binary_little_endian 1.0\n"
+        "element vertex " + std::to_string(count) + "\n"
+        "property float x\n"
+        "property float y\n"
+        "property float z\n";
+
+    static const char *normals[3] = {"nx", "ny", "nz"};
+    for(size_t e = 0; e < vp.m_normal.elements; e++)
+        hdr += std::string("property float ") + normals[e] + "\n";
+    if(vp.m_color.elements) {
+        hdr += "property uchar red\n"
+               "property uchar green\n"
+               "property uchar blue\n";
+        if(vp.m_color.elements == 4)
+            hdr += "property uchar alpha\n";
+    }
+    for(size_t e = 0; e < vp.m_aux.elements; e++)
+        hdr += "property float aux" + std::to_string(e) + "\n";
+
+    if(triangles) {
+        hdr += "element face " + std::to_string(triangles->size()) + "\n"
+               "property list uchar int vertex_indices\n";
+    }
+    hdr += "end_header\n";
+
+    OutputFile out(path);
+    out.write(hdr.data(), hdr.size());
+    vp.write(out, count);
+
+    if(triangles) {
+        // 13 bytes per face: count, then three int32 indices
+        const size_t slab = SLAB_BYTES / 13;
+        std::vector<uint8_t> buf(std::min(slab, triangles->size()) * 13);
+        for(size_t i = 0; i < triangles->size(); i += slab) {
+            const size_t n = std::min(slab, triangles->size() - i);
+            uint8_t *o = buf.data();
+            for(size_t j = 0; j < n; j++, o += 13) {
+                o[0] = 3;
+                memcpy(o + 1, &(*triangles)[i + j], 12);
+            }
+            out.write(buf.data(), n * 13);
+        }
+    }
+    out.commit();
+}
+
+}  // namespace g3d
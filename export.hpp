@@ -0,0 +1,33 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "vertexbuffer.hpp"
+
+namespace g3d {
+
+// Binary PCD (v0.7) and PLY (binary_little_endian) writers for any
+// VertexBuffer. Position, Normal, Color and Aux are written if present,
+// whatever their stride. Color is stored as 8 bits per channel: a packed
+// rgb / rgba field in PCD, red, green, blue (and alpha) in PLY. Aux
+// elements become float fields aux0, aux1, ...
+//
+// Points are packed in parallel slabs and written with large unbuffered
+// writes. The transform, if any, is applied to positions (and normals) as
+// they are packed. Organized clouds keep their grid in PCD.
+//
+// Files are written to path.tmp and renamed into place once complete.
+// Throws std::system_error on I/O errors.
+
+void savePCD(const char *path, const VertexBuffer &vb,
+             const glm::mat4 &transform = glm::mat4{1});
+
+// Triangles, if given, are written as a face element
+void savePLY(const char *path, const VertexBuffer &vb,
+             const std::vector<glm::ivec3> *triangles = nullptr,
+             const glm::mat4 &transform = glm::mat4{1});
+
+}  // namespace g3d
@@ -4,6 +4,9 @@
 #include "camera.hpp"
 #include "object.hpp"
 #include "image.hpp"
+#include "asyncload.hpp"
+#include "drawstate.hpp"
+#include "occlusion.hpp"
 
 #include <sys/stat.h>
 
@@ -47,6 +50,10 @@ struct GLFWImguiScene : public Scene {
 
     GLuint m_vao;
 
+    // Render thread time per frame for moving data to the GPU
+    double m_upload_budget_ms{4};
+    double m_point_budget_ms{10};
+
     std::shared_ptr<Object> m_crosshair;
     std::shared_ptr<Object> m_skybox;
     std::shared_ptr<Object> m_ground;
@@ -355,6 +362,10 @@ GLFWImguiScene::prepare()
     if(m_camera != NULL) {
         m_camera->update(m_width * m_scene_editor_start, m_height);
 
+        // Rasterizes occluders on worker threads while input and UI are
+        // dealt with below
+        Occlusion::beginFrame(m_camera->m_P * m_camera->m_V);
+
         if(!m_left_grab.m_on && !m_right_grab.m_on) {
             m_hit.distance = INFINITY;
             m_hit.object = nullptr;
@@ -423,6 +434,18 @@ GLFWImguiScene::prepare()
                     ImGui::Text("Distance: %f", glm::distance(*m_p1, *m_p2));
                 }
             }
+
+            if(ImGui::CollapsingHeader("Draw state")) {
+                const DrawStats ds = DrawState::lastFrame();
+                ImGui::Text("Programs bound: %zd", ds.m_programs);
+                ImGui::Text("Vertex arrays bound: %zd", ds.m_vertex_arrays);
+                ImGui::Text("Redundant binds skipped: %zd", ds.m_skipped);
+                ImGui::Text("Objects drawn: %zd, culled: %zd, occluded: %zd",
+                            ds.m_drawn, ds.m_culled, ds.m_occluded);
+                const OcclusionStats os = Occlusion::lastFrame();
+                ImGui::Text("Occluders: %zd, %zd triangles in %.2f ms",
+                            os.m_occluders, os.m_triangles, os.m_ms);
+            }
         }
         ImGui::End();
 
@@ -473,7 +496,8 @@ GLFWImguiScene::draw()
 {
     ImGui::Render();
 
-    glBindVertexArray(m_vao);
+    DrawState::beginFrame(m_vao);
+    FrameUniforms::update(*m_camera, m_lightpos);
 
     int display_w, display_h;
     glfwGetFramebufferSize(m_window, &display_w, &display_h);
@@ -485,31 +509,30 @@ GLFWImguiScene::draw()
     glDisable(GL_DEPTH_TEST);
     glDisable(GL_BLEND);
 
+    UploadClock::beginFrame(m_upload_budget_ms);
+    PointBudget::beginFrame(m_point_budget_ms);
+
     if(m_skybox && m_skybox->m_visible)
-        m_skybox->draw(*this, *m_camera, glm::mat4{1});
+        drawObject(*m_skybox, *this, *m_camera, glm::mat4{1});
 
     glEnable(GL_DEPTH_TEST);
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-    for(auto &o : m_objects) {
-        if(o->m_visible) {
-            o->draw(*this, *m_camera, glm::mat4{1});
-        }
-    }
+    drawObjects(m_objects, *this, *m_camera, glm::mat4{1});
 
     if(m_ground && m_ground->m_visible)
-        m_ground->draw(*this, *m_camera, glm::mat4{1});
+        drawObject(*m_ground, *this, *m_camera, glm::mat4{1});
 
     glDisable(GL_DEPTH_TEST);
     glDisable(GL_BLEND);
     if(m_crosshair->m_visible)
-        m_crosshair->draw(*this, *m_camera, glm::mat4{1});
+        drawObject(*m_crosshair, *this, *m_camera, glm::mat4{1});
 
     if(m_p1_crosshair)
-        m_p1_crosshair->draw(*this, *m_camera, glm::mat4{1});
+        drawObject(*m_p1_crosshair, *this, *m_camera, glm::mat4{1});
     if(m_p2_crosshair)
-        m_p2_crosshair->draw(*this, *m_camera, glm::mat4{1});
+        drawObject(*m_p2_crosshair, *this, *m_camera, glm::mat4{1});
 
     ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 
@@ -12,8 +12,6 @@ layout (location = 2) in vec4 aCol;
 layout (location = 3) in vec2 aUV0;
 #endif
 
-uniform mat4 PVM;
-
 uniform mat4 M;
 
 #ifdef PER_VERTEX_NORMAL
@@ -34,7 +32,7 @@ out vec2 vo_UV0;
 void
 main()
 {
-    gl_Position = PVM * vec4(aPos.xyz, 1);
+    gl_Position = PV * M * vec4(aPos.xyz, 1);
     vo_Pos = aPos.xyz;
     vo_FragPos = (M * vec4(aPos.xyz, 1)).xyz;
 #ifdef PER_VERTEX_NORMAL
@@ -0,0 +1,424 @@
+#include <math.h>
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string.h>
+
+#include <glm/gtc/quaternion.hpp>
+
+#include "object.hpp"
+#include "vertexbuffer.hpp"
+#include "mappedfile.hpp"
+#include "json.hpp"
+
+namespace g3d {
+
+namespace {
+
+enum {
+    GLTF_BYTE = 5120,
+    GLTF_UNSIGNED_BYTE = 5121,
+    GLTF_SHORT = 5122,
+    GLTF_UNSIGNED_SHORT = 5123,
+    GLTF_UNSIGNED_INT = 5125,
+    GLTF_FLOAT = 5126,
+};
+
+size_t
+componentSize(int type)
+{
+    switch(type) {
+    case GLTF_BYTE:
+    case GLTF_UNSIGNED_BYTE:
+        return 1;
+    case GLTF_SHORT:
+    case GLTF_UNSIGNED_SHORT:
+        return 2;
+    case GLTF_UNSIGNED_INT:
+    case GLTF_FLOAT:
+        return 4;
+    default:
+        throw std::runtime_error{"glTF: Bad componentType"};
+    }
+}
+
+size_t
+typeElements(const std::string &type)
+{
+    if(type == "SCALAR")
+        return 1;
+    if(type == "VEC2")
+        return 2;
+    if(type == "VEC3")
+        return 3;
+    if(type == "VEC4")
+        return 4;
+    throw std::runtime_error{"glTF: Unsupported accessor type " + type};
+}
+
+// Indices, counts and byte sizes are non-negative integers. Within 2^53,
+// where doubles hold them exactly.
+size_t
+toSize(const Json &j, double def = 0)
+{
+    const double v = j.num(def);
+    if(!(v >= 0 && v <= 9007199254740992.0) || v != floor(v))
+        throw std::runtime_error{"glTF: Bad index or size"};
+    return v;
+}
+
+// Largest accessor without a bufferView, zero filled, in bytes
+constexpr size_t MAX_ZERO_FILLED = 1 << 28;
+
+// Keeps mapped buffers and any converted attributes alive for the
+// VertexBuffers referencing them
+struct GLTFStorage {
+    std::vector<std::shared_ptr<MappedFile>> m_files;
+    std::vector<std::unique_ptr<std::vector<float>>> m_converted;
+};
+
+struct Accessor {
+    const uint8_t *data;
+    size_t count;
+    size_t elements;
+    size_t stride;  // In bytes
+    int type;
+    bool normalized;
+};
+
+struct GLTFLoader {
+    Json m_doc;
+    std::vector<std::pair<const uint8_t *, size_t>> m_buffers;
+    std::shared_ptr<GLTFStorage> m_storage{std::make_shared<GLTFStorage>()};
+    bool m_interactive;
+
+    Accessor accessor(size_t index) const
+    {
+        const Json &a = m_doc["accessors"][index];
+        if(a.m_type != Json::Type::Object)
+            throw std::runtime_error{"glTF: Bad accessor index"};
+        if(a.has("sparse"))
+            throw std::runtime_error{"glTF: Sparse accessors not supported"};
+
+        Accessor r;
+        r.type = a["componentType"].num();
+        r.count = toSize(a["count"]);
+        r.elements = typeElements(a["type"].str());
+        r.normalized = a["normalized"].num() != 0;
+
+        if(!a.has("bufferView")) {
+            // All zeros, as the spec has it
+            r.stride = componentSize(r.type) * r.elements;
+            if(r.count > MAX_ZERO_FILLED / r.stride)
+                throw std::runtime_error{"glTF: Accessor too large"};
+            auto zeros = std::make_unique<std::vector<float>>(
+                (r.count * r.stride + sizeof(float) - 1) / sizeof(float));
+            r.data = (const uint8_t *)zeros->data();
+            m_storage->m_converted.push_back(std::move(zeros));
+            return r;
+        }
+
+        const Json &bv = m_doc["bufferViews"][toSize(a["bufferView"])];
+        const size_t buffer = toSize(bv["buffer"]);
+        if(buffer >= m_buffers.size())
+            throw std::runtime_error{"glTF: Bad buffer index"};
+
+        const size_t size = componentSize(r.type) * r.elements;
+        r.stride = toSize(bv["byteStride"], size);
+        if(r.stride < size)
+            throw std::runtime_error{"glTF: Bad byteStride"};
+
+        // Divided rather than multiplied, so a large count cannot wrap
+        const size_t view_offset = toSize(bv["byteOffset"]);
+        const size_t view_length = toSize(bv["byteLength"]);
+        const size_t offset = toSize(a["byteOffset"]);
+        if(view_offset > m_buffers[buffer].second ||
+           view_length > m_buffers[buffer].second - view_offset ||
+           offset > view_length)
+            throw std::runtime_error{"glTF: Accessor out of bounds"};
+        const size_t avail = view_length - offset;
+        if(r.count &&
+           (avail < size || r.count - 1 > (avail - size) / r.stride))
+            throw std::runtime_error{"glTF: Accessor out of bounds"};
+
+        r.data = m_buffers[buffer].first + view_offset + offset;
+        return r;
+    }
+
+    // Float data is referenced in place, anything else is converted
+    VertexAttribView attrib(VertexAttribute va, size_t index,
+                            size_t *count) const
+    {
+        const Accessor a = accessor(index);
+        *count = a.count;
+
+        if(a.type == GLTF_FLOAT && a.stride % sizeof(float) == 0 &&
+           (uintptr_t)a.data % alignof(float) == 0) {
+            return VertexAttribView{va, (const float *)a.data,
+                                    a.stride / sizeof(float), a.elements};
+        }
+
+        auto v = std::make_unique<std::vector<float>>(a.count * a.elements);
+        float *dst = v->data();
+        for(size_t i = 0; i < a.count; i++) {
+            const uint8_t *s = a.data + i * a.stride;
+            for(size_t k = 0; k < a.elements; k++) {
+                float f;
+                switch(a.type) {
+                case GLTF_BYTE:
+                    f = ((const int8_t *)s)[k];
+                    f = a.normalized ? glm::max(f / 127.0f, -1.0f) : f;
+                    break;
+                case GLTF_UNSIGNED_BYTE:
+                    f = s[k];
+                    f = a.normalized ? f / 255.0f : f;
+                    break;
+                case GLTF_SHORT: {
+                    int16_t x;
+                    memcpy(&x, s + k * 2, 2);
+                    f = a.normalized ? glm::max(x / 32767.0f, -1.0f) : x;
+                    break;
+                }
+                case GLTF_UNSIGNED_SHORT: {
+                    uint16_t x;
+                    memcpy(&x, s + k * 2, 2);
+                    f = a.normalized ? x / 65535.0f : x;
+                    break;
+                }
+                case GLTF_UNSIGNED_INT: {
+                    uint32_t x;
+                    memcpy(&x, s + k * 4, 4);
+                    f = x;
+                    break;
+                }
+                default:
+                    memcpy(&f, s + k * 4, 4);
+                    break;
+                }
+                *dst++ = f;
+            }
+        }
+        const float *data = v->data();
+        m_storage->m_converted.push_back(std::move(v));
+        return VertexAttribView{va, data, a.elements, a.elements};
+    }
+
+    // Throws if any index is past the vertices
+    std::shared_ptr<std::vector<glm::ivec3>> indices(size_t index,
+                                                     size_t vertices) const
+    {
+        const Accessor a = accessor(index);
+        if(a.elements != 1)
+            throw std::runtime_error{"glTF: Bad index accessor"};
+
+        auto ib = std::make_shared<std::vector<glm::ivec3>>(a.count / 3);
+        int *dst = &(*ib)[0][0];
+        for(size_t i = 0; i < ib->size() * 3; i++) {
+            const uint8_t *s = a.data + i * a.stride;
+            switch(a.type) {
+            case GLTF_UNSIGNED_BYTE:
+                dst[i] = *s;
+                break;
+            case GLTF_UNSIGNED_SHORT: {
+                uint16_t x;
+                memcpy(&x, s, 2);
+                dst[i] = x;
+                break;
+            }
+            case GLTF_UNSIGNED_INT: {
+                uint32_t x;
+                memcpy(&x, s, 4);
+                dst[i] = x;
+                break;
+            }
+            default:
+                throw std::runtime_error{"glTF: Bad index componentType"};
+            }
+            if((size_t)(uint32_t)dst[i] >= vertices)
+                throw std::runtime_error{"glTF: Index out of bounds"};
+        }
+        return ib;
+    }
+
+    void mesh(Object &parent, size_t index) const
+    {
+        const Json &m = m_doc["meshes"][index];
+        const Json &prims = m["primitives"];
+
+        for(size_t i = 0; i < prims.size(); i++) {
+            const Json &prim = prims[i];
+            const Json &attrs = prim["attributes"];
+
+            if(prim["mode"].num(4) != 4)
+                continue;  // Only triangle lists
+            if(!attrs.has("POSITION"))
+                continue;
+
+            static const std::pair<const char *, VertexAttribute> map[] = {
+                {"POSITION", VertexAttribute::Position},
+                {"NORMAL", VertexAttribute::Normal},
+                {"COLOR_0", VertexAttribute::Color},
+                {"TEXCOORD_0", VertexAttribute::UV0},
+            };
+
+            size_t count = 0;
+            std::vector<VertexAttribView> views;
+            for(const auto &[name, va] : map) {
+                if(!attrs.has(name))
+                    continue;
+                size_t c;
+                views.push_back(attrib(va, toSize(attrs[name]), &c));
+                if(va == VertexAttribute::Position)
+                    count = c;
+                else if(c < count)
+                    throw std::runtime_error{"glTF: Short attribute " +
+                                             std::string(name)};
+            }
+
+            auto vb = VertexBuffer::make(count, views, m_storage);
+            std::shared_ptr<std::vector<glm::ivec3>> ib;
+            if(prim.has("indices"))
+                ib = indices(toSize(prim["indices"]), count);
+
+            auto o = makeMesh(vb, ib, m_interactive);
+            if(m.has("name"))
+                o->m_name = m["name"].str();
+            parent.addChild(o);
+        }
+    }
+
+    std::shared_ptr<Object> node(size_t index, int depth) const
+    {
+        const Json &n = m_doc["nodes"][index];
+        if(depth > 64)
+            throw std::runtime_error{"glTF: Node hierarchy too deep"};
+
+        const std::string name =
+            n.has("name") ? n["name"].str() : "node" + std::to_string(index);
+        auto g = makeGroup(name.c_str());
+
+        if(n.has("matrix")) {
+            const Json &mtx = n["matrix"];
+            glm::mat4 m;
+            for(int i = 0; i < 16; i++)
+                m[i / 4][i % 4] = mtx[(size_t)i].num();
+            g->setModelMatrix(m);
+        } else {
+            auto v = [&](const char *key, size_t i, float def) -> float {
+                return n[key][i].num(def);
+            };
+            glm::mat4 m{1};
+            m = glm::translate(m, glm::vec3{v("translation", 0, 0),
+                                            v("translation", 1, 0),
+                                            v("translation", 2, 0)});
+            m = m * glm::mat4_cast(glm::quat{
+                        v("rotation", 3, 1), v("rotation", 0, 0),
+                        v("rotation", 1, 0), v("rotation", 2, 0)});
+            m = glm::scale(m, glm::vec3{v("scale", 0, 1), v("scale", 1, 1),
+                                        v("scale", 2, 1)});
+            g->setModelMatrix(m);
+        }
+
+        if(n.has("mesh"))
+            mesh(*g, toSize(n["mesh"]));
+
+        const Json &children = n["children"];
+        for(size_t i = 0; i < children.size(); i++)
+            g->addChild(node(toSize(children[i]), depth + 1));
+        return g;
+    }
+};
+
+std::string
+dirname(const char *path)
+{
+    const char *s = strrchr(path, '/');
+    return s ? std::string(path, s - path + 1) : std::string();
+}
+
+}  // namespace
+
+std::shared_ptr<Object>
+loadGLTF(const char *path, bool interactive)
+{
+    GLTFLoader l;
+    l.m_interactive = interactive;
+
+    auto mf = std::make_shared<MappedFile>(path);
+    l.m_storage->m_files.push_back(mf);
+
+    const uint8_t *p = mf->data();
+    const char *json = (const char *)p;
+    size_t json_len = mf->size();
+    std::pair<const uint8_t *, size_t> bin{nullptr, 0};
+
+    if(mf->size() >= 12 && !memcmp(p, "glTF", 4)) {
+        uint32_t version, length;
+        memcpy(&version, p + 4, 4);
+        memcpy(&length, p + 8, 4);
+        if(version != 2)
+            throw std::runtime_error{"glTF: Unsupported GLB version"};
+        if(length > mf->size())
+            throw std::runtime_error{"glTF: Short GLB file"};
+
+        json = nullptr;
+        size_t off = 12;
+        while(off + 8 <= length) {
+            uint32_t chunk_len, chunk_type;
+            memcpy(&chunk_len, p + off, 4);
+            memcpy(&chunk_type, p + off + 4, 4);
+            off += 8;
+            if(chunk_len > length - off)
+                throw std::runtime_error{"glTF: Bad GLB chunk"};
+
+            if(chunk_type == 0x4e4f534a && json == nullptr) {  // JSON
+                json = (const char *)p + off;
+                json_len = chunk_len;
+            } else if(chunk_type == 0x004e4942 && !bin.first) {  // BIN
+                bin = {p + off, chunk_len};
+            }
+            off += (chunk_len + 3) & ~3;
+        }
+        if(json == nullptr)
+            throw std::runtime_error{"glTF: No JSON chunk"};
+    }
+
+    JsonParser jp{json, json + json_len};
+    l.m_doc = jp.value();
+
+    const std::string dir = dirname(path);
+    const Json &buffers = l.m_doc["buffers"];
+    for(size_t i = 0; i < buffers.size(); i++) {
+        const Json &b = buffers[i];
+        if(!b.has("uri")) {
+            if(i != 0 || !bin.first)
+                throw std::runtime_error{"glTF: Missing buffer"};
+            l.m_buffers.push_back(bin);
+            continue;
+        }
+        const std::string &uri = b["uri"].str();
+        if(uri.compare(0, 5, "data:") == 0)
+            throw std::runtime_error{"glTF: Embedded data URIs not supported"};
+        auto bf = std::make_shared<MappedFile>((dir + uri).c_str());
+        l.m_storage->m_files.push_back(bf);
+        l.m_buffers.push_back({bf->data(), bf->size()});
+    }
+
+    auto root = makeGroup(path);
+
+    const Json &scenes = l.m_doc["scenes"];
+    const Json &scene = scenes[toSize(l.m_doc["scene"])];
+    if(scene.has("nodes")) {
+        const Json &nodes = scene["nodes"];
+        for(size_t i = 0; i < nodes.size(); i++)
+            root->addChild(l.node(toSize(nodes[i]), 0));
+    } else {
+        // No scenes, add the meshes as they are
+        for(size_t i = 0; i < l.m_doc["meshes"].size(); i++)
+            l.mesh(*root, i);
+    }
+    return root;
+}
+
+}  // namespace g3d
@@ -0,0 +1,394 @@
+#include "object.hpp"
+
+#include <math.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "arraybuffer.hpp"
+#include "camera.hpp"
+#include "primitives.hpp"
+#include "scene.hpp"
+#include "shader.hpp"
+
+static const char *glyph_vertex_shader = R"glsl(
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aNormal;
+layout (location = 2) in vec4 aCol;
+layout (location = 3) in vec4 iCol;
+layout (location = 4) in mat4 iModel;  // Takes locations 4 - 7
+
+uniform mat4 model;
+uniform int lit;
+uniform int focused;
+
+out vec4 fragmentColor;
+
+void main()
+{
+   mat4 m = model * iModel;
+   vec4 p = m * vec4(aPos, 1);
+   gl_Position = PV * p;
+
+   vec4 c = aCol * iCol;
+   if(lit != 0) {
+     // Headlight, from the camera
+     vec3 n = normalize(mat3(m) * aNormal);
+     vec3 l = normalize(VI[3].xyz - p.xyz);
+     c.rgb *= 0.3 + 0.7 * abs(dot(n, l));
+   }
+   if(gl_InstanceID == focused)
+     c.rgb = mix(c.rgb, vec3(1), 0.5);
+   fragmentColor = c;
+}
+
+)glsl";
+
+static const char *glyph_fragment_shader = R"glsl(
+out vec4 FragColor;
+in vec4 fragmentColor;
+
+void main()
+{
+  FragColor = fragmentColor;
+}
+
+)glsl";
+
+namespace g3d {
+
+namespace {
+
+struct GlyphVertex {
+    glm::vec3 pos;
+    glm::vec3 normal;
+    glm::vec4 color;
+};
+
+struct GlyphShape {
+    GLenum mode;
+    std::vector<GlyphVertex> vertices;
+    float radius{0};  // Bounding sphere around the origin, see shape()
+};
+
+// Same as makeCross()
+GlyphShape
+cross()
+{
+    GlyphShape s{GL_LINES};
+    for(int axis = 0; axis < 3; axis++) {
+        glm::vec3 v{0};
+        glm::vec4 col{0, 0, 0, 1};
+        col[axis] = 1;
+        v[axis] = -1;
+        s.vertices.push_back({v, {}, {glm::vec3{col}, 0.2}});
+        v[axis] = 1;
+        s.vertices.push_back({v, {}, col});
+    }
+    return s;
+}
+
+GlyphShape
+sphere()
+{
+    GlyphShape s{GL_TRIANGLES};
+    auto [vb, triangles] = icosphere(1, 2);
+    const float *pos = vb->get_attributes(VertexAttribute::Position);
+    const size_t stride = vb->get_stride(VertexAttribute::Position);
+    for(const auto &t : triangles) {
+        for(int i = 0; i < 3; i++) {
+            const glm::vec3 p{pos[t[i] * stride], pos[t[i] * stride + 1],
+                              pos[t[i] * stride + 2]};
+            s.vertices.push_back({p, p, glm::vec4{1}});
+        }
+    }
+    return s;
+}
+
+// From the origin to (0, 0, 1): a shaft, then a cone over the last quarter
+GlyphShape
+arrow()
+{
+    constexpr int segments = 16;
+    constexpr float shaft = 0.03f;
+    constexpr float head = 0.08f;
+    constexpr float base = 0.75f;
+
+    GlyphShape s{GL_TRIANGLES};
+    auto tri = [&](glm::vec3 a, glm::vec3 b, glm::vec3 c, glm::vec3 na,
+                   glm::vec3 nb, glm::vec3 nc) {
+        s.vertices.push_back({a, na, glm::vec4{1}});
+        s.vertices.push_back({b, nb, glm::vec4{1}});
+        s.vertices.push_back({c, nc, glm::vec4{1}});
+    };
+    const glm::vec3 down{0, 0, -1};
+    const float slope = head / (1 - base);
+
+    for(int i = 0; i < segments; i++) {
+        const float a0 = 2 * M_PI * i / segments;
+        const float a1 = 2 * M_PI * (i + 1) / segments;
+        const glm::vec3 r0{cosf(a0), sinf(a0), 0};
+        const glm::vec3 r1{cosf(a1), sinf(a1), 0};
+        const glm::vec3 z{0, 0, base};
+
+        // Shaft and its end cap
+        tri(r0 * shaft, r1 * shaft, r1 * shaft + z, r0, r1, r1);
+        tri(r0 * shaft, r1 * shaft + z, r0 * shaft + z, r0, r1, r0);
+        tri({}, r1 * shaft, r0 * shaft, down, down, down);
+
+        // Head and its base
+        const glm::vec3 n0 = glm::normalize(r0 + glm::vec3{0, 0, slope});
+        const glm::vec3 n1 = glm::normalize(r1 + glm::vec3{0, 0, slope});
+        tri(r0 * head + z, r1 * head + z, {0, 0, 1}, n0, n1,
+            glm::normalize(n0 + n1));
+        tri(z, r1 * head + z, r0 * head + z, down, down, down);
+    }
+    return s;
+}
+
+// A camera at the origin looking down -Z with a 4:3 image at distance 1,
+// the triangle above it marking up
+GlyphShape
+frustum()
+{
+    const glm::vec3 c[4] = {
+        {-0.5f, -0.375f, -1}, {0.5f, -0.375f, -1},
+        {0.5f, 0.375f, -1},   {-0.5f, 0.375f, -1},
+    };
+    const glm::vec3 up[3] = {
+        {-0.2f, 0.425f, -1}, {0.2f, 0.425f, -1}, {0, 0.6f, -1}};
+
+    GlyphShape s{GL_LINES};
+    auto line = [&](glm::vec3 a, glm::vec3 b) {
+        s.vertices.push_back({a, {}, glm::vec4{1}});
+        s.vertices.push_back({b, {}, glm::vec4{1}});
+    };
+    for(int i = 0; i < 4; i++) {
+        line({}, c[i]);
+        line(c[i], c[(i + 1) % 4]);
+    }
+    for(int i = 0; i < 3; i++)
+        line(up[i], up[(i + 1) % 3]);
+    return s;
+}
+
+// Largest axis scale of m
+float
+scale(const glm::mat4 &m)
+{
+    return std::max({glm::length(glm::vec3{m[0]}),
+                     glm::length(glm::vec3{m[1]}),
+                     glm::length(glm::vec3{m[2]})});
+}
+
+GlyphShape
+build(Glyph glyph)
+{
+    switch(glyph) {
+    case Glyph::Cross:
+        return cross();
+    case Glyph::Icosphere:
+        return sphere();
+    case Glyph::Arrow:
+        return arrow();
+    case Glyph::Frustum:
+        return frustum();
+    }
+    throw std::invalid_argument{"Unknown glyph"};
+}
+
+// With the radius reaching its farthest vertex
+GlyphShape
+shape(Glyph glyph)
+{
+    GlyphShape s = build(glyph);
+    for(const auto &v : s.vertices)
+        s.radius = std::max(s.radius, glm::length(v.pos));
+    return s;
+}
+
+}  // namespace
+
+// One shape drawn once per instance, transforms and colors coming from a
+// per instance buffer (attribute divisor 1)
+struct Glyphs : public Object {
+    Glyphs(Glyph glyph, std::vector<GlyphInstance> instances)
+      : m_shape(shape(glyph)), m_instances(std::move(instances))
+    {
+        m_name = "Glyphs";
+    }
+
+    ~Glyphs()
+    {
+        if(m_vao)
+            DrawState::deleteVertexArray(m_vao);
+    }
+
+    void setInstances(std::vector<GlyphInstance> instances)
+    {
+        m_instances = std::move(instances);
+        m_dirty = true;
+        m_bounds.reset();
+    }
+
+    // Around the bounding sphere of each instance
+    std::optional<Bounds> bounds() override
+    {
+        if(m_bounds)
+            return m_bounds;
+        m_bounds = Bounds{};
+        for(const auto &inst : m_instances) {
+            const glm::mat4 &m = inst.transform;
+            const glm::vec3 r{m_shape.radius * scale(m)};
+            m_bounds->add(Bounds{glm::vec3{m[3]} - r, glm::vec3{m[3]} + r});
+        }
+        return m_bounds;
+    }
+
+    void hit(const glm::vec3 &origin, const glm::vec3 &direction,
+             const glm::mat4 &parent_mm, Hit &hit) override
+    {
+        const glm::mat4 mm = parent_mm * m_model_matrix;
+        const glm::vec3 dir = glm::normalize(direction);
+
+        // Against the bounding sphere of each instance
+        for(size_t i = 0; i < m_instances.size(); i++) {
+            const glm::mat4 m = mm * m_instances[i].transform;
+            const glm::vec3 center{m[3]};
+            const float r = m_shape.radius * scale(m);
+
+            const glm::vec3 oc = center - origin;
+            const float t = glm::dot(oc, dir);
+            const float d2 = glm::dot(oc, oc) - t * t;
+            if(d2 > r * r)
+                continue;
+            const float h = sqrtf(r * r - d2);
+            if(t + h < 0)
+                continue;  // Behind the origin
+            // From within the sphere, where the ray passes its center
+            const float d = t - h >= 0 ? t - h : std::max(t, 0.0f);
+            if(d >= hit.distance)
+                continue;
+            hit.object = this;
+            hit.primitive = i;
+            hit.distance = d;
+            hit.world_pos = origin + dir * d;
+        }
+    }
+
+    void setup()
+    {
+        m_shape_buf.write(m_shape.vertices.data(),
+                          m_shape.vertices.size() * sizeof(GlyphVertex));
+
+        glGenVertexArrays(1, &m_vao);
+        DrawState::bindVertexArray(m_vao);
+
+        m_shape_buf.bind();
+        const GLsizei vs = sizeof(GlyphVertex);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, vs,
+                              (void *)offsetof(GlyphVertex, pos));
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, vs,
+                              (void *)offsetof(GlyphVertex, normal));
+        glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, vs,
+                              (void *)offsetof(GlyphVertex, color));
+        for(GLuint i = 0; i < 3; i++)
+            glEnableVertexAttribArray(i);
+
+        m_instance_buf.bind();
+        const GLsizei is = sizeof(GlyphInstance);
+        glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, is,
+                              (void *)offsetof(GlyphInstance, color));
+        for(GLuint col = 0; col < 4; col++) {
+            glVertexAttribPointer(
+                4 + col, 4, GL_FLOAT, GL_FALSE, is,
+                (void *)(offsetof(GlyphInstance, transform) +
+                         col * sizeof(glm::vec4)));
+        }
+        for(GLuint i = 3; i < 8; i++) {
+            glEnableVertexAttribArray(i);
+            glVertexAttribDivisor(i, 1);
+        }
+    }
+
+    void draw(const Scene &scene, const Camera &cam,
+              const glm::mat4 &pt) override
+    {
+        if(m_dirty) {
+            // Reusing the buffer name keeps the vertex array valid
+            m_dirty = false;
+            m_drawn = m_instances.size();
+            if(m_drawn)
+                m_instance_buf.write(m_instances.data(),
+                                     m_drawn * sizeof(GlyphInstance));
+        }
+        if(m_drawn == 0)
+            return;
+
+        if(!m_shader) {
+            m_shader = Shader::get("glyphs",
+                                   "#version 330 core\n" FRAME_UNIFORMS_GLSL,
+                                   glyph_vertex_shader, -1,
+                                   glyph_fragment_shader, -1);
+        }
+        if(!m_shader->ready())
+            return;
+
+        Shader *s = m_shader.get();
+        s->use();
+        if(!m_vao)
+            setup();
+        DrawState::bindVertexArray(m_vao);
+
+        s->setMat4("model", pt * m_model_matrix);
+        s->setInt("lit", m_shape.mode == GL_TRIANGLES);
+        s->setInt("focused",
+                  scene.m_hit.object == this ? (int)scene.m_hit.primitive
+                                             : -1);
+
+        glDrawArraysInstanced(m_shape.mode, 0, m_shape.vertices.size(),
+                              m_drawn);
+    }
+
+    uint64_t drawKey() const override
+    {
+        return (uint64_t)(m_shader ? m_shader->m_id : 0) << 32 | m_vao;
+    }
+
+    void ui(const Scene &scene) override
+    {
+        ImGui::Checkbox("Visible", &m_visible);
+        ImGui::Text("%zd instances", m_instances.size());
+        if(scene.m_hit.object == this)
+            ImGui::Text("Instance %zd", scene.m_hit.primitive);
+    }
+
+    const GlyphShape m_shape;
+    std::vector<GlyphInstance> m_instances;
+    bool m_dirty{true};
+    size_t m_drawn{0};
+    std::optional<Bounds> m_bounds;
+
+    ArrayBuffer m_shape_buf{GL_ARRAY_BUFFER};
+    ArrayBuffer m_instance_buf{GL_ARRAY_BUFFER, GL_DYNAMIC_DRAW};
+    GLuint m_vao{0};
+
+    std::shared_ptr<Shader> m_shader;
+};
+
+std::shared_ptr<Object>
+makeGlyphs(Glyph glyph, std::vector<GlyphInstance> instances)
+{
+    return std::make_shared<Glyphs>(glyph, std::move(instances));
+}
+
+void
+setGlyphInstances(Object &glyphs, std::vector<GlyphInstance> instances)
+{
+    auto g = dynamic_cast<Glyphs *>(&glyphs);
+    if(g == nullptr)
+        throw std::invalid_argument{"Not glyphs"};
+    g->setInstances(std::move(instances));
+}
+
+}  // namespace g3d
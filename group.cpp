@@ -1,7 +1,16 @@
 #include "object.hpp"
 #include <glm/gtc/type_ptr.hpp>
 
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+
+#include "camera.hpp"
+#include "drawstate.hpp"
+#include "occlusion.hpp"
 #include "opengl.hpp"
+#include "transform.hpp"
+#include "vertexbuffer.hpp"
 
 namespace g3d {
 
@@ -13,19 +22,67 @@ struct Group : public Object {
     {
         for(auto &o : m_children) {
             if(o->m_visible) {
-                o->hit(origin, direction, m_model_matrix * parent_mm, hit);
+                o->hit(origin, direction, parent_mm * m_model_matrix, hit);
             }
         }
     }
 
+    bool uploading() const override
+    {
+        for(auto &o : m_children) {
+            if(o->m_visible && o->uploading())
+                return true;
+        }
+        return false;
+    }
+
+    // Its bounds enclose those of the occluder
+    bool occluder() const override
+    {
+        for(auto &o : m_children) {
+            if(o->m_visible && o->occluder())
+                return true;
+        }
+        return false;
+    }
+
+    // So a group with translucent children draws after opaque siblings
+    bool translucent() const override
+    {
+        for(auto &o : m_children) {
+            if(o->m_visible && o->translucent())
+                return true;
+        }
+        return false;
+    }
+
     void draw(const Scene &scene, const Camera &cam,
               const glm::mat4 &parent_mm) override
     {
+        drawObjects(m_children, scene, cam, parent_mm * m_model_matrix);
+    }
+
+    // Of the visible children, worked out once per frame as theirs may
+    // change as they load
+    std::optional<Bounds> bounds() override
+    {
+        const uint64_t frame = DrawState::frameNumber();
+        if(m_bounds_frame == frame)
+            return m_bounds;
+        m_bounds_frame = frame;
+
+        m_bounds = Bounds{};
         for(auto &o : m_children) {
-            if(o->m_visible) {
-                o->draw(scene, cam, m_model_matrix * parent_mm);
+            if(!o->m_visible)
+                continue;
+            const auto b = o->bounds();
+            if(!b) {
+                m_bounds.reset();
+                break;
             }
+            m_bounds->add(b->transformed(o->m_model_matrix));
         }
+        return m_bounds;
     }
 
     void ui(const Scene &scene) override
@@ -46,6 +103,9 @@ struct Group : public Object {
     bool m_rigid{false};
 
     std::vector<std::shared_ptr<Object>> m_children;
+
+    std::optional<Bounds> m_bounds;
+    uint64_t m_bounds_frame{UINT64_MAX};
 };
 
 std::shared_ptr<Object>
@@ -54,4 +114,111 @@ makeGroup(const char *name)
     return std::make_shared<Group>(name);
 }
 
+Bounds
+Bounds::transformed(const glm::mat4 &m) const
+{
+    if(empty())
+        return *this;
+
+    // Center moves, extent grows by the absolute rotation and scale
+    const glm::vec3 c = (lo + hi) * 0.5f;
+    const glm::vec3 e = (hi - lo) * 0.5f;
+    const glm::vec3 tc = m * glm::vec4{c, 1};
+    glm::vec3 te{0};
+    for(int col = 0; col < 3; col++)
+        te += glm::abs(glm::vec3{m[col]}) * e[col];
+    return Bounds{tc - te, tc + te};
+}
+
+Bounds
+vertexBounds(const VertexBuffer &vb)
+{
+    Bounds b;
+    if(vb.get_elements(VertexAttribute::Position) >= 3)
+        positionBounds(vb.get_attributes(VertexAttribute::Position),
+                       vb.get_stride(VertexAttribute::Position), vb.size(),
+                       b.lo, b.hi);
+    return b;
+}
+
+// True unless all corners of the box are outside one of the clip planes
+bool
+inFrustum(const glm::mat4 &pvm, const Bounds &b)
+{
+    if(b.empty())
+        return false;
+
+    glm::vec4 c[8];
+    for(int i = 0; i < 8; i++) {
+        c[i] = pvm * glm::vec4{i & 1 ? b.hi.x : b.lo.x,
+                               i & 2 ? b.hi.y : b.lo.y,
+                               i & 4 ? b.hi.z : b.lo.z, 1};
+    }
+    for(int axis = 0; axis < 3; axis++) {
+        int below = 0, above = 0;
+        for(int i = 0; i < 8; i++) {
+            below += c[i][axis] < -c[i].w;
+            above += c[i][axis] > c[i].w;
+        }
+        if(below == 8 || above == 8)
+            return false;
+    }
+    return true;
+}
+
+void
+drawObject(Object &o, const Scene &scene, const Camera &cam,
+           const glm::mat4 &parent_mm)
+{
+    if(!o.m_visible)
+        return;
+    try {
+        o.draw(scene, cam, parent_mm);
+    } catch(const std::exception &e) {
+        fprintf(stderr, "Hiding %s: %s\n",
+                o.m_name ? o.m_name->c_str() : "object", e.what());
+        o.m_visible = false;
+    }
+}
+
+void
+drawObjects(const std::vector<std::shared_ptr<Object>> &objects,
+            const Scene &scene, const Camera &cam, const glm::mat4 &parent_mm)
+{
+    const glm::mat4 pv = cam.m_P * cam.m_V * parent_mm;
+
+    std::vector<std::pair<uint64_t, Object *>> order;
+    std::vector<Object *> translucent;
+    order.reserve(objects.size());
+    for(const auto &o : objects) {
+        if(!o->m_visible)
+            continue;
+        const auto b = o->bounds();
+        const glm::mat4 pvm = pv * o->m_model_matrix;
+        const bool culled = b && !inFrustum(pvm, *b);
+        const bool occluded = b && !culled && !o->occluder() &&
+                              !Occlusion::visible(pvm, *b);
+        DrawState::countObject(culled, occluded);
+        if(culled || occluded)
+            continue;
+        if(o->translucent())
+            translucent.push_back(o.get());
+        else
+            order.emplace_back(o->drawKey(), o.get());
+    }
+
+    // Stable, so opaque objects otherwise keep the order they were added
+    // in
+    std::stable_sort(order.begin(), order.end(),
+                     [](const auto &a, const auto &b) {
+                         return a.first < b.first;
+                     });
+
+    for(const auto &[key, o] : order)
+        drawObject(*o, scene, cam, parent_mm);
+
+    for(auto *o : translucent)
+        drawObject(*o, scene, cam, parent_mm);
+}
+
 }  // namespace g3d
@@ -27,11 +27,12 @@ Image2D::Image2D(const uint8_t *data, size_t len)
 
 Image2D::~Image2D() { free(m_data); }
 
-Image2D::Image2D(size_t width, size_t height)
+Image2D::Image2D(size_t width, size_t height, PixelFormat format)
 {
     m_width = width;
     m_height = height;
-    m_data = calloc(1, width * height * 3);
+    m_format = format;
+    m_data = calloc(1, width * height * bytesPerPixel());
 }
 
 int
@@ -5,6 +5,12 @@
 
 namespace g3d {
 
+enum class PixelFormat {
+    RGB8,
+    DEPTH16,   // uint16_t, in sensor units
+    DEPTH32F,  // float
+};
+
 struct Image2D {
     Image2D(const Image2D &) = delete;
     Image2D &operator=(const Image2D &) = delete;
@@ -16,11 +22,13 @@ struct Image2D {
     Image2D(const uint8_t *data, size_t len);
 
     // Allocates memory for empty image
-    Image2D(size_t width, size_t height);
+    Image2D(size_t width, size_t height,
+            PixelFormat format = PixelFormat::RGB8);
 
-    // This takes ownership of *data
-    Image2D(void **data, size_t width, size_t height)
-      : m_data(*data), m_width(width), m_height(height)
+    // This takes ownership of *data, which must come from malloc()
+    Image2D(void **data, size_t width, size_t height,
+            PixelFormat format = PixelFormat::RGB8)
+      : m_data(*data), m_width(width), m_height(height), m_format(format)
     {
         *data = NULL;
     }
@@ -29,9 +37,23 @@ struct Image2D {
 
     void save_jpeg(const char *path, int quality, bool flip);
 
+    size_t bytesPerPixel() const
+    {
+        switch(m_format) {
+        case PixelFormat::RGB8:
+            return 3;
+        case PixelFormat::DEPTH16:
+            return 2;
+        case PixelFormat::DEPTH32F:
+            return 4;
+        }
+        return 0;
+    }
+
     void *m_data{NULL};
     size_t m_width{0};
     size_t m_height{0};
+    PixelFormat m_format{PixelFormat::RGB8};
 
 private:
     int load(const char *path);
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace g3d {
+
+// Just enough JSON to walk glTF documents and asset manifests
+struct Json {
+    enum class Type { Null, Bool, Number, String, Array, Object };
+
+    Type m_type{Type::Null};
+    double m_number{0};
+    std::string m_string;
+    std::vector<Json> m_values;       // Array elements or object values
+    std::vector<std::string> m_keys;  // Object keys
+
+    const Json &operator[](const char *key) const
+    {
+        static const Json null;
+        for(size_t i = 0; i < m_keys.size(); i++) {
+            if(m_keys[i] == key)
+                return m_values[i];
+        }
+        return null;
+    }
+
+    const Json &operator[](size_t index) const
+    {
+        static const Json null;
+        return index < m_values.size() ? m_values[index] : null;
+    }
+
+    bool has(const char *key) const
+    {
+        return (*this)[key].m_type != Type::Null;
+    }
+
+    size_t size() const { return m_values.size(); }
+
+    double num(double def = 0) const
+    {
+        if(m_type == Type::Number || m_type == Type::Bool)
+            return m_number;
+        return def;
+    }
+
+    const std::string &str() const { return m_string; }
+};
+
+struct JsonParser {
+    const char *p;
+    const char *end;
+
+    void ws()
+    {
+        while(p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+            p++;
+    }
+
+    char peek()
+    {
+        ws();
+        if(p == end)
+            throw std::runtime_error{"Unexpected end of JSON"};
+        return *p;
+    }
+
+    void expect(char c)
+    {
+        if(peek() != c)
+            throw std::runtime_error{std::string("JSON: Expected ") + c};
+        p++;
+    }
+
+    bool literal(const char *s)
+    {
+        const size_t len = strlen(s);
+        if((size_t)(end - p) < len || memcmp(p, s, len))
+            return false;
+        p += len;
+        return true;
+    }
+
+    std::string string()
+    {
+        expect('"');
+        std::string r;
+        while(p < end && *p != '"') {
+            char c = *p++;
+            if(c != '\\') {
+                r += c;
+                continue;
+            }
+            if(p == end)
+                break;
+            c = *p++;
+            switch(c) {
+            case 'b':
+                r += '\b';
+                break;
+            case 'f':
+                r += '\f';
+                break;
+            case 'n':
+                r += '\n';
+                break;
+            case 'r':
+                r += '\r';
+                break;
+            case 't':
+                r += '\t';
+                break;
+            case 'u': {
+                if(end - p < 4)
+                    throw std::runtime_error{"JSON: Bad escape"};
+                const unsigned cp = std::stoul(std::string(p, 4), nullptr, 16);
+                p += 4;
+                if(cp < 0x80) {
+                    r += (char)cp;
+                } else if(cp < 0x800) {
+                    r += (char)(0xc0 | (cp >> 6));
+                    r += (char)(0x80 | (cp & 0x3f));
+                } else {
+                    r += (char)(0xe0 | (cp >> 12));
+                    r += (char)(0x80 | ((cp >> 6) & 0x3f));
+                    r += (char)(0x80 | (cp & 0x3f));
+                }
+                break;
+            }
+            default:
+                r += c;
+                break;
+            }
+        }
+        expect('"');
+        return r;
+    }
+
+    Json value()
+    {
+        Json j;
+        const char c = peek();
+        if(c == '{') {
+            p++;
+            j.m_type = Json::Type::Object;
+            if(peek() == '}') {
+                p++;
+                return j;
+            }
+            while(1) {
+                j.m_keys.push_back(string());
+                expect(':');
+                j.m_values.push_back(value());
+                if(peek() == '}') {
+                    p++;
+                    return j;
+                }
+                expect(',');
+            }
+        } else if(c == '[') {
+            p++;
+            j.m_type = Json::Type::Array;
+            if(peek() == ']') {
+                p++;
+                return j;
+            }
+            while(1) {
+                j.m_values.push_back(value());
+                if(peek() == ']') {
+                    p++;
+                    return j;
+                }
+                expect(',');
+            }
+        } else if(c == '"') {
+            j.m_type = Json::Type::String;
+            j.m_string = string();
+        } else if(literal("true")) {
+            j.m_type = Json::Type::Bool;
+            j.m_number = 1;
+        } else if(literal("false")) {
+            j.m_type = Json::Type::Bool;
+        } else if(literal("null")) {
+        } else {
+            const char *s = p;
+            while(p < end && strchr("+-.0123456789eE", *p))
+                p++;
+            if(p == s)
+                throw std::runtime_error{"JSON: Syntax error"};
+            j.m_type = Json::Type::Number;
+            j.m_number = strtod(std::string(s, p).c_str(), NULL);
+        }
+        return j;
+    }
+};
+
+}  // namespace g3d
@@ -0,0 +1,263 @@
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+#include "object.hpp"
+#include "octree.hpp"
+#include "vertexbuffer.hpp"
+#include "mappedfile.hpp"
+#include "parallel.hpp"
+#include "scenecache.hpp"
+#include "transform.hpp"
+
+namespace g3d {
+
+namespace {
+
+struct LASHeader {
+    uint8_t version_major;
+    uint8_t version_minor;
+    uint32_t offset_to_points;
+    uint8_t format;
+    uint16_t record_length;
+    uint64_t points;
+    double scale[3];
+    double offset[3];
+};
+
+template <typename T>
+T
+rd(const uint8_t *p)
+{
+    T v;
+    memcpy(&v, p, sizeof(T));
+    return v;
+}
+
+// Smallest record of each point data format, as in the specification
+constexpr uint16_t MIN_RECORD_LENGTH[11] = {20, 28, 26, 34, 57, 63,
+                                            30, 36, 38, 59, 67};
+
+LASHeader
+parseHeader(const MappedFile &mf)
+{
+    const uint8_t *p = mf.data();
+
+    if(mf.size() < 227 || memcmp(p, "LASF", 4))
+        throw std::runtime_error{"Not a LAS file"};
+
+    LASHeader h;
+    h.version_major = p[24];
+    h.version_minor = p[25];
+    if(h.version_major != 1 || h.version_minor < 2 || h.version_minor > 4)
+        throw std::runtime_error{"Unsupported LAS version"};
+
+    const uint16_t header_size = rd<uint16_t>(p + 94);
+    h.offset_to_points = rd<uint32_t>(p + 96);
+    h.format = p[104];
+    h.record_length = rd<uint16_t>(p + 105);
+    h.points = rd<uint32_t>(p + 107);
+
+    if(h.version_minor == 4 && header_size >= 375 && mf.size() >= 255)
+        h.points = rd<uint64_t>(p + 247);
+
+    for(int i = 0; i < 3; i++) {
+        h.scale[i] = rd<double>(p + 131 + i * 8);
+        h.offset[i] = rd<double>(p + 155 + i * 8);
+    }
+
+    if(h.format & 0xc0)
+        throw std::runtime_error{"Compressed LAS (LAZ) is not supported"};
+    if(h.format > 10)
+        throw std::runtime_error{"Unknown LAS point data format"};
+    if(h.record_length < MIN_RECORD_LENGTH[h.format])
+        throw std::runtime_error{"Bad LAS point record length"};
+    if(h.offset_to_points > mf.size() ||
+       h.points > (mf.size() - h.offset_to_points) / h.record_length)
+        throw std::runtime_error{"Short LAS file"};
+    return h;
+}
+
+// Byte offset of the RGB triplet in a point record, or 0 if not present
+size_t
+rgbOffset(uint8_t format)
+{
+    switch(format) {
+    case 2:
+        return 20;
+    case 3:
+    case 5:
+        return 28;
+    case 7:
+    case 8:
+    case 10:
+        return 30;
+    default:
+        return 0;
+    }
+}
+
+// Decodes count records starting at base
+std::shared_ptr<VertexBuffer>
+decodeRecords(const LASHeader &h, const uint8_t *base, size_t count,
+              const glm::mat4 &transform, const glm::vec3 &bbmin,
+              const glm::vec3 &bbmax, const glm::dvec3 &origin)
+{
+    const size_t reclen = h.record_length;
+    const size_t rgb = rgbOffset(h.format);
+    const size_t class_offset = h.format >= 6 ? 16 : 15;
+    const uint8_t class_mask = h.format >= 6 ? 0xff : 0x1f;
+
+    std::vector<glm::vec3> positions(count);
+    std::vector<glm::vec4> colors(rgb ? count : 0);
+    std::vector<glm::vec2> aux(count);
+
+    // Dequantization is done in double precision so large georeferenced
+    // coordinates keep their resolution once they are made relative to
+    // origin. The final result is rounded to float.
+    const double add[3] = {h.offset[0] - origin.x, h.offset[1] - origin.y,
+                           h.offset[2] - origin.z};
+
+    std::vector<size_t> kept(parallelChunks(count));
+
+    parallelFor(count, [&](size_t begin, size_t end, size_t chunk) {
+#ifdef __SSE2__
+        const SSETransform t(transform);
+        const SSEBox box(bbmin, bbmax);
+#ifdef __AVX__
+        const __m256d s = _mm256_setr_pd(h.scale[0], h.scale[1], h.scale[2], 0);
+        const __m256d o = _mm256_setr_pd(add[0], add[1], add[2], 0);
+#else
+        const __m128d sxy = _mm_setr_pd(h.scale[0], h.scale[1]);
+        const __m128d sz = _mm_setr_pd(h.scale[2], 0);
+        const __m128d oxy = _mm_setr_pd(add[0], add[1]);
+        const __m128d oz = _mm_setr_pd(add[2], 0);
+#endif
+#endif
+        size_t j = begin;
+        for(size_t i = begin; i < end; i++) {
+            const uint8_t *rec = base + i * reclen;
+#ifdef __SSE2__
+            // X, Y, Z are the first three int32 of every record format.
+            // The fourth lane picks up intensity and is scaled by zero.
+            const __m128i q = _mm_loadu_si128((const __m128i *)rec);
+#ifdef __AVX__
+            const __m256d d =
+                _mm256_add_pd(_mm256_mul_pd(_mm256_cvtepi32_pd(q), s), o);
+            const __m128 v = _mm256_cvtpd_ps(d);
+#else
+            const __m128d dxy = _mm_add_pd(_mm_mul_pd(_mm_cvtepi32_pd(q), sxy),
+                                           oxy);
+            const __m128d dz = _mm_add_pd(
+                _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(q, 8)), sz), oz);
+            const __m128 v =
+                _mm_movelh_ps(_mm_cvtpd_ps(dxy), _mm_cvtpd_ps(dz));
+#endif
+            const __m128 p = t(v);
+            if(box.outside(p))
+                continue;
+
+            float tmp[4];
+            _mm_storeu_ps(tmp, p);
+            positions[j] = glm::vec3{tmp[0], tmp[1], tmp[2]};
+#else
+            const glm::vec3 v{rd<int32_t>(rec) * h.scale[0] + add[0],
+                              rd<int32_t>(rec + 4) * h.scale[1] + add[1],
+                              rd<int32_t>(rec + 8) * h.scale[2] + add[2]};
+            const auto p = transform * glm::vec4{v, 1};
+            if(p.x < bbmin.x || p.y < bbmin.y || p.z < bbmin.z ||
+               p.x > bbmax.x || p.y > bbmax.y || p.z > bbmax.z)
+                continue;
+            positions[j] = p;
+#endif
+            aux[j] = glm::vec2{rd<uint16_t>(rec + 12) * (1.0f / 65535.0f),
+                               rec[class_offset] & class_mask};
+            if(rgb) {
+                colors[j] = glm::vec4{rd<uint16_t>(rec + rgb) / 65535.0f,
+                                      rd<uint16_t>(rec + rgb + 2) / 65535.0f,
+                                      rd<uint16_t>(rec + rgb + 4) / 65535.0f,
+                                      1.0f};
+            }
+            j++;
+        }
+        kept[chunk] = j - begin;
+    });
+
+    // Close the gaps left by cropping in each chunk
+    size_t j = 0;
+    for(size_t chunk = 0; chunk < kept.size(); chunk++) {
+        const size_t begin = count * chunk / kept.size();
+        if(j != begin) {
+            std::copy_n(positions.begin() + begin, kept[chunk],
+                        positions.begin() + j);
+            std::copy_n(aux.begin() + begin, kept[chunk], aux.begin() + j);
+            if(rgb)
+                std::copy_n(colors.begin() + begin, kept[chunk],
+                            colors.begin() + j);
+        }
+        j += kept[chunk];
+    }
+
+    positions.resize(j);
+    aux.resize(j);
+    if(rgb)
+        colors.resize(j);
+
+    return VertexBuffer::make(std::move(positions), std::move(colors),
+                              std::move(aux));
+}
+
+}  // namespace
+
+std::shared_ptr<VertexBuffer>
+loadLAS(const char *path, const glm::mat4 transform, glm::vec3 bbmin,
+        glm::vec3 bbmax, const glm::dvec3 &origin)
+{
+    const struct {
+        glm::mat4 transform;
+        glm::vec3 bbmin, bbmax;
+        glm::dvec3 origin;
+    } args{transform, bbmin, bbmax, origin};
+
+    auto key = sceneCacheKey(path, "las", &args, sizeof(args));
+    if(key) {
+        if(auto c = sceneCacheLoad(*key))
+            return c->m_vb;
+    }
+
+    MappedFile mf(path);
+    const LASHeader h = parseHeader(mf);
+
+    auto vb = decodeRecords(h, mf.data() + h.offset_to_points, h.points,
+                            transform, bbmin, bbmax, origin);
+    if(key)
+        sceneCacheStore(*key, vb, nullptr);
+    return vb;
+}
+
+void
+scanLAS(const char *path, const std::function<void(const VertexBuffer &)> &fn,
+        const glm::dvec3 &origin, size_t chunk_points)
+{
+    MappedFile mf(path);
+    const LASHeader h = parseHeader(mf);
+    const uint8_t *base = mf.data() + h.offset_to_points;
+
+    for(size_t i = 0; i < h.points; i += chunk_points) {
+        const size_t n = std::min<size_t>(chunk_points, h.points - i);
+        auto vb = decodeRecords(h, base + i * h.record_length, n,
+                                glm::mat4{1}, glm::vec3{-INFINITY},
+                                glm::vec3{INFINITY}, origin);
+        fn(*vb);
+    }
+}
+
+}  // namespace g3d
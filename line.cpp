@@ -5,10 +5,8 @@
 #include "camera.hpp"
 
 static const char *line_vertex_shader = R"glsl(
-#version 330 core
 layout (location = 0) in vec3 vtx;
 
-uniform mat4 PV;
 uniform mat4 model;
 uniform vec4 col;
 
@@ -24,8 +22,6 @@ void main()
 
 static const char *line_fragment_shader = R"glsl(
 
-#version 330 core
-
 out vec4 FragColor;
 in vec4 fragmentColor;
 
@@ -51,12 +47,13 @@ struct Lines : public Object {
               const glm::mat4 &pt) override
     {
         if(!s_shader) {
-            s_shader = new Shader("line", NULL, line_vertex_shader, -1,
+            s_shader = new Shader("line",
+                                  "#version 330 core\n" FRAME_UNIFORMS_GLSL,
+                                  line_vertex_shader, -1,
                                   line_fragment_shader, -1);
         }
 
         s_shader->use();
-        s_shader->setMat4("PV", cam.m_P * cam.m_V);
         s_shader->setMat4("model", pt * m_model_matrix);
         s_shader->setVec4("col", m_color);
 
@@ -72,19 +69,20 @@ struct Lines : public Object {
             m_ib.reset();
         }
 
-        if(!m_attrib_buf.bind())
+        if(!m_attrib_buf.bindArray({VertexAttribute::Position}, &m_index_buf))
             return;
 
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_TRUE, 0, (void *)NULL);
-
-        if(m_index_buf.bind()) {
+        if(m_index_buf.id()) {
             glDrawElements(m_mode, m_draw_count * 2, GL_UNSIGNED_INT, NULL);
         } else {
             glDrawArrays(m_mode, 0, m_attrib_buf.size());
         }
+    }
 
-        glDisableVertexAttribArray(0);
+    uint64_t drawKey() const override
+    {
+        return (uint64_t)(s_shader ? s_shader->m_id : 0) << 32 |
+               m_attrib_buf.vertexArray();
     }
 
     void setColor(const glm::vec4 &ambient, const glm::vec4 &diffuse,
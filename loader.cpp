@@ -1,50 +1,31 @@
 #include <utility>
 #include <memory>
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 #include <system_error>
 
+#include "object.hpp"
 #include "vertexbuffer.hpp"
+#include "scenecache.hpp"
+#include "asyncload.hpp"
+#include "transform.hpp"
+#include "parallel.hpp"
 
 namespace g3d {
 
-std::pair<std::shared_ptr<VertexBuffer>,
-          std::shared_ptr<std::vector<glm::ivec3>>>
-loadOBJ(const char *path, const glm::mat4 transform)
-{
-    FILE *fp = fopen(path, "r");
-    if(fp == NULL)
-        throw std::system_error(errno, std::system_category());
+namespace {
 
-    std::vector<glm::vec3> vertices;
-    auto triangles = std::make_shared<std::vector<glm::ivec3>>();
+struct PCDHeader {
+    int width;
+    int height;
+    int points;
+};
 
-    while(!feof(fp)) {
-        double a, b, c;
-        char x;
-        if(fscanf(fp, "%c %lf %lf %lf\n", &x, &a, &b, &c) == 4) {
-            if(x == 'v') {
-                auto v = transform * glm::vec4{a, b, c, 1};
-                vertices.push_back(glm::vec3{v});
-            } else if(x == 'f') {
-                triangles->push_back(glm::ivec3{a - 1, b - 1, c - 1});
-            }
-        }
-    }
-    fclose(fp);
-    return {VertexBuffer::make(vertices), triangles};
-}
-
-std::shared_ptr<VertexBuffer>
-loadPCD(const char *path, const glm::mat4 transform,
-        glm::vec3 bbmin, glm::vec3 bbmax)
+// Leaves fp at the start of the binary point data
+PCDHeader
+readPCDHeader(FILE *fp)
 {
-    FILE *fp = fopen(path, "r");
-    if(fp == NULL)
-        throw std::system_error(errno, std::system_category());
-
-    std::vector<glm::vec3> vertices;
-
     char line[1024];
 
     int height = -1;
@@ -77,29 +58,251 @@ loadPCD(const char *path, const glm::mat4 transform,
     if(points < 1)
         throw std::runtime_error{"Unknown/Bad number of points"};
 
-    vertices.resize(points);
-    size_t c = fread(vertices.data(), sizeof(glm::vec3), points, fp);
-    if(c != points) {
-        throw std::runtime_error{"Short read"};
+    return PCDHeader{width, height, points};
+}
+
+}  // namespace
+
+std::pair<std::shared_ptr<VertexBuffer>,
+          std::shared_ptr<std::vector<glm::ivec3>>>
+loadOBJ(const char *path, const glm::mat4 transform)
+{
+    auto key = sceneCacheKey(path, "obj", &transform, sizeof(transform));
+    if(key) {
+        if(auto c = sceneCacheLoad(*key))
+            return {c->m_vb, c->m_ib};
     }
 
+    FILE *fp = fopen(path, "r");
+    if(fp == NULL)
+        throw std::system_error(errno, std::system_category());
+
+    std::vector<glm::vec3> vertices;
+    auto triangles = std::make_shared<std::vector<glm::ivec3>>();
+
+    while(!feof(fp)) {
+        double a, b, c;
+        char x;
+        if(fscanf(fp, "%c %lf %lf %lf\n", &x, &a, &b, &c) == 4) {
+            if(x == 'v') {
+                vertices.push_back(glm::vec3{a, b, c});
+            } else if(x == 'f') {
+                triangles->push_back(glm::ivec3{a - 1, b - 1, c - 1});
+            }
+        }
+    }
     fclose(fp);
 
-    size_t j = 0;
-    for(size_t i = 0; i < vertices.size(); i++) {
-        auto p = transform * glm::vec4{vertices[i], 1};
-        if(p.x < bbmin.x ||
-           p.y < bbmin.y ||
-           p.z < bbmin.z ||
-           p.x > bbmax.x ||
-           p.y > bbmax.y ||
-           p.z > bbmax.z)
-            continue;
-        vertices[j++] = p;
+    transformPositions(transform, (const float *)vertices.data(), 3,
+                       vertices.data(), vertices.size());
+
+    auto vb = VertexBuffer::make(std::move(vertices));
+    if(key)
+        sceneCacheStore(*key, vb, triangles);
+    return {vb, triangles};
+}
+
+namespace {
+
+// All points of a binary PCD file, untransformed
+std::vector<glm::vec3>
+readPCD(const char *path, PCDHeader &hdr)
+{
+    FILE *fp = fopen(path, "r");
+    if(fp == NULL)
+        throw std::system_error(errno, std::system_category());
+    std::unique_ptr<FILE, int (*)(FILE *)> closer(fp, fclose);
+
+    hdr = readPCDHeader(fp);
+
+    std::vector<glm::vec3> vertices(hdr.points);
+    size_t c = fread(vertices.data(), sizeof(glm::vec3), hdr.points, fp);
+    if(c != (size_t)hdr.points) {
+        throw std::runtime_error{"Short read"};
+    }
+    return vertices;
+}
+
+}  // namespace
+
+std::shared_ptr<VertexBuffer>
+loadPCD(const char *path, const glm::mat4 transform,
+        glm::vec3 bbmin, glm::vec3 bbmax)
+{
+    const struct {
+        glm::mat4 transform;
+        glm::vec3 bbmin, bbmax;
+    } args{transform, bbmin, bbmax};
+
+    auto key = sceneCacheKey(path, "pcd", &args, sizeof(args));
+    if(key) {
+        if(auto c = sceneCacheLoad(*key))
+            return c->m_vb;
     }
 
+    PCDHeader hdr;
+    std::vector<glm::vec3> vertices = readPCD(path, hdr);
+
+    const size_t j =
+        transformCrop(transform, bbmin, bbmax, (const float *)vertices.data(),
+                      3, vertices.data(), vertices.size());
     vertices.resize(j);
-    return VertexBuffer::make(vertices);
+
+    auto vb = VertexBuffer::make(std::move(vertices));
+    if(key)
+        sceneCacheStore(*key, vb, nullptr);
+    return vb;
+}
+
+std::shared_ptr<VertexBuffer>
+loadOrganizedPCD(const char *path, const glm::mat4 transform,
+                 glm::vec3 bbmin, glm::vec3 bbmax)
+{
+    const struct {
+        glm::mat4 transform;
+        glm::vec3 bbmin, bbmax;
+    } args{transform, bbmin, bbmax};
+
+    auto key = sceneCacheKey(path, "pcd-organized", &args, sizeof(args));
+    if(key) {
+        if(auto c = sceneCacheLoad(*key))
+            return c->m_vb;
+    }
+
+    PCDHeader hdr;
+    std::vector<glm::vec3> vertices = readPCD(path, hdr);
+    if(hdr.height < 1 || hdr.width < 1 ||
+       (size_t)hdr.width * hdr.height != vertices.size())
+        throw std::runtime_error{"PCD is not organized"};
+
+    // Keep the grid, points outside the box are invalidated instead
+    transformPositions(transform, (const float *)vertices.data(), 3,
+                       vertices.data(), vertices.size());
+    parallelFor(vertices.size(), [&](size_t begin, size_t end, size_t) {
+        for(size_t i = begin; i < end; i++) {
+            const glm::vec3 &p = vertices[i];
+            if(p.x < bbmin.x || p.y < bbmin.y || p.z < bbmin.z ||
+               p.x > bbmax.x || p.y > bbmax.y || p.z > bbmax.z)
+                vertices[i] = glm::vec3{NAN};
+        }
+    });
+
+    auto vb = VertexBuffer::make(std::move(vertices));
+    vb->set_grid(glm::uvec2{hdr.width, hdr.height});
+    if(key)
+        sceneCacheStore(*key, vb, nullptr);
+    return vb;
+}
+
+std::shared_ptr<AsyncLoad>
+loadOBJAsync(const char *path, const glm::mat4 transform, size_t chunk_size)
+{
+    auto load = std::make_shared<AsyncLoad>(path);
+    load->start([path = std::string(path), transform,
+                 chunk_size](AsyncLoad &load) {
+        auto key = sceneCacheKey(path.c_str(), "obj", &transform,
+                                 sizeof(transform));
+        if(key) {
+            if(auto c = sceneCacheLoad(*key)) {
+                load.setExpectedVertices(c->m_vb->size());
+                load.push(LoadChunk{c->m_vb, std::move(*c->m_ib)});
+                load.setProgress(1);
+                return;
+            }
+        }
+
+        std::unique_ptr<FILE, int (*)(FILE *)> fp(fopen(path.c_str(), "r"),
+                                                  fclose);
+        if(!fp)
+            throw std::system_error(errno, std::system_category());
+
+        fseek(fp.get(), 0, SEEK_END);
+        const long size = ftell(fp.get());
+        rewind(fp.get());
+
+        std::vector<glm::vec3> vertices;
+        std::vector<glm::ivec3> triangles;
+
+        auto flush = [&] {
+            transformPositions(transform, (const float *)vertices.data(),
+                               3, vertices.data(), vertices.size());
+            load.push(LoadChunk{
+                vertices.empty() ? nullptr
+                                 : VertexBuffer::make(std::move(vertices)),
+                std::move(triangles)});
+            vertices.clear();
+            triangles.clear();
+            load.setProgress(size > 0 ? (float)ftell(fp.get()) / size : 1);
+        };
+
+        while(!feof(fp.get())) {
+            double a, b, c;
+            char x;
+            if(fscanf(fp.get(), "%c %lf %lf %lf\n", &x, &a, &b, &c) == 4) {
+                if(x == 'v') {
+                    vertices.push_back(glm::vec3{a, b, c});
+                } else if(x == 'f') {
+                    triangles.push_back(glm::ivec3{a - 1, b - 1, c - 1});
+                }
+                if(vertices.size() + triangles.size() >= chunk_size)
+                    flush();
+            }
+        }
+        flush();
+    });
+    return load;
+}
+
+std::shared_ptr<AsyncLoad>
+loadPCDAsync(const char *path, const glm::mat4 transform, glm::vec3 bbmin,
+             glm::vec3 bbmax, size_t chunk_size)
+{
+    auto load = std::make_shared<AsyncLoad>(path);
+    load->start([path = std::string(path), transform, bbmin, bbmax,
+                 chunk_size](AsyncLoad &load) {
+        const struct {
+            glm::mat4 transform;
+            glm::vec3 bbmin, bbmax;
+        } args{transform, bbmin, bbmax};
+
+        auto key = sceneCacheKey(path.c_str(), "pcd", &args, sizeof(args));
+        if(key) {
+            if(auto c = sceneCacheLoad(*key)) {
+                load.setExpectedVertices(c->m_vb->size());
+                load.push(LoadChunk{c->m_vb, {}});
+                load.setProgress(1);
+                return;
+            }
+        }
+
+        std::unique_ptr<FILE, int (*)(FILE *)> fp(fopen(path.c_str(), "r"),
+                                                  fclose);
+        if(!fp)
+            throw std::system_error(errno, std::system_category());
+
+        const size_t points = readPCDHeader(fp.get()).points;
+        load.setExpectedVertices(points);
+
+        for(size_t i = 0; i < points;) {
+            std::vector<glm::vec3> vertices(std::min(chunk_size, points - i));
+            if(fread(vertices.data(), sizeof(glm::vec3), vertices.size(),
+                     fp.get()) != vertices.size())
+                throw std::runtime_error{"Short read"};
+            i += vertices.size();
+
+            const size_t j =
+                transformCrop(transform, bbmin, bbmax,
+                              (const float *)vertices.data(), 3,
+                              vertices.data(), vertices.size());
+            vertices.resize(j);
+
+            if(j)
+                load.push(
+                    LoadChunk{VertexBuffer::make(std::move(vertices)), {}});
+            load.setProgress((float)i / points);
+        }
+    });
+    return load;
 }
 
 }  // namespace g3d
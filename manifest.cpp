@@ -0,0 +1,389 @@
+#include "manifest.hpp"
+
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#include "image.hpp"
+#include "json.hpp"
+#include "mappedfile.hpp"
+#include "opengl.hpp"
+#include "pointcodec.hpp"
+
+namespace g3d {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double
+ms(Clock::time_point from, Clock::time_point to)
+{
+    return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+struct Job {
+    std::string m_path;
+    std::string m_texture;
+    std::string m_name;
+    glm::mat4 m_model{1};
+    glm::mat4 m_world{1};  // Of m_parent, relative to the manifest
+    std::optional<glm::vec4> m_color;
+    bool m_interactive{false};
+    std::vector<std::pair<std::string, float>> m_settings;
+    std::shared_ptr<Object> m_parent;
+};
+
+struct Finished {
+    size_t m_job;
+    std::shared_ptr<Object> m_object;
+    Clock::time_point m_first_draw{};
+};
+
+std::string
+dirname(const char *path)
+{
+    const char *s = strrchr(path, '/');
+    return s ? std::string(path, s - path + 1) : std::string();
+}
+
+std::string
+resolve(const std::string &dir, const std::string &path)
+{
+    return path.empty() || path[0] == '/' ? path : dir + path;
+}
+
+size_t
+fileSize(const std::string &path)
+{
+    struct stat st;
+    return path.empty() || stat(path.c_str(), &st) ? 0 : st.st_size;
+}
+
+// Reads the whole file so decoding finds it in the page cache
+void
+prefetch(const std::string &path)
+{
+    const int fd = open(path.c_str(), O_RDONLY);
+    if(fd == -1)
+        throw std::system_error(errno, std::system_category(), path);
+
+    std::vector<char> buf(4 * 1024 * 1024);
+    ssize_t r;
+    while((r = read(fd, buf.data(), buf.size())) > 0) {
+    }
+    const int err = errno;
+    close(fd);
+    if(r < 0)
+        throw std::system_error(err, std::system_category(), path);
+}
+
+glm::vec4
+vec4(const Json &j)
+{
+    glm::vec4 v{1};
+    for(size_t i = 0; i < 4 && i < j.size(); i++)
+        v[i] = j[i].num();
+    return v;
+}
+
+glm::mat4
+mat4(const Json &j)
+{
+    if(j.size() != 16)
+        throw std::runtime_error{"Manifest: transform needs 16 numbers"};
+    glm::mat4 m;
+    for(size_t i = 0; i < 16; i++)
+        m[i / 4][i % 4] = j[i].num();
+    return m;
+}
+
+std::shared_ptr<Object>
+decode(const Job &j)
+{
+    const char *path = j.m_path.c_str();
+    const char *ext = strrchr(path, '.');
+    ext = ext ? ext : "";
+
+    std::shared_ptr<Object> o;
+    if(!strcasecmp(ext, ".obj")) {
+        auto [vb, ib] = loadOBJ(path);
+        o = makeMesh(vb, ib, j.m_interactive);
+    } else if(!strcasecmp(ext, ".stl")) {
+        auto [vb, ib] = loadSTL(path);
+        o = makeMesh(vb, ib, j.m_interactive);
+    } else if(!strcasecmp(ext, ".pcd")) {
+        o = makePointCloud(loadPCD(path), j.m_interactive);
+    } else if(!strcasecmp(ext, ".las")) {
+        o = makePointCloud(loadLAS(path), j.m_interactive);
+    } else if(!strcasecmp(ext, ".g3p")) {
+        o = makePointCloud(loadPoints(path), j.m_interactive);
+    } else if(!strcasecmp(ext, ".glb") || !strcasecmp(ext, ".gltf")) {
+        o = loadGLTF(path, j.m_interactive);
+    } else if(!strcasecmp(ext, ".g3o")) {
+        o = loadOctree(path);
+    } else {
+        throw std::runtime_error{"Unsupported asset " + j.m_path};
+    }
+
+    if(!j.m_texture.empty())
+        o->set(std::make_shared<Image2D>(j.m_texture.c_str()));
+
+    o->setModelMatrix(j.m_model);
+    if(j.m_color)
+        o->setColor(*j.m_color);
+    for(const auto &[key, val] : j.m_settings)
+        o->set(key, val);
+    if(!j.m_name.empty())
+        o->m_name = j.m_name;
+    else if(!o->m_name)
+        o->m_name = j.m_path;
+    return o;
+}
+
+}  // namespace
+
+struct Manifest : public Object {
+    Manifest(const char *path, size_t max_bytes_in_flight)
+      : m_max_bytes(max_bytes_in_flight)
+    {
+        MappedFile mf(path);
+        JsonParser jp{(const char *)mf.data(),
+                      (const char *)mf.data() + mf.size()};
+        const Json doc = jp.value();
+
+        const Json &name = doc["name"];
+        m_root = makeGroup(name.m_type == Json::Type::String
+                               ? name.str().c_str()
+                               : path);
+        m_name = m_root->m_name;
+        node(doc, dirname(path), m_root, glm::mat4{1}, true);
+
+        m_timings.resize(m_jobs.size());
+        for(size_t i = 0; i < m_jobs.size(); i++)
+            m_timings[i].m_path = m_jobs[i].m_path;
+
+        const size_t workers = std::min<size_t>(
+            m_jobs.size(), std::max(4u, std::thread::hardware_concurrency()));
+        for(size_t i = 0; i < workers; i++)
+            m_workers.emplace_back([this] { worker(); });
+    }
+
+    ~Manifest()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_all();
+        for(auto &t : m_workers)
+            t.join();
+    }
+
+    // Groups are made up front, files become jobs
+    void node(const Json &n, const std::string &dir,
+              const std::shared_ptr<Object> &parent,
+              const glm::mat4 &parent_world, bool root)
+    {
+        const glm::mat4 model =
+            n.has("transform") ? mat4(n["transform"]) : glm::mat4{1};
+        const Json &children = n["children"];
+
+        std::shared_ptr<Object> group = parent;
+        glm::mat4 world = parent_world;
+        if(root || children.size()) {
+            if(!root) {
+                group = makeGroup(n["name"].str().c_str());
+                parent->addChild(group);
+            }
+            group->setModelMatrix(model);
+            world = parent_world * model;
+        }
+
+        if(n.has("file")) {
+            Job j;
+            j.m_path = resolve(dir, n["file"].str());
+            j.m_texture = resolve(dir, n["texture"].str());
+            // A leaf carries its own transform. The root's is already on
+            // m_root, which the loaded object is added to.
+            if(group == parent && !root) {
+                j.m_name = n["name"].str();
+                j.m_model = model;
+            }
+            j.m_world = world;
+            if(n.has("color"))
+                j.m_color = vec4(n["color"]);
+            j.m_interactive = n["interactive"].num() != 0;
+            const Json &set = n["set"];
+            for(size_t i = 0; i < set.m_keys.size(); i++)
+                j.m_settings.emplace_back(set.m_keys[i], set[i].num());
+            j.m_parent = group;
+            m_jobs.push_back(std::move(j));
+        }
+
+        for(size_t i = 0; i < children.size(); i++)
+            node(children[i], dir, group, world, false);
+    }
+
+    void worker()
+    {
+        while(1) {
+            const size_t i = m_next++;
+            if(i >= m_jobs.size())
+                return;
+            const Job &j = m_jobs[i];
+            const size_t bytes = fileSize(j.m_path) + fileSize(j.m_texture);
+
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cond.wait(lock, [&] {
+                    return m_stop || m_in_flight == 0 ||
+                           m_in_flight + bytes <= m_max_bytes;
+                });
+                if(m_stop)
+                    return;
+                m_in_flight += bytes;
+                m_timings[i].m_bytes = bytes;
+            }
+
+            try {
+                const auto t0 = Clock::now();
+                prefetch(j.m_path);
+                if(!j.m_texture.empty())
+                    prefetch(j.m_texture);
+                const auto t1 = Clock::now();
+                auto o = decode(j);
+                const auto t2 = Clock::now();
+
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_timings[i].m_io_ms = ms(t0, t1);
+                m_timings[i].m_decode_ms = ms(t1, t2);
+                m_finished.push_back(Finished{i, std::move(o)});
+            } catch(const std::exception &e) {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_timings[i].m_error = e.what();
+                    m_timings[i].m_done = true;
+                    m_in_flight -= bytes;
+                }
+                m_cond.notify_all();
+            }
+        }
+    }
+
+    void draw(const Scene &scene, const Camera &cam,
+              const glm::mat4 &pt) override
+    {
+        const glm::mat4 m = pt * m_model_matrix;
+        m_root->draw(scene, cam, m);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for(auto &f : m_finished) {
+                f.m_first_draw = Clock::now();
+                m_uploading.push_back(std::move(f));
+            }
+            m_finished.clear();
+        }
+        if(m_uploading.empty())
+            return;
+
+        // Drawn here, where they are never culled, until their data is on
+        // the GPU. Only then are their bytes no longer in flight.
+        bool released = false;
+        for(size_t i = 0; i < m_uploading.size();) {
+            Finished &f = m_uploading[i];
+            const Job &j = m_jobs[f.m_job];
+            drawObject(*f.m_object, scene, cam, m * j.m_world);
+            if(f.m_object->m_visible && f.m_object->uploading()) {
+                i++;
+                continue;
+            }
+            j.m_parent->addChild(f.m_object);
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                AssetTiming &t = m_timings[f.m_job];
+                t.m_upload_ms = ms(f.m_first_draw, Clock::now());
+                t.m_done = true;
+                m_in_flight -= t.m_bytes;
+            }
+            released = true;
+            m_uploading.erase(m_uploading.begin() + i);
+        }
+        if(released)
+            m_cond.notify_all();
+    }
+
+    void hit(const glm::vec3 &origin, const glm::vec3 &direction,
+             const glm::mat4 &parent_mm, Hit &hit) override
+    {
+        m_root->hit(origin, direction, parent_mm * m_model_matrix, hit);
+    }
+
+    void ui(const Scene &scene) override
+    {
+        ImGui::Checkbox("Visible", &m_visible);
+
+        const auto timings = manifestTimings(*this);
+        size_t done = 0;
+        for(const auto &t : timings)
+            done += t.m_done;
+        if(done < timings.size())
+            ImGui::ProgressBar((float)done / timings.size(), ImVec2(-1, 0));
+        ImGui::Text("%zd of %zd files", done, timings.size());
+
+        if(!ImGui::CollapsingHeader("Timings (ms)"))
+            return;
+        for(const auto &t : timings) {
+            if(t.m_error) {
+                ImGui::Text("%s: %s", t.m_path.c_str(), t.m_error->c_str());
+            } else if(t.m_done) {
+                ImGui::Text("%s: io %.1f decode %.1f upload %.1f",
+                            t.m_path.c_str(), t.m_io_ms, t.m_decode_ms,
+                            t.m_upload_ms);
+            }
+        }
+    }
+
+    const size_t m_max_bytes;
+    std::shared_ptr<Object> m_root;
+    std::vector<Job> m_jobs;
+
+    std::atomic<size_t> m_next{0};
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::vector<AssetTiming> m_timings;
+    std::vector<Finished> m_finished;
+    std::vector<Finished> m_uploading;  // Render thread only
+    size_t m_in_flight{0};
+    bool m_stop{false};
+
+    std::vector<std::thread> m_workers;
+};
+
+std::shared_ptr<Object>
+loadManifest(const char *path, size_t max_bytes_in_flight)
+{
+    return std::make_shared<Manifest>(path, max_bytes_in_flight);
+}
+
+std::vector<AssetTiming>
+manifestTimings(const Object &manifest)
+{
+    auto m = dynamic_cast<const Manifest *>(&manifest);
+    if(m == nullptr)
+        throw std::invalid_argument{"Not a manifest"};
+    std::lock_guard<std::mutex> lock(m->m_mutex);
+    return m->m_timings;
+}
+
+}  // namespace g3d
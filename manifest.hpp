@@ -0,0 +1,48 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "object.hpp"
+
+namespace g3d {
+
+// Asset manifest, a JSON tree of nodes:
+//
+// { "name": "Session",
+//   "children": [
+//     { "file": "scan.pcd", "transform": [ 16 numbers, column major ] },
+//     { "file": "part.obj", "texture": "part.png", "color": [1, 0, 0, 1],
+//       "interactive": true, "set": { "pointsize": 2 } },
+//     { "name": "Site", "children": [ ... ] }
+//   ]
+// }
+//
+// Nodes with children become Groups, a node's own file then goes inside
+// its Group. Paths are relative to the manifest. Files may be .obj, .stl,
+// .pcd, .las, .g3p, .glb, .gltf or .g3o, textures anything Image2D reads.
+
+struct AssetTiming {
+    std::string m_path;
+    size_t m_bytes{0};
+    double m_io_ms{0};      // Reading the file(s) into the page cache
+    double m_decode_ms{0};  // Parsing into an Object
+    double m_upload_ms{0};  // First draw until Object::uploading() is done
+    bool m_done{false};
+    std::optional<std::string> m_error;
+};
+
+// All files are read and decoded concurrently, with at most
+// max_bytes_in_flight of files decoded but not yet on the GPU. Objects are
+// attached to their Group on the render thread as they finish, so the
+// order within a Group is the order of completion.
+std::shared_ptr<Object> loadManifest(
+    const char *path, size_t max_bytes_in_flight = size_t{1} << 30);
+
+// Per file timings of an Object returned by loadManifest(), in manifest
+// order
+std::vector<AssetTiming> manifestTimings(const Object &manifest);
+
+}  // namespace g3d
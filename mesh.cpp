@@ -7,6 +7,9 @@
 #include "camera.hpp"
 #include "scene.hpp"
 #include "bvh.hpp"
+#include "asyncload.hpp"
+#include "occlusion.hpp"
+#include "transform.hpp"
 
 extern unsigned char phong_vertex_glsl[];
 extern int phong_vertex_glsl_len;
@@ -27,6 +30,13 @@ struct Mesh : public Object {
             m_update_index_buffer = true;
     }
 
+    Mesh(const std::shared_ptr<AsyncLoad> &load, bool interactive)
+      : m_interactive(interactive),
+        m_upload(std::make_unique<AsyncUpload>(load, interactive))
+    {
+        m_name = load->m_name;
+    }
+
     void hit(const glm::vec3 &origin, const glm::vec3 &direction,
              const glm::mat4 &parent_mm, Hit &hit) override
     {
@@ -58,52 +68,85 @@ struct Mesh : public Object {
     void draw(const Scene &scene, const Camera &cam,
               const glm::mat4 &pt) override
     {
-        if(m_update_index_buffer) {
-            m_update_index_buffer = false;
-            m_elements = m_ib->size();
-            m_drawcount = m_elements;
-            m_index_buf.write((void *)m_ib->data(),
-                              m_ib->size() * sizeof(glm::ivec3));
-        }
-
         if(m_vb) {
-            if(m_interactive && m_ib) {
+            // While the vertices are at hand
+            if(!m_bounds)
+                m_bounds = vertexBounds(*m_vb);
+            if(m_occluder)
+                takeOccluder(*m_vb, m_ib);
+
+            // The same VertexBuffer again only needs its changed ranges
+            const auto dirty = m_vb->take_dirty();
+            const bool partial = !m_staged && m_vb == m_loaded.lock() &&
+                                 !dirty.empty() &&
+                                 m_attrib_buf.update(*m_vb, dirty);
+
+            const bool moved = touches(dirty, VertexAttribute::Position);
+            if(m_interactive && m_ib && (!partial || moved)) {
                 m_intersector = Intersector::make(m_vb, m_ib);
             }
 
-            uint32_t mask = m_vb->get_attribute_mask();
+            if(!partial) {
+                // A replaced upload may not have got to its triangles
+                if(m_staged && m_staged->m_ib)
+                    m_update_index_buffer = true;
+                m_staged = std::make_unique<StagedUpload>(
+                    m_vb, m_update_index_buffer ? m_ib : nullptr,
+                    m_attrib_buf.layout());
+                m_update_index_buffer = false;
+            }
+            m_loaded = m_vb;
+            m_vb.reset();
+        }
 
+        if(m_staged) {
             // Recompile shader if attribute setup changes
-            if(m_attrib_buf.get_attribute_mask() ^ mask) {
-                char hdr[4096];
-
-                snprintf(hdr, sizeof(hdr),
-                         "#version 330 core\n"
-                         "%s%s%s",
-                         m_vb->get_elements(VertexAttribute::Normal)
-                             ? "#define PER_VERTEX_NORMAL\n"
-                             : "",
-                         m_vb->get_elements(VertexAttribute::Color)
-                             ? "#define PER_VERTEX_COLOR\n"
-                             : "",
-                         m_vb->get_elements(VertexAttribute::UV0)
-                             ? "#define TEX0\n"
-                             : "");
-
-                // clang-format off
-                m_shader = std::make_unique<Shader>("phong",
-            hdr,
-            (const char *)phong_vertex_glsl,   (int)phong_vertex_glsl_len,
-            (const char *)phong_fragment_glsl, (int)phong_fragment_glsl_len,
-            (const char *)phong_geometry_glsl, (int)phong_geometry_glsl_len);
-                // clang-format on
+            const uint32_t mask = m_attrib_buf.get_attribute_mask();
+            const bool more = m_staged->update(m_attrib_buf, &m_index_buf);
+            if(m_attrib_buf.get_attribute_mask() ^ mask)
+                compileShader(m_attrib_buf);
+
+            // Triangles need all their vertices, so wait for everything
+            if(more)
+                return;
+            if(m_staged->m_ib) {
+                m_elements = m_staged->m_ib->size();
+                m_drawcount = m_elements;
             }
+            m_staged.reset();
+        }
 
-            m_attrib_buf.load(*m_vb);
-            m_vb.reset();
+        if(m_upload) {
+            const uint32_t mask = m_attrib_buf.get_attribute_mask();
+            const bool more = m_upload->update(m_attrib_buf, &m_index_buf,
+                                               m_upload_budget);
+            if(m_drawcount == m_elements)
+                m_drawcount = m_upload->m_triangles;
+            m_elements = m_upload->m_triangles;
+
+            if(!more)
+                m_bounds = Bounds{m_upload->m_lo, m_upload->m_hi};
+            if(!more && m_upload->m_vb) {
+                if(m_occluder)
+                    takeOccluder(*m_upload->m_vb, m_upload->m_ib);
+                if(m_interactive)
+                    m_intersector =
+                        Intersector::make(m_upload->m_vb, m_upload->m_ib);
+                m_upload->m_vb.reset();
+                m_upload->m_ib.reset();
+            }
+            if(m_attrib_buf.get_attribute_mask() ^ mask)
+                compileShader(m_attrib_buf);
         }
 
-        if(!m_attrib_buf.bind())
+        if(!m_attrib_buf.bindArray(
+               {VertexAttribute::Position, VertexAttribute::Normal,
+                VertexAttribute::Color, VertexAttribute::UV0},
+               &m_index_buf))
+            return;
+
+        // Drawn once the driver has compiled it in the background
+        if(!m_shader->ready())
             return;
 
         Shader *s = m_shader.get();
@@ -114,17 +157,16 @@ struct Mesh : public Object {
         if(m_rigid)
             m = m_edit_matrix * m;
 
-        s->setMat4("PVM", cam.m_P * cam.m_V * m);
-        if(s->has_uniform("M")) {
-            s->setMat4("M", m);
-        }
+        s->setMat4("M", m);
+
+        if(m_occluder_pos)
+            Occlusion::addOccluder(m_occluder_pos, m_occluder_tris, m);
 
         if(m_attrib_buf.get_elements(VertexAttribute::Color)) {
             s->setFloat("per_vertex_color_blend", m_colorize);
         }
 
         if(scene.m_lightpos) {
-            s->setVec3("lightPos", *scene.m_lightpos);
             s->setVec3("diffuseColor", m_diffuse);
             s->setVec3("specularColor", m_specular);
             s->setVec3("ambientColor", m_ambient);
@@ -135,28 +177,6 @@ struct Mesh : public Object {
         s->setFloat("normalColorize", m_normal_colorize);
         s->setFloat("alpha", m_alpha);
 
-        if(s->has_uniform("viewPos")) {
-            s->setVec3("viewPos", glm::vec3{cam.m_VI[3]});
-        }
-
-        glEnableVertexAttribArray(0);
-        m_attrib_buf.ptr(0, VertexAttribute::Position);
-
-        if(m_attrib_buf.get_elements(VertexAttribute::Normal)) {
-            glEnableVertexAttribArray(1);
-            m_attrib_buf.ptr(1, VertexAttribute::Normal);
-        }
-
-        if(m_attrib_buf.get_elements(VertexAttribute::Color)) {
-            glEnableVertexAttribArray(2);
-            m_attrib_buf.ptr(2, VertexAttribute::Color);
-        }
-
-        if(m_attrib_buf.get_elements(VertexAttribute::UV0)) {
-            glEnableVertexAttribArray(3);
-            m_attrib_buf.ptr(3, VertexAttribute::UV0);
-        }
-
         GLuint tex0 = m_tex0.get();
         if(tex0) {
             glActiveTexture(GL_TEXTURE0);
@@ -170,7 +190,7 @@ struct Mesh : public Object {
         if(m_wireframe)
             glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 
-        if(m_index_buf.bind()) {
+        if(m_index_buf.id()) {
             glDrawElements(GL_TRIANGLES, m_drawcount * 3, GL_UNSIGNED_INT,
                            NULL);
         } else {
@@ -179,16 +199,66 @@ struct Mesh : public Object {
 
         glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
         glDisable(GL_CULL_FACE);
+    }
+
+    std::optional<Bounds> bounds() override
+    {
+        // The edit matrix applies in world space, so nothing is culled
+        // while editing
+        if(m_rigid)
+            return std::nullopt;
+        if(!m_bounds && m_vb)
+            m_bounds = vertexBounds(*m_vb);
+        return m_bounds;
+    }
 
-        glDisableVertexAttribArray(0);
-        glDisableVertexAttribArray(1);
-        glDisableVertexAttribArray(2);
-        glDisableVertexAttribArray(3);
+    uint64_t drawKey() const override
+    {
+        return (uint64_t)(m_shader ? m_shader->m_id : 0) << 32 |
+               m_attrib_buf.vertexArray();
+    }
+
+    bool translucent() const override { return m_alpha < 1; }
+
+    bool occluder() const override { return m_occluder; }
+
+    bool uploading() const override
+    {
+        return m_vb || m_staged || m_tex0.uploading();
+    }
+
+    void compileShader(const VertexBuffer &layout)
+    {
+        char hdr[4096];
+
+        snprintf(hdr, sizeof(hdr),
+                 "#version 330 core\n" FRAME_UNIFORMS_GLSL
+                 "%s%s%s",
+                 layout.get_elements(VertexAttribute::Normal)
+                     ? "#define PER_VERTEX_NORMAL\n"
+                     : "",
+                 layout.get_elements(VertexAttribute::Color)
+                     ? "#define PER_VERTEX_COLOR\n"
+                     : "",
+                 layout.get_elements(VertexAttribute::UV0)
+                     ? "#define TEX0\n"
+                     : "");
+
+        // clang-format off
+        m_shader = Shader::get("phong",
+            hdr,
+            (const char *)phong_vertex_glsl,   (int)phong_vertex_glsl_len,
+            (const char *)phong_fragment_glsl, (int)phong_fragment_glsl_len,
+            (const char *)phong_geometry_glsl, (int)phong_geometry_glsl_len);
+        // clang-format on
     }
 
     void ui(const Scene &scene) override
     {
         ImGui::Checkbox("Visible", &m_visible);
+
+        if(m_upload)
+            m_upload->ui();
         ImGui::Checkbox("Wireframe", &m_wireframe);
         ImGui::Checkbox("Backface culling", &m_backface_culling);
 
@@ -244,14 +314,56 @@ struct Mesh : public Object {
             m_colorize = val;
         if(key == "normalcolors")
             m_normal_colorize = val;
+        if(key == "upload_budget")
+            m_upload_budget = val * 1024 * 1024;
+        if(key == "usage")
+            m_attrib_buf.setUsage(bufferUsage(val));
+        if(key == "occluder") {
+            m_occluder = val;
+            if(!m_occluder) {
+                m_occluder_pos.reset();
+                m_occluder_tris.reset();
+            } else if(auto vb = m_loaded.lock(); vb && !m_occluder_pos) {
+                takeOccluder(*vb, m_ib);
+            }
+        }
+    }
+
+    // A copy of the positions, the VertexBuffer being the caller's to
+    // change. Without triangles every three vertices make one.
+    void takeOccluder(const VertexBuffer &vb,
+                      const std::shared_ptr<std::vector<glm::ivec3>> &ib)
+    {
+        auto pos = std::make_shared<std::vector<glm::vec3>>(vb.size());
+        transformPositions(glm::mat4{1},
+                           vb.get_attributes(VertexAttribute::Position),
+                           vb.get_stride(VertexAttribute::Position),
+                           pos->data(), pos->size());
+        m_occluder_pos = pos;
+
+        if(ib) {
+            m_occluder_tris = ib;
+            return;
+        }
+        auto tris = std::make_shared<std::vector<glm::ivec3>>(pos->size() / 3);
+        for(size_t i = 0; i < tris->size(); i++)
+            (*tris)[i] = glm::ivec3{i * 3, i * 3 + 1, i * 3 + 2};
+        m_occluder_tris = tris;
     }
 
-    void set(const std::shared_ptr<VertexBuffer> &vb) override { m_vb = vb; }
+    void set(const std::shared_ptr<VertexBuffer> &vb) override
+    {
+        if(vb != m_loaded.lock() ||
+           vb->is_dirty(VertexAttribute::Position))
+            m_bounds.reset();
+        m_vb = vb;
+        m_upload.reset();
+    }
 
     VertexAttribBuffer m_attrib_buf;
     ArrayBuffer m_index_buf{GL_ELEMENT_ARRAY_BUFFER};
 
-    std::unique_ptr<Shader> m_shader;
+    std::shared_ptr<Shader> m_shader;
     int m_drawcount{0};
     int m_elements{0};
 
@@ -269,9 +381,15 @@ struct Mesh : public Object {
     Texture2D m_tex0;
 
     std::shared_ptr<VertexBuffer> m_vb;
+    std::weak_ptr<VertexBuffer> m_loaded;  // What m_attrib_buf holds
+    std::optional<Bounds> m_bounds;        // Of m_vb, or m_loaded
     std::shared_ptr<std::vector<glm::ivec3>> m_ib;
     const bool m_interactive;
 
+    std::unique_ptr<AsyncUpload> m_upload;
+    size_t m_upload_budget{32 * 1024 * 1024};
+    std::unique_ptr<StagedUpload> m_staged;
+
     bool m_rigid{false};
     glm::vec3 m_translation{0};
     glm::vec3 m_rotation{0};
@@ -279,6 +397,10 @@ struct Mesh : public Object {
 
     std::shared_ptr<Intersector> m_intersector;
 
+    bool m_occluder{false};
+    std::shared_ptr<const std::vector<glm::vec3>> m_occluder_pos;
+    std::shared_ptr<const std::vector<glm::ivec3>> m_occluder_tris;
+
     bool m_update_index_buffer{false};
 };
 
@@ -290,4 +412,17 @@ makeMesh(const std::shared_ptr<VertexBuffer> &vb,
     return std::make_shared<Mesh>(vb, ibsp, interactive);
 }
 
+std::shared_ptr<Object>
+makeMesh(const std::shared_ptr<VertexBuffer> &vb,
+         const std::shared_ptr<std::vector<glm::ivec3>> &ib, bool interactive)
+{
+    return std::make_shared<Mesh>(vb, ib, interactive);
+}
+
+std::shared_ptr<Object>
+makeMesh(const std::shared_ptr<AsyncLoad> &load, bool interactive)
+{
+    return std::make_shared<Mesh>(load, interactive);
+}
+
 }  // namespace g3d
@@ -16,6 +16,7 @@ struct VertexBuffer;
 struct IndexBuffer;
 struct Image2D;
 struct Object;
+struct AsyncLoad;
 
 struct Hit {
     Object *object;
@@ -24,6 +25,29 @@ struct Hit {
     glm::vec3 world_pos;
 };
 
+// Axis aligned box, empty if lo > hi
+struct Bounds {
+    glm::vec3 lo{INFINITY};
+    glm::vec3 hi{-INFINITY};
+
+    bool empty() const { return lo.x > hi.x || lo.y > hi.y || lo.z > hi.z; }
+
+    void add(const Bounds &b)
+    {
+        lo = glm::min(lo, b.lo);
+        hi = glm::max(hi, b.hi);
+    }
+
+    // Box around this one transformed by m
+    Bounds transformed(const glm::mat4 &m) const;
+};
+
+// Of the positions of vb, computed in parallel
+Bounds vertexBounds(const VertexBuffer &vb);
+
+// False if the box is entirely outside one of the clip planes of pvm
+bool inFrustum(const glm::mat4 &pvm, const Bounds &b);
+
 enum class Control {
 
     ROTATE_START,
@@ -60,6 +84,8 @@ struct Object : public std::enable_shared_from_this<Object> {
 
     virtual void addChild(std::shared_ptr<Object> child) {}
 
+    // Giving the same VertexBuffer again after VertexBuffer::invalidate()
+    // uploads only the invalidated ranges
     virtual void set(const std::shared_ptr<VertexBuffer> &vb) {}
 
     virtual void set(const std::shared_ptr<Image2D> &tex) {}
@@ -79,6 +105,28 @@ struct Object : public std::enable_shared_from_this<Object> {
         return false;
     }
 
+    // Objects with equal keys draw with the same program and vertex
+    // array, so drawObjects() puts them next to each other
+    virtual uint64_t drawKey() const { return 0; }
+
+    // Objects that blend with what is behind them. drawObjects() draws
+    // them after the rest, in the order they were added, as blending
+    // depends on it
+    virtual bool translucent() const { return false; }
+
+    // True while data handed to the object is still on its way to the
+    // GPU, which happens as it draws
+    virtual bool uploading() const { return false; }
+
+    // Objects handing their triangles to Occlusion. drawObjects() does
+    // not test them against it, they would hide behind themselves.
+    virtual bool occluder() const { return false; }
+
+    // Local bounds, before m_model_matrix, for culling in drawObjects().
+    // Objects that do not know them (yet) return nullopt and are always
+    // drawn.
+    virtual std::optional<Bounds> bounds() { return std::nullopt; }
+
     glm::mat4 m_model_matrix{1};
 
     std::optional<std::string> m_name;
@@ -89,12 +137,70 @@ struct Object : public std::enable_shared_from_this<Object> {
 std::shared_ptr<Object> makePointCloud(const std::shared_ptr<VertexBuffer> &vb,
                                        bool interactive);
 
+// A copy of vb's points in progressive order, any prefix of it being a
+// spatially uniform subsample. Point clouds made from it draw only what
+// fits the PointBudget while the view changes, and every point once it is
+// still. Organized clouds lose their grid.
+std::shared_ptr<VertexBuffer> progressiveOrder(const VertexBuffer &vb);
+
+// GPU time per frame for all progressive point clouds together. Each
+// draws the same fraction of its points, sized so that their cost as
+// measured in the previous frame fits. Scenes call beginFrame() before
+// drawing; without it every point is drawn.
+struct PointBudget {
+    static void beginFrame(double budget_ms);
+
+    // For a cloud drawn this frame whose points all take ns of GPU time,
+    // the fraction of them to draw while the view changes
+    static double share(double ns);
+};
+
 std::shared_ptr<Object> makeCross();
 
+enum class Glyph {
+    Cross,      // As makeCross()
+    Icosphere,  // Radius 1
+    Arrow,      // From the origin to (0, 0, 1)
+    Frustum,    // Camera at the origin looking down -Z, image plane at 1
+};
+
+struct GlyphInstance {
+    glm::mat4 transform;
+    glm::vec4 color;  // Multiplies the glyph's own
+};
+
+// Thousands of markers in one instanced draw call instead of an object
+// each. Hit::primitive is the index of the instance picked, tested
+// against its bounding sphere.
+std::shared_ptr<Object> makeGlyphs(Glyph glyph,
+                                   std::vector<GlyphInstance> instances = {});
+
+// Replaces the instances of an object made by makeGlyphs(), uploaded when
+// next drawn
+void setGlyphInstances(Object &glyphs, std::vector<GlyphInstance> instances);
+
 std::shared_ptr<Object> makeMesh(const std::shared_ptr<VertexBuffer> &vb,
                                  const std::vector<glm::ivec3> &ib,
                                  bool interactive = false);
 
+std::shared_ptr<Object> makeMesh(
+    const std::shared_ptr<VertexBuffer> &vb,
+    const std::shared_ptr<std::vector<glm::ivec3>> &ib,
+    bool interactive = false);
+
+// Objects filled in from an asynchronous loader as chunks arrive. At most
+// "upload_budget" MB (see Object::set()) is uploaded per frame.
+std::shared_ptr<Object> makePointCloud(const std::shared_ptr<AsyncLoad> &load,
+                                       bool interactive);
+
+std::shared_ptr<Object> makeMesh(const std::shared_ptr<AsyncLoad> &load,
+                                 bool interactive = false);
+
+// Live point cloud (lidar, depth camera) showing the last `scans` scans of
+// up to max_points each, older ones fading out. A larger scan grows the
+// buffers to fit it. Hand it each scan with set(vb), from any thread.
+std::shared_ptr<Object> makePointStream(size_t scans, size_t max_points);
+
 std::shared_ptr<Object> makeSkybox();
 
 std::shared_ptr<Object> makeGround(float checkersize);
@@ -112,6 +218,20 @@ std::shared_ptr<Object> makeLines(const std::shared_ptr<VertexBuffer> &vb,
 
 std::shared_ptr<Object> makeGroup(const char *name);
 
+// Draws o if visible. If drawing throws, e.g. as its shader failed to
+// compile or link, the error goes to stderr and o is hidden, so it is
+// reported once rather than every frame.
+void drawObject(Object &o, const Scene &scene, const Camera &cam,
+                const glm::mat4 &parent_mm);
+
+// Draws the visible objects within the camera frustum and not hidden by
+// occluders (see Occlusion), ordered by Object::drawKey() with
+// translucent objects last, in their own order. Culled,
+// occluded and drawn objects are counted in DrawStats.
+void drawObjects(const std::vector<std::shared_ptr<Object>> &objects,
+                 const Scene &scene, const Camera &cam,
+                 const glm::mat4 &parent_mm);
+
 std::pair<std::shared_ptr<VertexBuffer>,
           std::shared_ptr<std::vector<glm::ivec3>>>
 loadOBJ(const char *path, const glm::mat4 transform = glm::mat4{1});
@@ -121,4 +241,55 @@ std::shared_ptr<VertexBuffer> loadPCD(const char *path,
                                       glm::vec3 bbmin = {-INFINITY,-INFINITY,-INFINITY},
                                       glm::vec3 bbmax = {INFINITY,INFINITY,INFINITY});
 
+// As loadPCD(), but keeping the WIDTH x HEIGHT grid (see
+// VertexBuffer::get_grid()). Points outside the box are set to NaN rather than
+// removed. Throws if WIDTH x HEIGHT is not the number of points.
+std::shared_ptr<VertexBuffer> loadOrganizedPCD(
+    const char *path, const glm::mat4 transform = glm::mat4{1},
+    glm::vec3 bbmin = {-INFINITY, -INFINITY, -INFINITY},
+    glm::vec3 bbmax = {INFINITY, INFINITY, INFINITY});
+
+// Background loading, see makePointCloud() and makeMesh() for display.
+// The file is delivered in chunks of about chunk_size vertices and faces.
+std::shared_ptr<AsyncLoad> loadOBJAsync(const char *path,
+                                        const glm::mat4 transform = glm::mat4{1},
+                                        size_t chunk_size = 1 << 18);
+
+std::shared_ptr<AsyncLoad> loadPCDAsync(const char *path,
+                                        const glm::mat4 transform = glm::mat4{1},
+                                        glm::vec3 bbmin = {-INFINITY,-INFINITY,-INFINITY},
+                                        glm::vec3 bbmax = {INFINITY,INFINITY,INFINITY},
+                                        size_t chunk_size = 1 << 18);
+
+// Uncompressed LAS 1.2 - 1.4. Positions are made relative to origin before
+// being converted to float. Aux holds normalized intensity and
+// classification, Color is set if the point format carries RGB.
+std::shared_ptr<VertexBuffer> loadLAS(const char *path,
+                                      const glm::mat4 transform = glm::mat4{1},
+                                      glm::vec3 bbmin = {-INFINITY,-INFINITY,-INFINITY},
+                                      glm::vec3 bbmax = {INFINITY,INFINITY,INFINITY},
+                                      const glm::dvec3 &origin = {0, 0, 0});
+
+struct WeldStats {
+    size_t vertices_in;
+    size_t vertices_out;
+    size_t bytes_saved;  // Compared to drawing the unindexed triangle soup
+};
+
+// Binary STL. Vertices sharing position (or grid cell of size weld_epsilon
+// if non-zero) are merged into one indexed vertex.
+std::pair<std::shared_ptr<VertexBuffer>,
+          std::shared_ptr<std::vector<glm::ivec3>>>
+loadSTL(const char *path, const glm::mat4 transform = glm::mat4{1},
+        float weld_epsilon = 0, WeldStats *stats = nullptr);
+
+// glTF 2.0 (.glb or .gltf with external buffers). Returns a Group per scene
+// node holding a Mesh per triangle primitive. Float attributes reference
+// the memory mapped buffers directly.
+std::shared_ptr<Object> loadGLTF(const char *path, bool interactive = false);
+
+// Level of detail point cloud made by buildOctree() (see octree.hpp).
+// Nodes are streamed from disk as the camera moves.
+std::shared_ptr<Object> loadOctree(const char *path);
+
 }  // namespace g3d
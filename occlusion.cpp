@@ -0,0 +1,343 @@
+#include "occlusion.hpp"
+
+#include <math.h>
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "parallel.hpp"
+
+namespace g3d {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// NDC depth by which a box may lie behind the pyramid and still count as
+// visible, as the buffer's interpolated depths are only approximate
+constexpr float DEPTH_BIAS = 1e-4f;
+
+struct Occluder {
+    std::shared_ptr<const std::vector<glm::vec3>> positions;
+    std::shared_ptr<const std::vector<glm::ivec3>> triangles;
+    glm::mat4 m;
+};
+
+// A triangle in buffer pixels, counter-clockwise. Inside where none of the
+// three edge functions a * x + b * y + c is negative, depth there being
+// dz.x * x + dz.y * y + dz.z.
+struct ScreenTriangle {
+    glm::vec3 edge[3];
+    glm::vec3 dz;
+    int x0, x1, y0, y1;  // Pixels covered, inclusive
+};
+
+// Max depth of each 2x2 block of the level below, level 0 being the
+// depth buffer itself. NDC depth, 1 where nothing was drawn.
+struct Pyramid {
+    std::vector<std::vector<float>> m_levels;
+    std::vector<glm::ivec2> m_sizes;
+};
+
+bool s_active;
+std::vector<Occluder> s_next;
+std::future<void> s_raster;
+Pyramid s_pyramid;
+bool s_empty{true};  // No occluders this frame
+
+OcclusionStats s_stats;
+OcclusionStats s_last_stats;
+
+// Triangles crossing the near plane are left out, which only lets more
+// through
+void
+setup(const Occluder &o, const glm::mat4 &pv,
+      std::vector<ScreenTriangle> &out)
+{
+    const glm::mat4 pvm = pv * o.m;
+    const auto &pos = *o.positions;
+    std::vector<glm::vec4> clip(pos.size());
+    for(size_t i = 0; i < pos.size(); i++)
+        clip[i] = pvm * glm::vec4{pos[i], 1};
+
+    const glm::vec2 scale{Occlusion::WIDTH * 0.5f, Occlusion::HEIGHT * 0.5f};
+
+    for(const auto &t : *o.triangles) {
+        glm::vec2 p[3];
+        float z[3];
+        bool skip = false;
+        for(int i = 0; i < 3; i++) {
+            if((size_t)t[i] >= clip.size()) {
+                skip = true;
+                break;
+            }
+            const glm::vec4 &c = clip[t[i]];
+            if(c.w < 1e-6f || c.z < -c.w) {
+                skip = true;
+                break;
+            }
+            p[i] = (glm::vec2{c} / c.w + 1.0f) * scale;
+            z[i] = std::min(c.z / c.w, 1.0f);
+        }
+        if(skip)
+            continue;
+
+        float area = (p[1].x - p[0].x) * (p[2].y - p[0].y) -
+                     (p[1].y - p[0].y) * (p[2].x - p[0].x);
+        // Also leaves out NaN vertices
+        if(!(fabsf(area) >= 1e-6f))
+            continue;
+        if(area < 0) {
+            // Either facing will do
+            std::swap(p[1], p[2]);
+            std::swap(z[1], z[2]);
+            area = -area;
+        }
+
+        ScreenTriangle st;
+        const glm::vec2 lo = glm::min(p[0], glm::min(p[1], p[2]));
+        const glm::vec2 hi = glm::max(p[0], glm::max(p[1], p[2]));
+        st.x0 = std::max(0, (int)floorf(lo.x));
+        st.y0 = std::max(0, (int)floorf(lo.y));
+        st.x1 = std::min(Occlusion::WIDTH - 1, (int)floorf(hi.x));
+        st.y1 = std::min(Occlusion::HEIGHT - 1, (int)floorf(hi.y));
+        if(st.x0 > st.x1 || st.y0 > st.y1)
+            continue;
+
+        // Triangles sharing an edge work it out from the same end, one
+        // negating it, so pixel centers on it go to at least one of them
+        for(int i = 0; i < 3; i++) {
+            glm::vec2 a = p[i];
+            glm::vec2 b = p[(i + 1) % 3];
+            const bool flip = b.x < a.x || (b.x == a.x && b.y < a.y);
+            if(flip)
+                std::swap(a, b);
+            const float ea = a.y - b.y;
+            const float eb = b.x - a.x;
+            st.edge[i] = glm::vec3{ea, eb, -(ea * a.x + eb * a.y)};
+            if(flip)
+                st.edge[i] = -st.edge[i];
+        }
+
+        const float dzdx = ((z[1] - z[0]) * (p[2].y - p[0].y) -
+                            (z[2] - z[0]) * (p[1].y - p[0].y)) /
+                           area;
+        const float dzdy = ((z[2] - z[0]) * (p[1].x - p[0].x) -
+                            (z[1] - z[0]) * (p[2].x - p[0].x)) /
+                           area;
+        st.dz = glm::vec3{dzdx, dzdy, z[0] - dzdx * p[0].x - dzdy * p[0].y};
+        out.push_back(st);
+    }
+}
+
+// Rows [y0, y1] of the triangle, nearest depth kept. Four pixels at a
+// time with SSE, starting at a multiple of four.
+void
+rasterize(const ScreenTriangle &t, int y0, int y1, float *depth)
+{
+    y0 = std::max(y0, t.y0);
+    y1 = std::min(y1, t.y1);
+
+#ifdef __SSE2__
+    const int x0 = t.x0 & ~3;
+    const __m128 step = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+    const __m128 zero = _mm_setzero_ps();
+    __m128 ea[3], eb[3], ec[3];
+    for(int i = 0; i < 3; i++) {
+        ea[i] = _mm_set1_ps(t.edge[i].x);
+        eb[i] = _mm_set1_ps(t.edge[i].y);
+        ec[i] = _mm_set1_ps(t.edge[i].z);
+    }
+    const __m128 za = _mm_set1_ps(t.dz.x);
+
+    for(int y = y0; y <= y1; y++) {
+        const __m128 py = _mm_set1_ps(y + 0.5f);
+        __m128 row[3];
+        for(int i = 0; i < 3; i++)
+            row[i] = _mm_add_ps(_mm_mul_ps(eb[i], py), ec[i]);
+        const __m128 zrow = _mm_set1_ps(t.dz.y * (y + 0.5f) + t.dz.z);
+        float *d = depth + y * Occlusion::WIDTH;
+
+        for(int x = x0; x <= t.x1; x += 4) {
+            const __m128 px = _mm_add_ps(_mm_set1_ps((float)x), step);
+            __m128 inside = _mm_cmpge_ps(
+                _mm_add_ps(_mm_mul_ps(ea[0], px), row[0]), zero);
+            for(int i = 1; i < 3; i++) {
+                inside = _mm_and_ps(
+                    inside,
+                    _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(ea[i], px), row[i]),
+                                 zero));
+            }
+            if(_mm_movemask_ps(inside) == 0)
+                continue;
+            const __m128 old = _mm_loadu_ps(d + x);
+            const __m128 z =
+                _mm_min_ps(old, _mm_add_ps(_mm_mul_ps(za, px), zrow));
+            _mm_storeu_ps(d + x, _mm_or_ps(_mm_and_ps(inside, z),
+                                           _mm_andnot_ps(inside, old)));
+        }
+    }
+#else
+    for(int y = y0; y <= y1; y++) {
+        const float py = y + 0.5f;
+        float *d = depth + y * Occlusion::WIDTH;
+        for(int x = t.x0; x <= t.x1; x++) {
+            const float px = x + 0.5f;
+            bool inside = true;
+            for(int i = 0; i < 3; i++) {
+                const float e = t.edge[i].y * py + t.edge[i].z;
+                inside &= t.edge[i].x * px + e >= 0;
+            }
+            if(inside)
+                d[x] = std::min(d[x], t.dz.x * px + t.dz.y * py + t.dz.z);
+        }
+    }
+#endif
+}
+
+void
+build(std::vector<Occluder> occluders, const glm::mat4 &pv)
+{
+    const auto t0 = Clock::now();
+
+    std::vector<ScreenTriangle> triangles;
+    for(const auto &o : occluders)
+        setup(o, pv, triangles);
+
+    Pyramid &p = s_pyramid;
+    p.m_levels.resize(1);
+    p.m_sizes.assign(1, glm::ivec2{Occlusion::WIDTH, Occlusion::HEIGHT});
+    std::vector<float> &depth = p.m_levels[0];
+    depth.assign(Occlusion::WIDTH * Occlusion::HEIGHT, 1.0f);
+
+    // Bands of rows, each thread going over every triangle
+    parallelFor(
+        Occlusion::HEIGHT,
+        [&](size_t begin, size_t end, size_t chunk) {
+            for(const auto &t : triangles) {
+                if(t.y1 >= (int)begin && t.y0 < (int)end)
+                    rasterize(t, begin, end - 1, depth.data());
+            }
+        },
+        8);
+
+    for(glm::ivec2 size = p.m_sizes[0]; size.x > 1 && size.y > 1;) {
+        const std::vector<float> &below = p.m_levels.back();
+        const int w = size.x;
+        size /= 2;
+        std::vector<float> level(size.x * size.y);
+        for(int y = 0; y < size.y; y++) {
+            for(int x = 0; x < size.x; x++) {
+                const float *b = &below[y * 2 * w + x * 2];
+                level[y * size.x + x] =
+                    std::max(std::max(b[0], b[1]), std::max(b[w], b[w + 1]));
+            }
+        }
+        p.m_levels.push_back(std::move(level));
+        p.m_sizes.push_back(size);
+    }
+
+    s_stats.m_triangles = triangles.size();
+    s_stats.m_ms =
+        std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+}
+
+}  // namespace
+
+void
+Occlusion::beginFrame(const glm::mat4 &pv)
+{
+    if(s_raster.valid())
+        s_raster.get();
+
+    s_active = true;
+    s_last_stats = s_stats;
+    s_stats = OcclusionStats{};
+    s_stats.m_occluders = s_next.size();
+    s_empty = s_next.empty();
+    if(s_empty)
+        return;
+
+    s_raster = std::async(std::launch::async, build, std::move(s_next), pv);
+    s_next.clear();
+}
+
+void
+Occlusion::addOccluder(
+    const std::shared_ptr<const std::vector<glm::vec3>> &positions,
+    const std::shared_ptr<const std::vector<glm::ivec3>> &triangles,
+    const glm::mat4 &m)
+{
+    if(s_active && positions && triangles)
+        s_next.push_back(Occluder{positions, triangles, m});
+}
+
+bool
+Occlusion::visible(const glm::mat4 &pvm, const Bounds &b)
+{
+    if(s_empty || b.empty())
+        return true;
+    if(s_raster.valid())
+        s_raster.get();
+
+    glm::vec2 lo{INFINITY}, hi{-INFINITY};
+    float zmin = INFINITY;
+    for(int i = 0; i < 8; i++) {
+        const glm::vec4 c =
+            pvm * glm::vec4{i & 1 ? b.hi.x : b.lo.x, i & 2 ? b.hi.y : b.lo.y,
+                            i & 4 ? b.hi.z : b.lo.z, 1};
+        // Reaching behind the camera, or near plane
+        if(c.w < 1e-6f || c.z < -c.w)
+            return true;
+        const glm::vec2 p = glm::vec2{c} / c.w;
+        lo = glm::min(lo, p);
+        hi = glm::max(hi, p);
+        zmin = std::min(zmin, c.z / c.w);
+    }
+
+    // Off screen is for the frustum test to decide
+    const glm::vec2 scale{WIDTH * 0.5f, HEIGHT * 0.5f};
+    lo = (lo + 1.0f) * scale;
+    hi = (hi + 1.0f) * scale;
+    if(hi.x < 0 || hi.y < 0 || lo.x >= WIDTH || lo.y >= HEIGHT)
+        return true;
+    int x0 = std::max(0, (int)floorf(lo.x));
+    int y0 = std::max(0, (int)floorf(lo.y));
+    int x1 = std::min(WIDTH - 1, (int)floorf(hi.x));
+    int y1 = std::min(HEIGHT - 1, (int)floorf(hi.y));
+
+    // The level where the rectangle spans at most 2x2 texels
+    const Pyramid &p = s_pyramid;
+    size_t level = 0;
+    while(level + 1 < p.m_levels.size() &&
+          (x1 - x0 > 1 || y1 - y0 > 1)) {
+        level++;
+        x0 >>= 1;
+        y0 >>= 1;
+        x1 >>= 1;
+        y1 >>= 1;
+    }
+
+    const std::vector<float> &d = p.m_levels[level];
+    const int w = p.m_sizes[level].x;
+    float farthest = -INFINITY;
+    for(int y = y0; y <= y1; y++) {
+        for(int x = x0; x <= x1; x++)
+            farthest = std::max(farthest, d[y * w + x]);
+    }
+    // Surfaces lying on an occluder are not behind it
+    return zmin <= farthest + DEPTH_BIAS;
+}
+
+OcclusionStats
+Occlusion::lastFrame()
+{
+    return s_last_stats;
+}
+
+}  // namespace g3d
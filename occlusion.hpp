@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <memory>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "object.hpp"
+
+namespace g3d {
+
+struct OcclusionStats {
+    size_t m_occluders{0};
+    size_t m_triangles{0};  // Rasterized, after rejecting
+    double m_ms{0};         // Worker time, rasterizing and building
+};
+
+// Software occlusion culling. Meshes marked as occluders (Object::set()
+// "occluder" 1) hand over their triangles as they draw. When the next
+// frame begins they are rasterized into a small depth buffer on worker
+// threads, while the scene handles input and UI, and drawObjects() tests
+// the bounds of each other object against a max-depth pyramid of it.
+//
+// Occluders are a frame behind, which static geometry does not notice.
+// Coverage is sampled at pixel centers, so objects peeking past an
+// occluder's silhouette by less than a pixel of the buffer may be culled.
+struct Occlusion {
+    static constexpr int WIDTH = 256;
+    static constexpr int HEIGHT = 128;
+
+    // Starts rasterizing the occluders of the previous frame as seen by
+    // pv. Scenes call this once per frame; without it nothing is culled.
+    static void beginFrame(const glm::mat4 &pv);
+
+    // Triangles in local coordinates, m taking them to world
+    static void addOccluder(
+        const std::shared_ptr<const std::vector<glm::vec3>> &positions,
+        const std::shared_ptr<const std::vector<glm::ivec3>> &triangles,
+        const glm::mat4 &m);
+
+    // False if the box, pvm taking it to clip space, is certainly hidden
+    // behind occluders. Waits for the rasterizer the first time.
+    static bool visible(const glm::mat4 &pvm, const Bounds &b);
+
+    // Of the previous frame
+    static OcclusionStats lastFrame();
+};
+
+}  // namespace g3d
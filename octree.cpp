@@ -0,0 +1,431 @@
+#include "octree.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <stdexcept>
+#include <thread>
+
+#include "object.hpp"
+#include "arraybuffer.hpp"
+#include "camera.hpp"
+#include "drawstate.hpp"
+#include "mappedfile.hpp"
+#include "opengl.hpp"
+#include "pointcodec.hpp"
+#include "scene.hpp"
+#include "shader.hpp"
+
+static const char *octree_vertex_shader = R"glsl(
+layout (location = 0) in vec3 aPos;
+
+#ifdef PER_VERTEX_COLOR
+layout (location = 1) in vec4 aCol;
+#endif
+
+uniform mat4 model;
+uniform vec4 albedo;
+uniform int pointsize;
+
+out vec4 fragmentColor;
+
+void main()
+{
+   gl_Position = PV * model * vec4(aPos.xyz, 1);
+   gl_PointSize = pointsize;
+#ifdef PER_VERTEX_COLOR
+   fragmentColor = aCol * albedo;
+#else
+   fragmentColor = albedo;
+#endif
+}
+
+)glsl";
+
+static const char *octree_fragment_shader = R"glsl(
+out vec4 FragColor;
+in vec4 fragmentColor;
+
+void main()
+{
+  FragColor = fragmentColor;
+}
+
+)glsl";
+
+namespace g3d {
+
+// Draws the nodes whose point spacing, projected to the screen, is
+// coarser than m_error_px, coarsest first until m_point_budget is
+// reached. Nodes are decoded by worker threads and kept on the GPU until
+// m_gpu_budget is exceeded, least recently drawn going first.
+struct Octree : public Object {
+    struct Node {
+        const G3ONode *rec;
+        glm::vec3 lo;
+        float size;
+        std::unique_ptr<VertexAttribBuffer> gpu;
+        std::list<uint32_t>::iterator lru;
+    };
+
+    Octree(const char *path) : m_file(path)
+    {
+        m_name = "Octree";
+
+        if(m_file.size() < sizeof(G3OHeader))
+            throw std::runtime_error{"Truncated octree"};
+        memcpy(&m_h, m_file.data(), sizeof(m_h));
+        if(memcmp(m_h.magic, "G3O", 4) || m_h.version != G3O_VERSION)
+            throw std::runtime_error{"Not a .g3o file or wrong version"};
+        if(m_h.nodes == 0 || m_h.table_offset > m_file.size() ||
+           (m_file.size() - m_h.table_offset) / sizeof(G3ONode) < m_h.nodes)
+            throw std::runtime_error{"Truncated octree"};
+
+        const G3ONode *table =
+            (const G3ONode *)(m_file.data() + m_h.table_offset);
+        m_nodes.resize(m_h.nodes);
+        m_nodes[0].lo = glm::vec3{m_h.cube_min[0], m_h.cube_min[1],
+                                  m_h.cube_min[2]};
+        m_nodes[0].size = m_h.cube_size;
+
+        for(uint32_t i = 0; i < m_h.nodes; i++) {
+            Node &n = m_nodes[i];
+            n.rec = &table[i];
+            if(n.rec->offset > m_file.size() ||
+               n.rec->size > m_file.size() - n.rec->offset)
+                throw std::runtime_error{"Octree node out of bounds"};
+            if(!n.rec->child_mask)
+                continue;
+            if(n.rec->first_child <= i ||
+               n.rec->first_child + __builtin_popcount(n.rec->child_mask) >
+                   m_h.nodes)
+                throw std::runtime_error{"Corrupt octree node table"};
+
+            const float half = n.size * 0.5f;
+            uint32_t c = n.rec->first_child;
+            for(int o = 0; o < 8; o++) {
+                if(!(n.rec->child_mask & (1 << o)))
+                    continue;
+                m_nodes[c].lo = n.lo + half * glm::vec3(o & 1, (o >> 1) & 1,
+                                                        (o >> 2) & 1);
+                m_nodes[c].size = half;
+                c++;
+            }
+        }
+
+        const size_t workers =
+            std::clamp(std::thread::hardware_concurrency() / 2, 1u, 4u);
+        for(size_t i = 0; i < workers; i++)
+            m_workers.emplace_back([this] { worker(); });
+    }
+
+    ~Octree()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_all();
+        for(auto &t : m_workers)
+            t.join();
+    }
+
+    void worker()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while(1) {
+            m_cond.wait(lock, [&] {
+                return m_stop || (!m_requests.empty() &&
+                                  m_decoded.size() < MAX_DECODED);
+            });
+            if(m_stop)
+                return;
+
+            const uint32_t index = m_requests.back();
+            m_requests.pop_back();
+            m_inflight.insert(index);
+            lock.unlock();
+
+            const G3ONode &rec = *m_nodes[index].rec;
+            std::shared_ptr<VertexBuffer> vb;
+            std::optional<std::string> error;
+            try {
+                decodePoints(m_file.data() + rec.offset, rec.size,
+                             [&](size_t block, size_t blocks,
+                                 const std::shared_ptr<VertexBuffer> &b) {
+                                 if(blocks != 1)
+                                     throw std::runtime_error{
+                                         "Octree node with several blocks"};
+                                 vb = b;
+                             });
+            } catch(const std::exception &e) {
+                error = e.what();
+            }
+
+            lock.lock();
+            if(error)
+                m_error = error;
+            else
+                m_decoded.emplace_back(index, vb);
+        }
+    }
+
+    void draw(const Scene &scene, const Camera &cam,
+              const glm::mat4 &pt) override
+    {
+        upload();
+
+        const glm::mat4 m = pt * m_model_matrix;
+        const glm::mat4 pvm = cam.m_P * cam.m_V * m;
+        const glm::vec3 eye = cam.origin();
+        const float scale = glm::length(glm::vec3(m[0]));
+
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        const float px_per_unit = viewport[3] * 0.5f * cam.m_P[1][1];
+
+        // Projected point spacing in pixels
+        auto error = [&](const Node &n) {
+            const glm::vec3 center = m * glm::vec4(n.lo + n.size * 0.5f, 1);
+            const float radius = n.size * scale * 0.8660254f;
+            const float d = std::max(glm::distance(center, eye) - radius,
+                                     radius * 1e-3f);
+            return n.size * scale / m_h.grid * px_per_unit / d;
+        };
+
+        auto cull = [&](const Node &n) {
+            return !inFrustum(pvm, Bounds{n.lo, n.lo + glm::vec3{n.size}});
+        };
+
+        std::priority_queue<std::pair<float, uint32_t>> queue;
+        std::vector<uint32_t> wanted;
+        m_drawn.clear();
+        m_drawn_points = 0;
+
+        if(!cull(m_nodes[0]))
+            queue.emplace(INFINITY, 0);
+
+        while(!queue.empty() && m_drawn_points < m_point_budget) {
+            const auto [err, index] = queue.top();
+            queue.pop();
+            Node &n = m_nodes[index];
+
+            if(!n.gpu) {
+                // Children are not drawn without their ancestors
+                wanted.push_back(index);
+                continue;
+            }
+
+            m_lru.splice(m_lru.begin(), m_lru, n.lru);
+            m_drawn.push_back(index);
+            m_drawn_points += n.rec->points;
+
+            if(err <= m_error_px || !n.rec->child_mask)
+                continue;
+
+            uint32_t c = n.rec->first_child;
+            for(int o = 0; o < 8; o++) {
+                if(!(n.rec->child_mask & (1 << o)))
+                    continue;
+                if(!cull(m_nodes[c]))
+                    queue.emplace(error(m_nodes[c]), c);
+                c++;
+            }
+        }
+
+        {
+            // Most wanted at the back, where the workers take from
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_requests.clear();
+            for(auto it = wanted.rbegin(); it != wanted.rend(); ++it) {
+                if(!m_inflight.count(*it))
+                    m_requests.push_back(*it);
+            }
+        }
+        m_cond.notify_all();
+
+        evict();
+
+        if(m_drawn.empty())
+            return;
+
+        if(!m_shader)
+            compileShader();
+        if(!m_shader->ready())
+            return;
+
+        Shader *s = m_shader.get();
+        s->use();
+        s->setMat4("model", m);
+        s->setVec4("albedo", m_color);
+        s->setInt("pointsize", m_pointsize);
+
+        glEnable(GL_PROGRAM_POINT_SIZE);
+
+        // Each node has its own vertex array, set up when first drawn
+        for(uint32_t index : m_drawn) {
+            VertexAttribBuffer &vab = *m_nodes[index].gpu;
+            if(!vab.bindArray(
+                   {VertexAttribute::Position, VertexAttribute::Color}))
+                continue;
+            glDrawArrays(GL_POINTS, 0, vab.size());
+        }
+
+        glDisable(GL_PROGRAM_POINT_SIZE);
+    }
+
+    uint64_t drawKey() const override
+    {
+        return (uint64_t)(m_shader ? m_shader->m_id : 0) << 32;
+    }
+
+    std::optional<Bounds> bounds() override
+    {
+        const Node &root = m_nodes[0];
+        return Bounds{root.lo, root.lo + glm::vec3{root.size}};
+    }
+
+    // Moves decoded nodes to the GPU, at most m_upload_budget bytes
+    void upload()
+    {
+        size_t budget = m_upload_budget;
+        while(budget > 0) {
+            std::pair<uint32_t, std::shared_ptr<VertexBuffer>> d;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if(m_decoded.empty())
+                    break;
+                d = std::move(m_decoded.front());
+                m_decoded.pop_front();
+                m_inflight.erase(d.first);
+            }
+            m_cond.notify_all();
+
+            Node &n = m_nodes[d.first];
+            if(n.gpu)
+                continue;
+            n.gpu = std::make_unique<VertexAttribBuffer>();
+            n.gpu->load(*d.second);
+            const size_t bytes = n.gpu->size() * n.gpu->byte_stride();
+            m_gpu_bytes += bytes;
+            m_lru.push_front(d.first);
+            n.lru = m_lru.begin();
+            budget -= std::min(budget, bytes);
+        }
+    }
+
+    void evict()
+    {
+        size_t drawn = m_drawn.size();
+        while(m_gpu_bytes > m_gpu_budget && m_lru.size() > drawn) {
+            Node &n = m_nodes[m_lru.back()];
+            m_gpu_bytes -= n.gpu->size() * n.gpu->byte_stride();
+            n.gpu.reset();
+            m_lru.pop_back();
+        }
+    }
+
+    void compileShader()
+    {
+        char hdr[4096];
+        snprintf(hdr, sizeof(hdr),
+                 "#version 330 core\n" FRAME_UNIFORMS_GLSL
+                 "%s",
+                 m_h.color ? "#define PER_VERTEX_COLOR\n" : "");
+        m_shader = Shader::get("octree", hdr, octree_vertex_shader, -1,
+                               octree_fragment_shader, -1);
+    }
+
+    void setColor(const glm::vec4 &ambient, const glm::vec4 &diffuse,
+                  const glm::vec4 &specular) override
+    {
+        m_color = ambient;
+    }
+
+    void set(const std::string &key, float val) override
+    {
+        if(key == "pointsize")
+            m_pointsize = val;
+        if(key == "upload_budget")
+            m_upload_budget = val * 1024 * 1024;
+        if(key == "gpu_budget")
+            m_gpu_budget = val * 1024 * 1024;
+        if(key == "point_budget")
+            m_point_budget = val;
+        if(key == "error_px")
+            m_error_px = val;
+    }
+
+    void ui(const Scene &scene) override
+    {
+        ImGui::Checkbox("Visible", &m_visible);
+
+        std::optional<std::string> err;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            err = m_error;
+        }
+        if(err)
+            ImGui::Text("Loading failed: %s", err->c_str());
+
+        ImGui::Text("%zd of %zd points in %zd nodes", m_drawn_points,
+                    (size_t)m_h.points, m_drawn.size());
+        ImGui::Text("%zd nodes resident, %zd MB", m_lru.size(),
+                    m_gpu_bytes / (1024 * 1024));
+        ImGui::SliderInt("PointSize", &m_pointsize, 1, 10);
+        ImGui::SliderFloat("Error (px)", &m_error_px, 0.25f, 10);
+
+        float mpoints = m_point_budget / 1e6f;
+        if(ImGui::SliderFloat("Points (M)", &mpoints, 0.5f, 50))
+            m_point_budget = mpoints * 1e6f;
+
+        int mb = m_gpu_budget / (1024 * 1024);
+        if(ImGui::SliderInt("GPU budget (MB)", &mb, 64, 8192))
+            m_gpu_budget = (size_t)mb * 1024 * 1024;
+    }
+
+    static constexpr size_t MAX_DECODED = 64;
+
+    MappedFile m_file;
+    G3OHeader m_h;
+    std::vector<Node> m_nodes;
+
+    // Render thread
+    std::list<uint32_t> m_lru;  // Resident nodes, most recently drawn first
+    std::vector<uint32_t> m_drawn;
+    size_t m_drawn_points{0};
+    size_t m_gpu_bytes{0};
+    std::shared_ptr<Shader> m_shader;
+
+    glm::vec4 m_color{1};
+    int m_pointsize{1};
+    float m_error_px{1.5f};
+    size_t m_point_budget{10000000};
+    size_t m_gpu_budget{size_t{1024} * 1024 * 1024};
+    size_t m_upload_budget{32 * 1024 * 1024};
+
+    // Shared with the workers
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::vector<uint32_t> m_requests;  // Most wanted at the back
+    std::set<uint32_t> m_inflight;     // Taken, but not yet uploaded
+    std::deque<std::pair<uint32_t, std::shared_ptr<VertexBuffer>>> m_decoded;
+    std::optional<std::string> m_error;
+    bool m_stop{false};
+
+    std::vector<std::thread> m_workers;
+};
+
+std::shared_ptr<Object>
+loadOctree(const char *path)
+{
+    return std::make_shared<Octree>(path);
+}
+
+}  // namespace g3d
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "vertexbuffer.hpp"
+
+namespace g3d {
+
+// .g3o: Level of detail octree for clouds larger than memory
+//
+// Each node keeps at most one point per cell of a grid laid over its
+// cube and passes the rest on to its children, so a node drawn together
+// with its ancestors shows its level's density. Node payloads are .g3p
+// images (see pointcodec.hpp) and are stored after one another, followed
+// by the node table in breadth first order.
+//
+// Display with loadOctree() in object.hpp.
+
+static constexpr uint32_t G3O_VERSION = 1;
+
+struct G3OHeader {
+    char magic[4];          // "G3O"
+    uint32_t version;
+    uint64_t points;        // Sum over all nodes
+    uint64_t table_offset;  // G3ONode[nodes]
+    uint32_t nodes;
+    uint32_t grid;
+    double origin[3];       // Subtracted from the input coordinates
+    float cube_min[3];      // Bounds of the root node
+    float cube_size;
+    uint32_t color;
+    uint32_t reserved;
+};
+
+// Children of a node are stored next to each other in octant order, the
+// octant being x | y << 1 | z << 2 for the upper half along each axis
+struct G3ONode {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t points;
+    uint32_t first_child;
+    uint8_t child_mask;
+    uint8_t reserved[3];
+};
+
+struct OctreeBuildOptions {
+    int grid{128};                     // Sampling cells per axis and node
+    size_t max_node_points{32768};     // Nodes with fewer are not split
+    size_t max_chunk_points{1 << 23};  // Points held in memory per thread
+    float precision{0.001f};           // Position quantization
+    glm::dvec3 origin{0};              // Subtracted from LAS coordinates
+    std::string tmpdir;                // Defaults to output + ".chunks"
+};
+
+// The inputs are read three times (bounds, density, distribution) in
+// pieces, so memory use does not depend on their size
+void buildOctree(const std::vector<std::string> &inputs, const char *output,
+                 const OctreeBuildOptions &opts = {});
+
+// Reads .las, .pcd, .obj (vertices only) and .g3p files in pieces small
+// enough to hold in memory
+void scanPoints(const char *path,
+                const std::function<void(const VertexBuffer &)> &fn,
+                const glm::dvec3 &origin = {0, 0, 0});
+
+void scanLAS(const char *path,
+             const std::function<void(const VertexBuffer &)> &fn,
+             const glm::dvec3 &origin = {0, 0, 0},
+             size_t chunk_points = 1 << 22);
+
+}  // namespace g3d
@@ -0,0 +1,591 @@
+#include "octree.hpp"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#include "object.hpp"
+#include "asyncload.hpp"
+#include "parallel.hpp"
+#include "pointcodec.hpp"
+
+namespace g3d {
+
+namespace {
+
+constexpr int COUNT_LEVEL = 7;  // Density grid of 128^3 cells
+constexpr int MAX_LEVEL = 20;   // Deeper nodes are not split further
+constexpr size_t FLUSH_POINTS = 16384;
+
+struct BuildPoint {
+    glm::vec3 pos;
+    uint32_t rgba;
+};
+
+static_assert(sizeof(BuildPoint) == 16);
+
+uint64_t
+morton(const glm::uvec3 &p)
+{
+    uint64_t m = 0;
+    for(int b = 0; b < MAX_LEVEL + 1; b++) {
+        m |= (uint64_t)((p.x >> b) & 1) << (3 * b);
+        m |= (uint64_t)((p.y >> b) & 1) << (3 * b + 1);
+        m |= (uint64_t)((p.z >> b) & 1) << (3 * b + 2);
+    }
+    return m;
+}
+
+glm::uvec3
+demorton(uint64_t m)
+{
+    glm::uvec3 p{0};
+    for(int b = 0; b < MAX_LEVEL + 1; b++) {
+        p.x |= ((m >> (3 * b)) & 1) << b;
+        p.y |= ((m >> (3 * b + 1)) & 1) << b;
+        p.z |= ((m >> (3 * b + 2)) & 1) << b;
+    }
+    return p;
+}
+
+// Nodes sort breadth first, and children in octant order
+using NodeKey = std::pair<int, uint64_t>;
+
+struct Cube {
+    glm::vec3 min;
+    float size;
+
+    float nodeSize(int level) const { return ldexpf(size, -level); }
+
+    glm::vec3 nodeMin(const NodeKey &k) const
+    {
+        return min + glm::vec3(demorton(k.second)) * nodeSize(k.first);
+    }
+};
+
+uint32_t
+packColor(const float *c, size_t elements)
+{
+    uint32_t v = 0;
+    for(size_t i = 0; i < 4; i++) {
+        const float f = i < elements ? c[i] : 1.0f;
+        v |= (uint32_t)std::clamp(f * 255.0f + 0.5f, 0.0f, 255.0f) << (i * 8);
+    }
+    return v;
+}
+
+// Calls fn(BuildPoint) for every point with a finite position
+template <typename F>
+void
+forEachPoint(const VertexBuffer &vb, F &&fn)
+{
+    const float *pos = vb.get_attributes(VertexAttribute::Position);
+    const size_t pos_stride = vb.get_stride(VertexAttribute::Position);
+    const float *col = vb.get_attributes(VertexAttribute::Color);
+    const size_t col_stride = vb.get_stride(VertexAttribute::Color);
+    const size_t col_elements = vb.get_elements(VertexAttribute::Color);
+
+    for(size_t i = 0; i < vb.size(); i++) {
+        const float *p = pos + i * pos_stride;
+        if(!std::isfinite(p[0]) || !std::isfinite(p[1]) ||
+           !std::isfinite(p[2]))
+            continue;
+        fn(BuildPoint{glm::vec3{p[0], p[1], p[2]},
+                      col ? packColor(col + i * col_stride, col_elements)
+                          : 0xffffffff});
+    }
+}
+
+// One bit per cell of the sampling grid
+struct Sampler {
+    Sampler(int grid)
+      : m_grid(grid), m_bits(((size_t)grid * grid * grid + 63) / 64)
+    {
+    }
+
+    // Splits points into the first one of each cell of the node and the
+    // rest, which go to the octant they fall in
+    void sample(const Cube &cube, const NodeKey &key,
+                std::vector<BuildPoint> &points,
+                std::vector<BuildPoint> &kept,
+                std::vector<BuildPoint> *rest)
+    {
+        const float size = cube.nodeSize(key.first);
+        const glm::vec3 lo = cube.nodeMin(key);
+        const glm::vec3 mid = lo + size * 0.5f;
+        const float scale = m_grid / size;
+
+        for(const auto &p : points) {
+            const glm::ivec3 c =
+                glm::clamp(glm::ivec3((p.pos - lo) * scale), 0, m_grid - 1);
+            const size_t cell = ((size_t)c.z * m_grid + c.y) * m_grid + c.x;
+            uint64_t &word = m_bits[cell / 64];
+            const uint64_t bit = 1ull << (cell & 63);
+            if(!(word & bit)) {
+                word |= bit;
+                m_used.push_back(cell / 64);
+                kept.push_back(p);
+            } else if(rest) {
+                const int octant = (p.pos.x >= mid.x) |
+                                   (p.pos.y >= mid.y) << 1 |
+                                   (p.pos.z >= mid.z) << 2;
+                rest[octant].push_back(p);
+            }
+        }
+
+        for(size_t w : m_used)
+            m_bits[w] = 0;
+        m_used.clear();
+    }
+
+    const int m_grid;
+    std::vector<uint64_t> m_bits;
+    std::vector<size_t> m_used;
+};
+
+struct NodeRecord {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t points;
+};
+
+// The output file. Payloads are appended by any thread.
+struct Writer {
+    Writer(const std::string &path, bool color, float precision)
+      : m_path(path), m_color(color), m_precision(precision)
+    {
+        m_fp = fopen(path.c_str(), "w+");
+        if(m_fp == NULL)
+            throw std::system_error(errno, std::system_category());
+        m_offset = sizeof(G3OHeader);
+        if(fseeko(m_fp, m_offset, SEEK_SET))
+            throw std::system_error(errno, std::system_category());
+    }
+
+    ~Writer()
+    {
+        if(m_fp) {
+            fclose(m_fp);
+            unlink(m_path.c_str());
+        }
+    }
+
+    void add(const NodeKey &key, const std::vector<BuildPoint> &points)
+    {
+        std::vector<glm::vec3> positions(points.size());
+        std::vector<glm::vec4> colors(m_color ? points.size() : 0);
+        for(size_t i = 0; i < points.size(); i++) {
+            positions[i] = points[i].pos;
+            for(int c = 0; m_color && c < 4; c++)
+                colors[i][c] = ((points[i].rgba >> (c * 8)) & 0xff) / 255.0f;
+        }
+        auto vb = m_color ? VertexBuffer::make(std::move(positions),
+                                               std::move(colors))
+                          : VertexBuffer::make(std::move(positions));
+        const auto data = encodePoints(*vb, m_precision,
+                                       std::max<size_t>(1, points.size()));
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        write(data.data(), data.size());
+        m_nodes[key] = NodeRecord{m_offset, (uint32_t)data.size(),
+                                  (uint32_t)points.size()};
+        m_offset += data.size();
+    }
+
+    std::vector<BuildPoint> read(const NodeRecord &n)
+    {
+        std::vector<uint8_t> data(n.size);
+        if(fflush(m_fp))
+            throw std::system_error(errno, std::system_category());
+        if(pread(fileno(m_fp), data.data(), n.size, n.offset) !=
+           (ssize_t)n.size)
+            throw std::runtime_error{"Short read from octree output"};
+
+        std::vector<BuildPoint> points;
+        std::mutex mutex;
+        decodePoints(data.data(), data.size(),
+                     [&](size_t, size_t, const auto &vb) {
+                         std::lock_guard<std::mutex> lock(mutex);
+                         forEachPoint(*vb, [&](const BuildPoint &p) {
+                             points.push_back(p);
+                         });
+                     });
+        return points;
+    }
+
+    void write(const void *data, size_t size)
+    {
+        if(fwrite(data, size, 1, m_fp) != 1)
+            throw std::system_error(errno, std::system_category());
+    }
+
+    void finish(const G3OHeader &h, const std::string &path)
+    {
+        if(fseeko(m_fp, 0, SEEK_SET))
+            throw std::system_error(errno, std::system_category());
+        write(&h, sizeof(h));
+        FILE *fp = m_fp;
+        m_fp = NULL;
+        if(fclose(fp)) {
+            unlink(m_path.c_str());
+            throw std::system_error(errno, std::system_category());
+        }
+        if(rename(m_path.c_str(), path.c_str()) == -1)
+            throw std::system_error(errno, std::system_category());
+    }
+
+    const std::string m_path;
+    const bool m_color;
+    const float m_precision;
+    FILE *m_fp;
+    uint64_t m_offset;
+    std::mutex m_mutex;
+    std::map<NodeKey, NodeRecord> m_nodes;
+};
+
+void
+buildNode(Writer &out, Sampler &sampler, const Cube &cube, const NodeKey &key,
+          std::vector<BuildPoint> &&points, size_t max_node_points)
+{
+    if(points.size() <= max_node_points || key.first == MAX_LEVEL) {
+        out.add(key, points);
+        return;
+    }
+
+    std::vector<BuildPoint> kept;
+    std::vector<BuildPoint> rest[8];
+    sampler.sample(cube, key, points, kept, rest);
+    points = {};
+    out.add(key, kept);
+    kept = {};
+
+    for(int i = 0; i < 8; i++) {
+        if(!rest[i].empty())
+            buildNode(out, sampler, cube, NodeKey{key.first + 1,
+                                                  key.second * 8 + i},
+                      std::move(rest[i]), max_node_points);
+    }
+}
+
+// Points of each chunk, spread out over the inputs, are collected here
+struct ChunkFile {
+    NodeKey key;
+    std::string path;
+    std::vector<BuildPoint> pending;
+
+    void flush()
+    {
+        if(pending.empty())
+            return;
+        FILE *fp = fopen(path.c_str(), "a");
+        if(fp == NULL)
+            throw std::system_error(errno, std::system_category());
+        const bool ok =
+            fwrite(pending.data(), sizeof(BuildPoint), pending.size(), fp) ==
+            pending.size();
+        const int err = errno;
+        if(fclose(fp) || !ok)
+            throw std::system_error(ok ? errno : err, std::system_category());
+        pending.clear();
+    }
+
+    std::vector<BuildPoint> load()
+    {
+        struct stat st;
+        if(stat(path.c_str(), &st))
+            throw std::system_error(errno, std::system_category());
+        std::vector<BuildPoint> points(st.st_size / sizeof(BuildPoint));
+        FILE *fp = fopen(path.c_str(), "r");
+        if(fp == NULL)
+            throw std::system_error(errno, std::system_category());
+        const bool ok = fread(points.data(), sizeof(BuildPoint), points.size(),
+                              fp) == points.size();
+        fclose(fp);
+        unlink(path.c_str());
+        if(!ok)
+            throw std::runtime_error{"Short read from " + path};
+        return points;
+    }
+};
+
+// Removes whatever chunk files are left, also when the build fails
+struct TempDir {
+    TempDir(const std::string &path) : m_path(path)
+    {
+        if(mkdir(path.c_str(), 0777) == -1 && errno != EEXIST)
+            throw std::system_error(errno, std::system_category());
+    }
+
+    ~TempDir()
+    {
+        for(const auto &c : m_chunks)
+            unlink(c.path.c_str());
+        rmdir(m_path.c_str());
+    }
+
+    const std::string m_path;
+    std::vector<ChunkFile> m_chunks;
+};
+
+template <typename F>
+void
+forEachIndex(size_t count, size_t workers, F &&fn)
+{
+    std::atomic<size_t> next{0};
+    std::vector<std::exception_ptr> errors(workers);
+
+    parallelFor(
+        workers,
+        [&](size_t begin, size_t end, size_t worker) {
+            try {
+                size_t i;
+                while((i = next++) < count)
+                    fn(i, worker);
+            } catch(...) {
+                errors[worker] = std::current_exception();
+                next = count;
+            }
+        },
+        1);
+
+    for(auto &e : errors) {
+        if(e)
+            std::rethrow_exception(e);
+    }
+}
+
+}  // namespace
+
+void
+scanPoints(const char *path,
+           const std::function<void(const VertexBuffer &)> &fn,
+           const glm::dvec3 &origin)
+{
+    const char *ext = strrchr(path, '.');
+    ext = ext ? ext : "";
+
+    if(!strcasecmp(ext, ".las")) {
+        scanLAS(path, fn, origin);
+        return;
+    }
+
+    if(!strcasecmp(ext, ".g3p")) {
+        std::mutex mutex;
+        loadPoints(path, [&](size_t, size_t, const auto &vb) {
+            std::lock_guard<std::mutex> lock(mutex);
+            fn(*vb);
+        });
+        return;
+    }
+
+    std::shared_ptr<AsyncLoad> load;
+    if(!strcasecmp(ext, ".pcd"))
+        load = loadPCDAsync(path);
+    else if(!strcasecmp(ext, ".obj"))
+        load = loadOBJAsync(path);
+    else
+        throw std::runtime_error{std::string{"Unsupported point file "} +
+                                 path};
+
+    while(!load->finished()) {
+        if(auto c = load->pop()) {
+            if(c->m_vb)
+                fn(*c->m_vb);
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    if(auto err = load->error())
+        throw std::runtime_error{*err};
+}
+
+void
+buildOctree(const std::vector<std::string> &inputs, const char *output,
+            const OctreeBuildOptions &opts)
+{
+    if(opts.grid < 1 || opts.grid > 512)
+        throw std::invalid_argument{"Octree grid must be 1 - 512"};
+
+    auto scan = [&](const auto &fn) {
+        for(const auto &in : inputs) {
+            scanPoints(in.c_str(), [&](const VertexBuffer &vb) {
+                forEachPoint(vb, fn);
+            }, opts.origin);
+        }
+    };
+
+    // Pass 1: Bounds
+
+    glm::vec3 lo{INFINITY};
+    glm::vec3 hi{-INFINITY};
+    bool color = false;
+    for(const auto &in : inputs) {
+        scanPoints(in.c_str(), [&](const VertexBuffer &vb) {
+            color |= vb.get_elements(VertexAttribute::Color) > 0;
+            forEachPoint(vb, [&](const BuildPoint &p) {
+                lo = glm::min(lo, p.pos);
+                hi = glm::max(hi, p.pos);
+            });
+        }, opts.origin);
+    }
+    if(!(lo.x <= hi.x))
+        throw std::runtime_error{"No points in octree inputs"};
+
+    const glm::vec3 extent = hi - lo;
+    const Cube cube{lo, std::max(std::max({extent.x, extent.y, extent.z}),
+                                 opts.precision)};
+
+    // Pass 2: Density, on a grid indexed in Morton order so the points of
+    // any node above it are a contiguous range
+
+    const uint32_t cells = 1 << COUNT_LEVEL;
+    auto cellOf = [&](const glm::vec3 &p) {
+        const glm::ivec3 c = glm::clamp(
+            glm::ivec3((p - cube.min) * (cells / cube.size)), 0,
+            (int)cells - 1);
+        return morton(glm::uvec3(c));
+    };
+
+    std::vector<uint64_t> prefix((size_t)cells * cells * cells + 1);
+    scan([&](const BuildPoint &p) { prefix[cellOf(p.pos) + 1]++; });
+    for(size_t i = 1; i < prefix.size(); i++)
+        prefix[i] += prefix[i - 1];
+
+    // Nodes small enough to build in memory become chunks
+
+    TempDir tmp(opts.tmpdir.empty() ? std::string(output) + ".chunks"
+                                    : opts.tmpdir);
+    std::vector<uint32_t> chunk_of(prefix.size() - 1);
+
+    std::function<void(const NodeKey &)> split = [&](const NodeKey &key) {
+        const int shift = 3 * (COUNT_LEVEL - key.first);
+        const uint64_t first = key.second << shift;
+        const uint64_t last = (key.second + 1) << shift;
+        const uint64_t n = prefix[last] - prefix[first];
+        if(n == 0)
+            return;
+        if(n > opts.max_chunk_points && key.first < COUNT_LEVEL) {
+            for(int i = 0; i < 8; i++)
+                split(NodeKey{key.first + 1, key.second * 8 + i});
+            return;
+        }
+        std::fill(chunk_of.begin() + first, chunk_of.begin() + last,
+                  tmp.m_chunks.size());
+        tmp.m_chunks.push_back(ChunkFile{
+            key, tmp.m_path + "/" + std::to_string(tmp.m_chunks.size())});
+    };
+    split(NodeKey{0, 0});
+
+    // Pass 3: Distribution
+
+    scan([&](const BuildPoint &p) {
+        ChunkFile &c = tmp.m_chunks[chunk_of[cellOf(p.pos)]];
+        c.pending.push_back(p);
+        if(c.pending.size() >= FLUSH_POINTS)
+            c.flush();
+    });
+    for(auto &c : tmp.m_chunks) {
+        c.flush();
+        c.pending.shrink_to_fit();
+    }
+    chunk_of = {};
+    prefix = {};
+
+    // Subtrees of chunks
+
+    Writer out(std::string(output) + ".tmp", color, opts.precision);
+
+    const size_t workers = parallelChunks(tmp.m_chunks.size(), 1);
+    std::vector<Sampler> samplers(workers, Sampler(opts.grid));
+    forEachIndex(tmp.m_chunks.size(), workers, [&](size_t i, size_t w) {
+        ChunkFile &c = tmp.m_chunks[i];
+        buildNode(out, samplers[w], cube, c.key, c.load(),
+                  opts.max_node_points);
+    });
+
+    // Nodes above the chunks sample the samples of their children. Their
+    // points are a repeat of some of the children's, which only matters
+    // for the few nodes at the top.
+
+    std::set<NodeKey> parents;
+    for(const auto &c : tmp.m_chunks) {
+        for(NodeKey k = c.key; k.first > 0;) {
+            k = NodeKey{k.first - 1, k.second / 8};
+            parents.insert(k);
+        }
+    }
+
+    for(auto it = parents.rbegin(); it != parents.rend(); ++it) {
+        const NodeKey &key = *it;
+        std::vector<BuildPoint> points;
+        for(int i = 0; i < 8; i++) {
+            auto child = out.m_nodes.find(NodeKey{key.first + 1,
+                                                  key.second * 8 + i});
+            if(child == out.m_nodes.end())
+                continue;
+            auto p = out.read(child->second);
+            points.insert(points.end(), p.begin(), p.end());
+        }
+        std::vector<BuildPoint> kept;
+        samplers[0].sample(cube, key, points, kept, nullptr);
+        out.add(key, kept);
+    }
+
+    // Node table, in breadth first order as the map is sorted that way
+
+    std::map<NodeKey, uint32_t> index;
+    for(const auto &n : out.m_nodes)
+        index.emplace(n.first, index.size());
+
+    G3OHeader h{};
+    std::vector<G3ONode> table;
+    table.reserve(out.m_nodes.size());
+    for(const auto &[key, rec] : out.m_nodes) {
+        G3ONode n{};
+        n.offset = rec.offset;
+        n.size = rec.size;
+        n.points = rec.points;
+        for(int i = 0; i < 8; i++) {
+            auto child = index.find(NodeKey{key.first + 1, key.second * 8 + i});
+            if(child == index.end())
+                continue;
+            if(!n.child_mask)
+                n.first_child = child->second;
+            n.child_mask |= 1 << i;
+        }
+        table.push_back(n);
+        h.points += rec.points;
+    }
+
+    memcpy(h.magic, "G3O", 4);
+    h.version = G3O_VERSION;
+    h.table_offset = out.m_offset;
+    h.nodes = table.size();
+    h.grid = opts.grid;
+    h.origin[0] = opts.origin.x;
+    h.origin[1] = opts.origin.y;
+    h.origin[2] = opts.origin.z;
+    memcpy(h.cube_min, &cube.min[0], sizeof(h.cube_min));
+    h.cube_size = cube.size;
+    h.color = color;
+
+    out.write(table.data(), table.size() * sizeof(G3ONode));
+    out.finish(h, output);
+}
+
+}  // namespace g3d
@@ -0,0 +1,192 @@
+#include "organized.hpp"
+
+#include <stdexcept>
+
+#include "parallel.hpp"
+
+namespace g3d {
+
+namespace {
+
+void
+requireOrganized(const VertexBuffer &vb)
+{
+    if(!vb.organized())
+        throw std::invalid_argument{"Point cloud is not organized"};
+}
+
+inline bool
+valid(const glm::vec3 &p)
+{
+    return !isnan(p.x) && !isnan(p.y) && !isnan(p.z);
+}
+
+// Rows per thread, aiming for the usual parallelFor() granularity
+size_t
+minRows(const VertexBuffer &vb)
+{
+    return std::max<size_t>(1, 65536 / vb.get_grid().x);
+}
+
+struct Grid {
+    explicit Grid(const VertexBuffer &vb)
+      : pos(vb.get_attributes(VertexAttribute::Position)),
+        stride(vb.get_stride(VertexAttribute::Position)),
+        w(vb.get_grid().x),
+        h(vb.get_grid().y)
+    {
+    }
+
+    glm::vec3 at(size_t i) const
+    {
+        const float *p = pos + i * stride;
+        return glm::vec3{p[0], p[1], p[2]};
+    }
+
+    const float *pos;
+    const size_t stride;
+    const size_t w;
+    const size_t h;
+};
+
+// Difference across p along one axis, one sided if a neighbour is missing
+inline bool
+difference(const Grid &g, size_t i, const glm::vec3 &p, bool has_prev,
+           bool has_next, size_t step, glm::vec3 &d)
+{
+    const glm::vec3 prev = has_prev ? g.at(i - step) : glm::vec3{NAN};
+    const glm::vec3 next = has_next ? g.at(i + step) : glm::vec3{NAN};
+    const bool vp = valid(prev);
+    const bool vn = valid(next);
+    if(vp && vn)
+        d = next - prev;
+    else if(vn)
+        d = next - p;
+    else if(vp)
+        d = p - prev;
+    else
+        return false;
+    return true;
+}
+
+}  // namespace
+
+std::vector<glm::vec3>
+gridNormals(const VertexBuffer &vb, const glm::vec3 &viewpoint)
+{
+    requireOrganized(vb);
+    const Grid g(vb);
+    std::vector<glm::vec3> normals(vb.size());
+
+    parallelFor(
+        g.h,
+        [&](size_t begin, size_t end, size_t chunk) {
+            for(size_t y = begin; y < end; y++) {
+                for(size_t x = 0; x < g.w; x++) {
+                    const size_t i = x + y * g.w;
+                    const glm::vec3 p = g.at(i);
+                    glm::vec3 n{NAN};
+                    glm::vec3 dx, dy;
+                    if(valid(p) &&
+                       difference(g, i, p, x > 0, x + 1 < g.w, 1, dx) &&
+                       difference(g, i, p, y > 0, y + 1 < g.h, g.w, dy)) {
+                        const glm::vec3 c = glm::cross(dx, dy);
+                        const float len = glm::length(c);
+                        if(len > 0) {
+                            n = c / len;
+                            if(glm::dot(n, viewpoint - p) < 0)
+                                n = -n;
+                        }
+                    }
+                    normals[i] = n;
+                }
+            }
+        },
+        minRows(vb));
+    return normals;
+}
+
+std::vector<glm::ivec3>
+gridTriangles(const VertexBuffer &vb, float max_edge)
+{
+    requireOrganized(vb);
+    const Grid g(vb);
+    if(g.w < 2 || g.h < 2)
+        return {};
+
+    const float max2 = max_edge * max_edge;
+    auto keep = [&](const glm::vec3 &a, const glm::vec3 &b,
+                    const glm::vec3 &c) {
+        return valid(a) && valid(b) && valid(c) &&
+               glm::dot(a - b, a - b) <= max2 &&
+               glm::dot(b - c, b - c) <= max2 &&
+               glm::dot(c - a, c - a) <= max2;
+    };
+
+    const size_t rows = g.h - 1;
+    std::vector<std::vector<glm::ivec3>> parts(
+        parallelChunks(rows, minRows(vb)));
+
+    parallelFor(
+        rows,
+        [&](size_t begin, size_t end, size_t chunk) {
+            auto &out = parts[chunk];
+            for(size_t y = begin; y < end; y++) {
+                for(size_t x = 0; x + 1 < g.w; x++) {
+                    const int a = x + y * g.w;
+                    const int b = a + 1;
+                    const int c = a + g.w;
+                    const int d = c + 1;
+                    const glm::vec3 pa = g.at(a), pb = g.at(b);
+                    const glm::vec3 pc = g.at(c), pd = g.at(d);
+                    if(keep(pa, pc, pb))
+                        out.push_back(glm::ivec3{a, c, b});
+                    if(keep(pb, pc, pd))
+                        out.push_back(glm::ivec3{b, c, d});
+                }
+            }
+        },
+        minRows(vb));
+
+    size_t total = 0;
+    for(const auto &p : parts)
+        total += p.size();
+    std::vector<glm::ivec3> triangles;
+    triangles.reserve(total);
+    for(const auto &p : parts)
+        triangles.insert(triangles.end(), p.begin(), p.end());
+    return triangles;
+}
+
+std::shared_ptr<VertexBuffer>
+withNormals(const std::shared_ptr<VertexBuffer> &vb,
+            std::vector<glm::vec3> normals)
+{
+    if(normals.size() != vb->size())
+        throw std::invalid_argument{"One normal per vertex expected"};
+
+    struct Owner {
+        std::shared_ptr<VertexBuffer> vb;
+        std::vector<glm::vec3> normals;
+    };
+    auto owner = std::make_shared<Owner>(Owner{vb, std::move(normals)});
+
+    std::vector<VertexAttribView> views;
+    for(size_t i = 0; i < 32; i++) {
+        const auto va = (VertexAttribute)i;
+        const size_t elements = vb->get_elements(va);
+        if(elements == 0 || va == VertexAttribute::Normal)
+            continue;
+        views.push_back(VertexAttribView{va, vb->get_attributes(va),
+                                         vb->get_stride(va), elements});
+    }
+    views.push_back(VertexAttribView{VertexAttribute::Normal,
+                                     (const float *)owner->normals.data(),
+                                     3, 3});
+
+    auto r = VertexBuffer::make(vb->size(), views, owner);
+    r->copy_properties(*vb);
+    return r;
+}
+
+}  // namespace g3d
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <math.h>
+
+#include <memory>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "vertexbuffer.hpp"
+
+namespace g3d {
+
+// Operations on organized clouds (VertexBuffer::organized()). Neighbours
+// are found through the grid instead of a spatial search. Invalid (NaN)
+// points are skipped. All of these throw std::invalid_argument if the
+// cloud is not organized.
+
+// Index of the vertex at column x and row y
+inline size_t
+gridIndex(const VertexBuffer &vb, unsigned int x, unsigned int y)
+{
+    return x + (size_t)y * vb.get_grid().x;
+}
+
+// Unit normals from the central differences along rows and columns,
+// facing viewpoint. NaN where a point or both its neighbours along an
+// axis are invalid.
+std::vector<glm::vec3> gridNormals(const VertexBuffer &vb,
+                                   const glm::vec3 &viewpoint = {0, 0, 0});
+
+// Two triangles per grid cell, one per valid half. Triangles with an edge
+// longer than max_edge are left out so surfaces break at depth
+// discontinuities instead of bridging them.
+std::vector<glm::ivec3> gridTriangles(const VertexBuffer &vb,
+                                      float max_edge = INFINITY);
+
+// vb with Normal added, for makeMesh(). Attributes are not copied.
+std::shared_ptr<VertexBuffer> withNormals(
+    const std::shared_ptr<VertexBuffer> &vb, std::vector<glm::vec3> normals);
+
+}  // namespace g3d
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+namespace g3d {
+
+// Number of contiguous ranges parallelFor() splits `count` items into
+static inline size_t
+parallelChunks(size_t count, size_t min_per_chunk = 65536)
+{
+    const size_t hw = std::max(1u, std::thread::hardware_concurrency());
+    const size_t chunks = (count + min_per_chunk - 1) / min_per_chunk;
+    return std::max<size_t>(1, std::min(hw, chunks));
+}
+
+// Calls fn(begin, end, chunk) for each of parallelChunks(count) ranges
+// covering [0, count), one thread per range. Returns when all are done.
+template <typename F>
+void
+parallelFor(size_t count, F &&fn, size_t min_per_chunk = 65536)
+{
+    const size_t chunks = parallelChunks(count, min_per_chunk);
+    if(chunks == 1) {
+        fn(size_t{0}, count, size_t{0});
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    threads.reserve(chunks - 1);
+    for(size_t i = 1; i < chunks; i++) {
+        threads.emplace_back([&, i]() {
+            fn(count * i / chunks, count * (i + 1) / chunks, i);
+        });
+    }
+    fn(size_t{0}, count / chunks, size_t{0});
+
+    for(auto &t : threads) {
+        t.join();
+    }
+}
+
+}  // namespace g3d
@@ -1,10 +1,17 @@
 #include "object.hpp"
 
+#include <math.h>
+
+#include <algorithm>
+
 #include "arraybuffer.hpp"
 #include "shader.hpp"
 #include "camera.hpp"
 #include "scene.hpp"
 #include "bvh.hpp"
+#include "asyncload.hpp"
+#include "parallel.hpp"
+#include "transform.hpp"
 
 static const char *pc_vertex_shader = R"glsl(
 layout (location = 0) in vec3 aPos;
@@ -17,7 +24,6 @@ layout (location = 1) in vec4 aCol;
 layout (location = 2) in float aTrait;
 #endif
 
-uniform mat4 PV;
 uniform mat4 model;
 uniform vec4 albedo;
 uniform vec3 bbox1;
@@ -32,6 +38,9 @@ out vec4 fragmentColor;
 void main()
 {
    gl_Position = PV * model * vec4(aPos.xyz, 1);
+   // Invalid points of organized clouds are NaN, put them behind the camera
+   if(any(isnan(aPos)))
+     gl_Position = vec4(0, 0, -2, 1);
 
    vec3 s = step(bbox1, aPos.xyz) - step(bbox2, aPos.xyz);
    float inside = s.x * s.y * s.z;
@@ -75,8 +84,182 @@ void main()
 
 namespace g3d {
 
+namespace {
+
+// Fewer points than this are not worth the sparseness
+constexpr size_t MIN_PROGRESSIVE_POINTS = 65536;
+
+uint64_t
+spreadBits(uint32_t v)
+{
+    uint64_t x = v & 0x1fffff;
+    x = (x | x << 32) & 0x001f00000000ffffull;
+    x = (x | x << 16) & 0x001f0000ff0000ffull;
+    x = (x | x << 8) & 0x100f00f00f00f00full;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+    x = (x | x << 2) & 0x1249249249249249ull;
+    return x;
+}
+
+size_t
+reverseBits(size_t v, int bits)
+{
+    size_t r = 0;
+    for(int i = 0; i < bits; i++)
+        r |= ((v >> i) & 1) << (bits - 1 - i);
+    return r;
+}
+
+// GL_TIME_ELAPSED queries in flight, read back frames later without
+// waiting for the GPU
+struct GpuTimers {
+    static constexpr size_t N = 4;
+
+    ~GpuTimers()
+    {
+        if(m_ids[0])
+            glDeleteQueries(N, m_ids);
+    }
+
+    // False if every query is still in flight, the draw then goes untimed
+    bool begin(size_t points)
+    {
+        if(!m_ids[0])
+            glGenQueries(N, m_ids);
+        if(points == 0 || m_points[m_next])
+            return false;
+        glBeginQuery(GL_TIME_ELAPSED, m_ids[m_next]);
+        m_points[m_next] = points;
+        return true;
+    }
+
+    void end()
+    {
+        glEndQuery(GL_TIME_ELAPSED);
+        m_next = (m_next + 1) % N;
+    }
+
+    // Nanoseconds per point of the latest result in, 0 if none came
+    double poll()
+    {
+        double ns_per_point = 0;
+        for(size_t i = 0; i < N; i++) {
+            if(!m_points[i])
+                continue;
+            GLint available = GL_FALSE;
+            glGetQueryObjectiv(m_ids[i], GL_QUERY_RESULT_AVAILABLE,
+                               &available);
+            if(!available)
+                continue;
+            GLuint64 ns = 0;
+            glGetQueryObjectui64v(m_ids[i], GL_QUERY_RESULT, &ns);
+            ns_per_point = (double)ns / m_points[i];
+            m_points[i] = 0;
+        }
+        return ns_per_point;
+    }
+
+    GLuint m_ids[N]{};
+    size_t m_points[N]{};  // Drawn while timed, 0 when not in flight
+    size_t m_next{0};
+};
+
+double s_point_demand_ns;  // Of the clouds drawn so far this frame
+double s_point_fraction{1};
+
+}  // namespace
+
+void
+PointBudget::beginFrame(double budget_ms)
+{
+    s_point_fraction = budget_ms > 0 && s_point_demand_ns > 0
+                           ? std::min(1.0, budget_ms * 1e6 / s_point_demand_ns)
+                           : 1.0;
+    s_point_demand_ns = 0;
+}
+
+double
+PointBudget::share(double ns)
+{
+    s_point_demand_ns += ns;
+    return s_point_fraction;
+}
+
+// Morton order over the bounds visits space cell by cell at every scale.
+// Taking its indices in bit reversed order then makes each prefix of
+// 2^k points every 2^(bits - k)th point along it, one per cell of about
+// that many points. NaN points go last.
+std::shared_ptr<VertexBuffer>
+progressiveOrder(const VertexBuffer &vb)
+{
+    const size_t n = vb.size();
+    const float *pos = vb.get_attributes(VertexAttribute::Position);
+    const size_t pos_stride = vb.get_stride(VertexAttribute::Position);
+
+    glm::vec3 lo, hi;
+    positionBounds(pos, pos_stride, n, lo, hi);
+    const glm::vec3 scale = 2097151.0f / glm::max(hi - lo, glm::vec3{1e-6f});
+
+    std::vector<std::pair<uint64_t, size_t>> keys(n);
+    parallelFor(n, [&](size_t begin, size_t end, size_t chunk) {
+        for(size_t i = begin; i < end; i++) {
+            const float *p = pos + i * pos_stride;
+            if(isnan(p[0]) || isnan(p[1]) || isnan(p[2])) {
+                keys[i] = {UINT64_MAX, i};
+                continue;
+            }
+            const glm::uvec3 c{(glm::vec3{p[0], p[1], p[2]} - lo) * scale};
+            keys[i] = {spreadBits(c.x) | spreadBits(c.y) << 1 |
+                           spreadBits(c.z) << 2,
+                       i};
+        }
+    });
+    std::sort(keys.begin(), keys.end());
+
+    size_t valid = n;
+    while(valid && keys[valid - 1].first == UINT64_MAX)
+        valid--;
+    int bits = 0;
+    while(((size_t)1 << bits) < valid)
+        bits++;
+
+    std::vector<size_t> order;
+    order.reserve(n);
+    for(size_t i = 0; i < ((size_t)1 << bits); i++) {
+        const size_t r = reverseBits(i, bits);
+        if(r < valid)
+            order.push_back(keys[r].second);
+    }
+    for(size_t i = valid; i < n; i++)
+        order.push_back(keys[i].second);
+
+    VertexBufferBuilder builder(n);
+    for(auto va : {VertexAttribute::Position, VertexAttribute::Normal,
+                   VertexAttribute::Color, VertexAttribute::UV0,
+                   VertexAttribute::Aux}) {
+        const float *src = vb.get_attributes(va);
+        const size_t elements = vb.get_elements(va);
+        if(src == nullptr || elements == 0)
+            continue;
+        const size_t stride = vb.get_stride(va);
+        auto dst = std::make_shared<std::vector<float>>(n * elements);
+        parallelFor(n, [&](size_t begin, size_t end, size_t chunk) {
+            for(size_t i = begin; i < end; i++)
+                std::copy_n(src + order[i] * stride, elements,
+                            dst->data() + i * elements);
+        });
+        builder.add(va, dst->data(), elements, elements,
+                    std::shared_ptr<const void>(dst));
+    }
+
+    auto out = builder.build();
+    out->set_formats(vb.get_formats());
+    out->set_progressive(true);
+    return out;
+}
+
 struct PointCloud : public Object {
-    std::unique_ptr<Shader> m_shader;
+    std::shared_ptr<Shader> m_shader;
 
     VertexAttribBuffer m_attrib_buf;
 
@@ -86,6 +269,13 @@ struct PointCloud : public Object {
         m_name = "Pointcloud";
     }
 
+    PointCloud(const std::shared_ptr<AsyncLoad> &load, bool interactive)
+      : m_interactive(interactive),
+        m_upload(std::make_unique<AsyncUpload>(load, interactive))
+    {
+        m_name = load->m_name;
+    }
+
     void hit(const glm::vec3 &origin, const glm::vec3 &direction,
              const glm::mat4 &parent_mm, Hit &hit) override
     {
@@ -114,44 +304,79 @@ struct PointCloud : public Object {
         }
     }
 
-    void set(const std::shared_ptr<VertexBuffer> &vb) override { m_vb = vb; }
+    void set(const std::shared_ptr<VertexBuffer> &vb) override
+    {
+        if(vb != m_loaded.lock() ||
+           vb->is_dirty(VertexAttribute::Position))
+            m_bounds.reset();
+        m_vb = vb;
+        m_upload.reset();
+    }
 
     void draw(const Scene &scene, const Camera &cam,
               const glm::mat4 &pt) override
     {
         if(m_vb) {
-            if(m_interactive)
+            // While the vertices are at hand
+            if(!m_bounds)
+                m_bounds = vertexBounds(*m_vb);
+
+            // The same VertexBuffer again only needs its changed ranges
+            const auto dirty = m_vb->take_dirty();
+            const bool partial = !m_staged && m_vb == m_loaded.lock() &&
+                                 !dirty.empty() &&
+                                 m_attrib_buf.update(*m_vb, dirty);
+
+            const bool moved = touches(dirty, VertexAttribute::Position);
+            if(m_interactive && (!partial || moved))
                 m_intersector =
                     Intersector::make(m_vb, IntersectionMode::POINT);
 
-            uint32_t mask = m_vb->get_attribute_mask();
-            // Recompile shader if attribute setup changes
-            if(m_attrib_buf.get_attribute_mask() ^ mask) {
-                char hdr[4096];
-                snprintf(hdr, sizeof(hdr),
-                         "#version 330 core\n"
-                         "%s%s",
-                         m_vb->get_elements(VertexAttribute::Color)
-                             ? "#define PER_VERTEX_COLOR\n"
-                             : "",
-                         m_vb->get_elements(VertexAttribute::Aux)
-                             ? "#define PER_VERTEX_TRAIT\n"
-                             : "");
-                m_shader = std::make_unique<Shader>("pointcloud", hdr,
-                                                    pc_vertex_shader, -1,
-                                                    pc_fragment_shader, -1);
+            if(!partial) {
+                m_staged = std::make_unique<StagedUpload>(
+                    m_vb, nullptr, m_attrib_buf.layout());
             }
-
-            m_attrib_buf.load(*m_vb);
+            m_progressive = m_vb->progressive();
+            m_loaded = m_vb;
             m_vb.reset();
         }
 
-        if(!m_attrib_buf.bind())
+        if(m_staged) {
+            // Points uploaded so far are drawn while the rest follow.
+            // Recompile shader if attribute setup changes.
+            const uint32_t mask = m_attrib_buf.get_attribute_mask();
+            if(!m_staged->update(m_attrib_buf, nullptr))
+                m_staged.reset();
+            if(m_attrib_buf.get_attribute_mask() ^ mask)
+                compileShader(m_attrib_buf);
+        }
+
+        if(m_upload) {
+            const uint32_t mask = m_attrib_buf.get_attribute_mask();
+            const bool more =
+                m_upload->update(m_attrib_buf, nullptr, m_upload_budget);
+            if(!more)
+                m_bounds = Bounds{m_upload->m_lo, m_upload->m_hi};
+            if(!more && m_upload->m_vb) {
+                if(m_interactive)
+                    m_intersector = Intersector::make(
+                        m_upload->m_vb, IntersectionMode::POINT);
+                m_upload->m_vb.reset();
+            }
+            if(m_attrib_buf.get_attribute_mask() ^ mask)
+                compileShader(m_attrib_buf);
+        }
+
+        if(!m_attrib_buf.bindArray({VertexAttribute::Position,
+                                    VertexAttribute::Color,
+                                    VertexAttribute::Aux}))
+            return;
+
+        if(!m_shader->ready())
             return;
 
         Shader *s = m_shader.get();
         s->use();
-        s->setMat4("PV", cam.m_P * cam.m_V);
 
         auto m = pt * m_model_matrix;
         if(m_rigid)
@@ -181,25 +406,83 @@ struct PointCloud : public Object {
 
         s->setInt("pointsize", m_pointsize);
 
-        glEnableVertexAttribArray(0);
+        m_drawn = drawCount(cam.m_P * cam.m_V * m);
+        const bool timed = m_progressive && m_timers.begin(m_drawn);
 
-        m_attrib_buf.ptr(0, VertexAttribute::Position);
+        glEnable(GL_PROGRAM_POINT_SIZE);
+        glDrawArrays(GL_POINTS, 0, m_drawn);
+        glDisable(GL_PROGRAM_POINT_SIZE);
 
-        if(m_attrib_buf.get_elements(VertexAttribute::Color)) {
-            glEnableVertexAttribArray(1);
-            m_attrib_buf.ptr(1, VertexAttribute::Color);
-        }
+        if(timed)
+            m_timers.end();
+    }
 
-        if(m_attrib_buf.get_elements(VertexAttribute::Aux)) {
-            glEnableVertexAttribArray(2);
-            m_attrib_buf.ptr(2, VertexAttribute::Aux);
+    // All points while the view is still. While it changes, this cloud's
+    // share of the PointBudget at the measured rate.
+    size_t drawCount(const glm::mat4 &pvm)
+    {
+        const size_t total = m_attrib_buf.size();
+        const bool moving = pvm != m_prev_pvm;
+        m_prev_pvm = pvm;
+        if(!m_progressive)
+            return total;
+
+        const double ns = m_timers.poll();
+        if(ns > 0) {
+            m_ns_per_point =
+                m_ns_per_point > 0 ? m_ns_per_point * 0.75 + ns * 0.25 : ns;
         }
-        glEnable(GL_PROGRAM_POINT_SIZE);
-        glDrawArrays(GL_POINTS, 0, m_attrib_buf.size());
-        glDisable(GL_PROGRAM_POINT_SIZE);
-        glDisableVertexAttribArray(0);
-        glDisableVertexAttribArray(1);
-        glDisableVertexAttribArray(2);
+
+        if(m_ns_per_point <= 0)
+            return total;
+        // Counted while still too, so the share is known once it moves
+        const double fraction = PointBudget::share(total * m_ns_per_point);
+        if(!moving)
+            return total;
+        return std::min<size_t>(
+            total, std::max<double>(total * fraction, MIN_PROGRESSIVE_POINTS));
+    }
+
+    std::optional<Bounds> bounds() override
+    {
+        // The edit matrix applies in world space, so nothing is culled
+        // while editing
+        if(m_rigid)
+            return std::nullopt;
+        if(!m_bounds && m_vb)
+            m_bounds = vertexBounds(*m_vb);
+        return m_bounds;
+    }
+
+    uint64_t drawKey() const override
+    {
+        return (uint64_t)(m_shader ? m_shader->m_id : 0) << 32 |
+               m_attrib_buf.vertexArray();
+    }
+
+    // Points outside the bounding box fade, and those outside the trait
+    // range are fully transparent
+    bool translucent() const override
+    {
+        return m_alpha < 1 || m_bb || m_trait_on;
+    }
+
+    bool uploading() const override { return m_vb || m_staged; }
+
+    void compileShader(const VertexBuffer &layout)
+    {
+        char hdr[4096];
+        snprintf(hdr, sizeof(hdr),
+                 "#version 330 core\n" FRAME_UNIFORMS_GLSL
+                 "%s%s",
+                 layout.get_elements(VertexAttribute::Color)
+                     ? "#define PER_VERTEX_COLOR\n"
+                     : "",
+                 layout.get_elements(VertexAttribute::Aux)
+                     ? "#define PER_VERTEX_TRAIT\n"
+                     : "");
+        m_shader = Shader::get("pointcloud", hdr, pc_vertex_shader, -1,
+                               pc_fragment_shader, -1);
     }
 
     void setColor(const glm::vec4 &ambient, const glm::vec4 &diffuse,
@@ -212,15 +495,28 @@ struct PointCloud : public Object {
     {
         if(key == "pointsize")
             m_pointsize = val;
+        if(key == "upload_budget")
+            m_upload_budget = val * 1024 * 1024;
+        if(key == "usage")
+            m_attrib_buf.setUsage(bufferUsage(val));
     }
 
     void ui(const Scene &scene) override
     {
         ImGui::Checkbox("Visible", &m_visible);
 
-        ImGui::Text("%zd points", m_attrib_buf.size());
+        if(m_upload)
+            m_upload->ui();
+
+        ImGui::Text("%zd points, %.1f MB", m_attrib_buf.size(),
+                    m_attrib_buf.size() * m_attrib_buf.byte_stride() / 1e6);
         ImGui::SliderInt("PointSize", &m_pointsize, 1, 10);
 
+        if(m_progressive) {
+            ImGui::Text("Progressive, %zd drawn, %.2f ns per point",
+                        m_drawn, m_ns_per_point);
+        }
+
         ImGui::SliderFloat("Alpha", &m_alpha, 0, 1);
 
         ImGui::Checkbox("Rigid Transform", &m_rigid);
@@ -264,6 +560,8 @@ struct PointCloud : public Object {
     }
 
     std::shared_ptr<VertexBuffer> m_vb;
+    std::weak_ptr<VertexBuffer> m_loaded;  // What m_attrib_buf holds
+    std::optional<Bounds> m_bounds;        // Of m_vb, or m_loaded
 
     glm::vec4 m_color{1};
 
@@ -284,7 +582,17 @@ struct PointCloud : public Object {
     std::shared_ptr<Intersector> m_intersector;
     const bool m_interactive{false};
 
+    std::unique_ptr<AsyncUpload> m_upload;
+    size_t m_upload_budget{32 * 1024 * 1024};
+    std::unique_ptr<StagedUpload> m_staged;
+
     glm::mat4 m_edit_matrix{1};
+
+    bool m_progressive{false};  // m_attrib_buf is from progressiveOrder()
+    size_t m_drawn{0};
+    glm::mat4 m_prev_pvm{0};
+    double m_ns_per_point{0};  // Smoothed, 0 until measured
+    GpuTimers m_timers;
 };
 
 std::shared_ptr<Object>
@@ -293,4 +601,10 @@ makePointCloud(const std::shared_ptr<VertexBuffer> &vb, bool interactive)
     return std::make_shared<PointCloud>(vb, interactive);
 }
 
+std::shared_ptr<Object>
+makePointCloud(const std::shared_ptr<AsyncLoad> &load, bool interactive)
+{
+    return std::make_shared<PointCloud>(load, interactive);
+}
+
 }  // namespace g3d
@@ -0,0 +1,772 @@
+#include "pointcodec.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+#include "asyncload.hpp"
+#include "mappedfile.hpp"
+#include "parallel.hpp"
+
+namespace g3d {
+
+namespace {
+
+struct G3PHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t points;
+    uint32_t blocks;
+    uint8_t color;
+    uint8_t aux_elements;
+    uint16_t reserved;
+    float bbmin[3];
+    float bbmax[3];
+};
+static_assert(sizeof(G3PHeader) == 48);
+
+struct G3PBlock {
+    uint64_t offset;  // From start of file
+    uint32_t size;
+    uint32_t points;
+};
+static_assert(sizeof(G3PBlock) == 16);
+
+constexpr uint32_t GRID_BITS = 21;
+constexpr uint32_t GRID_MAX = (1u << GRID_BITS) - 1;
+
+enum {
+    STREAM_RAW = 0,
+    STREAM_RANS = 1,
+};
+
+//================================================================
+// Morton codes, 21 bits per axis
+
+#ifdef __BMI2__
+
+inline uint64_t
+mortonEncode(uint32_t x, uint32_t y, uint32_t z)
+{
+    return _pdep_u64(x, 0x1249249249249249ull) |
+           _pdep_u64(y, 0x2492492492492492ull) |
+           _pdep_u64(z, 0x4924924924924924ull);
+}
+
+inline glm::uvec3
+mortonDecode(uint64_t m)
+{
+    return glm::uvec3{(uint32_t)_pext_u64(m, 0x1249249249249249ull),
+                      (uint32_t)_pext_u64(m, 0x2492492492492492ull),
+                      (uint32_t)_pext_u64(m, 0x4924924924924924ull)};
+}
+
+#else
+
+inline uint64_t
+spread(uint32_t v)
+{
+    uint64_t x = v & GRID_MAX;
+    x = (x | x << 32) & 0x001f00000000ffffull;
+    x = (x | x << 16) & 0x001f0000ff0000ffull;
+    x = (x | x << 8) & 0x100f00f00f00f00full;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+    x = (x | x << 2) & 0x1249249249249249ull;
+    return x;
+}
+
+inline uint32_t
+compact(uint64_t x)
+{
+    x &= 0x1249249249249249ull;
+    x = (x ^ (x >> 2)) & 0x10c30c30c30c30c3ull;
+    x = (x ^ (x >> 4)) & 0x100f00f00f00f00full;
+    x = (x ^ (x >> 8)) & 0x001f0000ff0000ffull;
+    x = (x ^ (x >> 16)) & 0x001f00000000ffffull;
+    x = (x ^ (x >> 32)) & GRID_MAX;
+    return x;
+}
+
+inline uint64_t
+mortonEncode(uint32_t x, uint32_t y, uint32_t z)
+{
+    return spread(x) | (spread(y) << 1) | (spread(z) << 2);
+}
+
+inline glm::uvec3
+mortonDecode(uint64_t m)
+{
+    return glm::uvec3{compact(m), compact(m >> 1), compact(m >> 2)};
+}
+
+#endif
+
+inline uint32_t
+quantize(float v, float lo, float inv_step)
+{
+    const float f = (v - lo) * inv_step + 0.5f;
+    if(!(f >= 0))  // Also catches NaN
+        return 0;
+    return f > GRID_MAX ? GRID_MAX : (uint32_t)f;
+}
+
+//================================================================
+// Static order-0 rANS with byte-wise renormalization
+
+constexpr uint32_t RANS_SCALE_BITS = 12;
+constexpr uint32_t RANS_SCALE = 1u << RANS_SCALE_BITS;
+constexpr uint32_t RANS_L = 1u << 23;
+
+struct RansTable {
+    uint16_t freq[256];
+    uint16_t cum[257];
+};
+
+void
+normalizeFreqs(const size_t counts[256], size_t total, RansTable &t)
+{
+    uint32_t sum = 0;
+    for(int s = 0; s < 256; s++) {
+        uint32_t f = 0;
+        if(counts[s])
+            f = std::max<uint32_t>(1, counts[s] * RANS_SCALE / total);
+        t.freq[s] = f;
+        sum += f;
+    }
+
+    // Rounding leaves the sum off by at most one per symbol. Settle the
+    // difference on the most frequent symbols.
+    while(sum != RANS_SCALE) {
+        int best = -1;
+        for(int s = 0; s < 256; s++) {
+            if(t.freq[s] > (sum > RANS_SCALE ? 1 : 0) &&
+               (best == -1 || t.freq[s] > t.freq[best]))
+                best = s;
+        }
+        if(sum > RANS_SCALE) {
+            t.freq[best]--;
+            sum--;
+        } else {
+            t.freq[best]++;
+            sum++;
+        }
+    }
+
+    t.cum[0] = 0;
+    for(int s = 0; s < 256; s++)
+        t.cum[s + 1] = t.cum[s] + t.freq[s];
+}
+
+void
+putU32(std::vector<uint8_t> &out, uint32_t v)
+{
+    const size_t o = out.size();
+    out.resize(o + 4);
+    memcpy(&out[o], &v, 4);
+}
+
+void
+putVarint(std::vector<uint8_t> &out, uint64_t v)
+{
+    while(v >= 0x80) {
+        out.push_back(v | 0x80);
+        v >>= 7;
+    }
+    out.push_back(v);
+}
+
+struct Reader {
+    const uint8_t *m_p;
+    const uint8_t *m_end;
+
+    void need(size_t n) const
+    {
+        if((size_t)(m_end - m_p) < n)
+            throw std::runtime_error{"Truncated point block"};
+    }
+
+    uint32_t u32()
+    {
+        need(4);
+        uint32_t v;
+        memcpy(&v, m_p, 4);
+        m_p += 4;
+        return v;
+    }
+
+    uint64_t varint()
+    {
+        uint64_t v = 0;
+        for(int shift = 0; shift < 64; shift += 7) {
+            need(1);
+            const uint8_t b = *m_p++;
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if(!(b & 0x80))
+                return v;
+        }
+        throw std::runtime_error{"Bad varint in point block"};
+    }
+};
+
+// Appends raw size, coded size, method and payload. Falls back to storing
+// the bytes as is if coding does not make them smaller.
+void
+encodeStream(std::vector<uint8_t> &out, const std::vector<uint8_t> &src)
+{
+    const size_t n = src.size();
+
+    size_t counts[256] = {0};
+    for(uint8_t b : src)
+        counts[b]++;
+
+    std::vector<uint8_t> coded;
+    if(n > 0) {
+        RansTable t;
+        normalizeFreqs(counts, n, t);
+
+        for(int s = 0; s < 256; s++)
+            putVarint(coded, t.freq[s]);
+        const size_t table_size = coded.size();
+
+        // Each symbol emits at most RANS_SCALE_BITS bits
+        std::vector<uint8_t> buf(n * 2 + 16);
+        uint8_t *ptr = buf.data() + buf.size();
+        uint32_t x = RANS_L;
+        for(size_t i = n; i-- > 0;) {
+            const uint32_t f = t.freq[src[i]];
+            const uint32_t x_max = ((RANS_L >> RANS_SCALE_BITS) << 8) * f;
+            while(x >= x_max) {
+                *--ptr = x & 0xff;
+                x >>= 8;
+            }
+            x = ((x / f) << RANS_SCALE_BITS) + (x % f) + t.cum[src[i]];
+        }
+        ptr -= 4;
+        memcpy(ptr, &x, 4);
+
+        const size_t len = buf.data() + buf.size() - ptr;
+        coded.resize(table_size + len);
+        memcpy(&coded[table_size], ptr, len);
+    }
+
+    putU32(out, n);
+    if(n > 0 && coded.size() < n) {
+        putU32(out, coded.size());
+        out.push_back(STREAM_RANS);
+        out.insert(out.end(), coded.begin(), coded.end());
+    } else {
+        putU32(out, n);
+        out.push_back(STREAM_RAW);
+        out.insert(out.end(), src.begin(), src.end());
+    }
+}
+
+// At most max bytes, as known from the block's point count
+void
+decodeStream(Reader &r, std::vector<uint8_t> &dst, size_t max)
+{
+    const uint32_t n = r.u32();
+    if(n > max)
+        throw std::runtime_error{"Oversized stream in point block"};
+    const uint32_t coded = r.u32();
+    r.need(1);
+    const uint8_t method = *r.m_p++;
+    r.need(coded);
+
+    Reader s{r.m_p, r.m_p + coded};
+    r.m_p += coded;
+
+    dst.resize(n);
+
+    if(method == STREAM_RAW) {
+        if(coded != n)
+            throw std::runtime_error{"Bad raw stream in point block"};
+        memcpy(dst.data(), s.m_p, n);
+        return;
+    }
+    if(method != STREAM_RANS)
+        throw std::runtime_error{"Unknown stream coding in point block"};
+
+    // Summed wide, so no table can wrap around to RANS_SCALE
+    RansTable t;
+    uint32_t cum = 0;
+    for(int i = 0; i < 256; i++) {
+        const uint64_t f = s.varint();
+        if(f > RANS_SCALE - cum)
+            throw std::runtime_error{"Bad frequency table in point block"};
+        t.freq[i] = f;
+        t.cum[i] = cum;
+        cum += f;
+    }
+    t.cum[256] = cum;
+    if(cum != RANS_SCALE)
+        throw std::runtime_error{"Bad frequency table in point block"};
+
+    uint8_t slot2sym[RANS_SCALE];
+    for(int i = 0; i < 256; i++)
+        memset(slot2sym + t.cum[i], i, t.freq[i]);
+
+    uint32_t x = s.u32();
+    const uint8_t *p = s.m_p;
+    const uint8_t *end = s.m_end;
+    for(uint32_t i = 0; i < n; i++) {
+        const uint32_t slot = x & (RANS_SCALE - 1);
+        const uint8_t sym = slot2sym[slot];
+        dst[i] = sym;
+        x = t.freq[sym] * (x >> RANS_SCALE_BITS) + slot - t.cum[sym];
+        while(x < RANS_L) {
+            if(p == end)
+                throw std::runtime_error{"Truncated rANS stream"};
+            x = (x << 8) | *p++;
+        }
+    }
+}
+
+//================================================================
+
+struct Source {
+    const VertexBuffer &vb;
+    const float *color;
+    size_t color_stride;
+    size_t color_elements;
+    const float *aux;
+    size_t aux_stride;
+    size_t aux_elements;
+};
+
+std::vector<uint8_t>
+encodeBlock(const Source &src, const std::pair<uint64_t, size_t> *order,
+            size_t count, float precision)
+{
+    glm::vec3 lo{INFINITY}, hi{-INFINITY};
+    for(size_t i = 0; i < count; i++) {
+        const auto p = src.vb.position(order[i].second);
+        lo = glm::min(lo, p);
+        hi = glm::max(hi, p);
+    }
+    if(count == 0 || !std::isfinite(lo.x + lo.y + lo.z + hi.x + hi.y + hi.z))
+        lo = hi = glm::vec3{0};
+
+    const glm::vec3 step =
+        glm::max(glm::vec3{precision}, (hi - lo) / (float)GRID_MAX);
+    const glm::vec3 inv = 1.0f / step;
+
+    std::vector<std::pair<uint64_t, size_t>> codes(count);
+    for(size_t i = 0; i < count; i++) {
+        const size_t index = order[i].second;
+        const auto p = src.vb.position(index);
+        codes[i] = {mortonEncode(quantize(p.x, lo.x, inv.x),
+                                 quantize(p.y, lo.y, inv.y),
+                                 quantize(p.z, lo.z, inv.z)),
+                    index};
+    }
+    std::sort(codes.begin(), codes.end());
+
+    std::vector<uint8_t> out;
+    out.resize(24);
+    memcpy(&out[0], &lo[0], 12);
+    memcpy(&out[12], &step[0], 12);
+
+    std::vector<uint8_t> stream;
+    stream.reserve(count * 3);
+    uint64_t prev = 0;
+    for(const auto &c : codes) {
+        putVarint(stream, c.first - prev);
+        prev = c.first;
+    }
+    encodeStream(out, stream);
+
+    if(src.color) {
+        std::vector<uint8_t> planes[4];
+        for(int ch = 0; ch < 4; ch++) {
+            planes[ch].resize(count);
+            uint8_t last = 0;
+            for(size_t i = 0; i < count; i++) {
+                const float *c = src.color + codes[i].second * src.color_stride;
+                const float v = ch < (int)src.color_elements ? c[ch] : 1.0f;
+                const uint8_t q = glm::clamp(v, 0.0f, 1.0f) * 255.0f + 0.5f;
+                planes[ch][i] = q - last;
+                last = q;
+            }
+            encodeStream(out, planes[ch]);
+        }
+    }
+
+    // Aux is stored losslessly, each float XORed with its predecessor and
+    // split into byte planes so the mostly constant high bytes code well
+    for(size_t e = 0; e < src.aux_elements; e++) {
+        std::vector<uint8_t> planes[4];
+        for(auto &p : planes)
+            p.resize(count);
+        uint32_t prev = 0;
+        for(size_t i = 0; i < count; i++) {
+            uint32_t bits;
+            memcpy(&bits, src.aux + codes[i].second * src.aux_stride + e, 4);
+            const uint32_t d = bits ^ prev;
+            prev = bits;
+            for(int b = 0; b < 4; b++)
+                planes[b][i] = d >> (b * 8);
+        }
+        for(auto &p : planes)
+            encodeStream(out, p);
+    }
+    return out;
+}
+
+// Writes count interleaved vertices of the given stride to dst
+void
+decodeBlock(const uint8_t *data, size_t size, size_t count,
+            const G3PHeader &h, float *dst, size_t stride)
+{
+    Reader r{data, data + size};
+    r.need(24);
+    glm::vec3 lo, step;
+    memcpy(&lo[0], r.m_p, 12);
+    memcpy(&step[0], r.m_p + 12, 12);
+    r.m_p += 24;
+
+    // Morton code deltas, a varint of at most 10 bytes each
+    std::vector<uint8_t> stream;
+    decodeStream(r, stream, count * 10);
+
+    Reader m{stream.data(), stream.data() + stream.size()};
+    uint64_t code = 0;
+    for(size_t i = 0; i < count; i++) {
+        code += m.varint();
+        const glm::vec3 p = lo + glm::vec3{mortonDecode(code)} * step;
+        float *d = dst + i * stride;
+        d[0] = p.x;
+        d[1] = p.y;
+        d[2] = p.z;
+    }
+
+    size_t offset = 3;
+    if(h.color) {
+        for(int ch = 0; ch < 4; ch++) {
+            decodeStream(r, stream, count);
+            if(stream.size() != count)
+                throw std::runtime_error{"Bad color stream in point block"};
+            uint8_t v = 0;
+            for(size_t i = 0; i < count; i++) {
+                v += stream[i];
+                dst[i * stride + offset + ch] = v * (1.0f / 255.0f);
+            }
+        }
+        offset += 4;
+    }
+
+    std::vector<uint8_t> planes[4];
+    for(size_t e = 0; e < h.aux_elements; e++) {
+        for(auto &p : planes) {
+            decodeStream(r, p, count);
+            if(p.size() != count)
+                throw std::runtime_error{"Bad aux stream in point block"};
+        }
+        uint32_t bits = 0;
+        for(size_t i = 0; i < count; i++) {
+            bits ^= planes[0][i] | (planes[1][i] << 8) |
+                    (planes[2][i] << 16) | ((uint32_t)planes[3][i] << 24);
+            memcpy(dst + i * stride + offset + e, &bits, 4);
+        }
+    }
+}
+
+struct G3PIndex {
+    G3PHeader h;
+    const G3PBlock *blocks;
+    size_t stride;  // In floats
+};
+
+G3PIndex
+parseIndex(const uint8_t *data, size_t size)
+{
+    G3PIndex idx;
+    if(size < sizeof(G3PHeader))
+        throw std::runtime_error{"Not a G3P file"};
+    memcpy(&idx.h, data, sizeof(G3PHeader));
+    if(memcmp(idx.h.magic, "G3P", 4))
+        throw std::runtime_error{"Not a G3P file"};
+    if(idx.h.version != G3P_VERSION)
+        throw std::runtime_error{"Unsupported G3P version"};
+    if(idx.h.aux_elements > 4)
+        throw std::runtime_error{"Bad G3P header"};
+    if(idx.h.blocks > (size - sizeof(G3PHeader)) / sizeof(G3PBlock))
+        throw std::runtime_error{"Short G3P file"};
+
+    idx.blocks = (const G3PBlock *)(data + sizeof(G3PHeader));
+
+    uint64_t points = 0;
+    for(size_t i = 0; i < idx.h.blocks; i++) {
+        const auto &b = idx.blocks[i];
+        if(b.offset > size || b.size > size - b.offset)
+            throw std::runtime_error{"Short G3P file"};
+        points += b.points;
+    }
+    if(points != idx.h.points)
+        throw std::runtime_error{"Bad G3P block table"};
+
+    idx.stride = 3 + (idx.h.color ? 4 : 0) + idx.h.aux_elements;
+    return idx;
+}
+
+std::shared_ptr<VertexBuffer>
+makeView(const G3PHeader &h, size_t count, size_t stride,
+         const std::shared_ptr<std::vector<float>> &buf)
+{
+    const float *base = buf->data();
+    std::vector<VertexAttribView> views{
+        {VertexAttribute::Position, base, stride, 3}};
+    size_t offset = 3;
+    if(h.color) {
+        views.push_back({VertexAttribute::Color, base + offset, stride, 4});
+        offset += 4;
+    }
+    if(h.aux_elements) {
+        views.push_back(
+            {VertexAttribute::Aux, base + offset, stride, h.aux_elements});
+    }
+    // Colors are stored with 8 bits per channel, so no more are uploaded
+    auto vb = VertexBuffer::make(count, views, buf);
+    vb->set_format(VertexAttribute::Color, VertexFormat::UNorm8);
+    return vb;
+}
+
+// Runs fn(block) for every block on a pool of threads, handing out blocks
+// in order so the first ones are done early. Rethrows the first error.
+template <typename F>
+void
+forEachBlock(size_t blocks, F &&fn)
+{
+    std::atomic<size_t> next{0};
+    const size_t workers = parallelChunks(blocks, 1);
+    std::vector<std::exception_ptr> errors(workers);
+
+    parallelFor(
+        workers,
+        [&](size_t begin, size_t end, size_t chunk) {
+            try {
+                size_t b;
+                while((b = next++) < blocks)
+                    fn(b);
+            } catch(...) {
+                errors[chunk] = std::current_exception();
+                next = blocks;
+            }
+        },
+        1);
+
+    for(auto &e : errors) {
+        if(e)
+            std::rethrow_exception(e);
+    }
+}
+
+}  // namespace
+
+std::vector<uint8_t>
+encodePoints(const VertexBuffer &vb, float precision, size_t block_points)
+{
+    if(!(precision > 0))
+        throw std::invalid_argument{"Point precision must be positive"};
+    block_points = std::clamp<size_t>(block_points, 1, UINT32_MAX);
+
+    const size_t count = vb.size();
+    const Source src{vb,
+                     vb.get_attributes(VertexAttribute::Color),
+                     vb.get_stride(VertexAttribute::Color),
+                     vb.get_elements(VertexAttribute::Color),
+                     vb.get_attributes(VertexAttribute::Aux),
+                     vb.get_stride(VertexAttribute::Aux),
+                     std::min<size_t>(4, vb.get_elements(VertexAttribute::Aux))};
+
+    const size_t chunks = parallelChunks(count);
+    std::vector<glm::vec3> mins(chunks, glm::vec3{INFINITY});
+    std::vector<glm::vec3> maxs(chunks, glm::vec3{-INFINITY});
+    parallelFor(count, [&](size_t begin, size_t end, size_t chunk) {
+        for(size_t i = begin; i < end; i++) {
+            const auto p = vb.position(i);
+            mins[chunk] = glm::min(mins[chunk], p);
+            maxs[chunk] = glm::max(maxs[chunk], p);
+        }
+    });
+    glm::vec3 bbmin{INFINITY}, bbmax{-INFINITY};
+    for(size_t i = 0; i < chunks; i++) {
+        bbmin = glm::min(bbmin, mins[i]);
+        bbmax = glm::max(bbmax, maxs[i]);
+    }
+
+    // A coarse Morton order over the whole cloud makes each block a
+    // compact region, which keeps the per-block grids small
+    const glm::vec3 inv =
+        (float)GRID_MAX / glm::max(bbmax - bbmin, glm::vec3{1e-30f});
+    std::vector<std::pair<uint64_t, size_t>> order(count);
+    parallelFor(count, [&](size_t begin, size_t end, size_t chunk) {
+        for(size_t i = begin; i < end; i++) {
+            const auto p = vb.position(i);
+            if(std::isnan(p.x) || std::isnan(p.y) || std::isnan(p.z)) {
+                order[i] = {UINT64_MAX, i};
+                continue;
+            }
+            order[i] = {mortonEncode(quantize(p.x, bbmin.x, inv.x),
+                                     quantize(p.y, bbmin.y, inv.y),
+                                     quantize(p.z, bbmin.z, inv.z)),
+                        i};
+        }
+        std::sort(order.begin() + begin, order.begin() + end);
+    });
+    for(size_t width = 1; width < chunks; width *= 2) {
+        parallelFor(
+            (chunks + 2 * width - 1) / (2 * width),
+            [&](size_t begin, size_t end, size_t) {
+                for(size_t pair = begin; pair < end; pair++) {
+                    const size_t a = pair * 2 * width;
+                    const size_t b = std::min(chunks, a + width);
+                    const size_t c = std::min(chunks, a + 2 * width);
+                    std::inplace_merge(order.begin() + count * a / chunks,
+                                       order.begin() + count * b / chunks,
+                                       order.begin() + count * c / chunks);
+                }
+            },
+            1);
+    }
+
+    // Invalid (NaN) points sorted last, and are left out
+    size_t valid = count;
+    while(valid && order[valid - 1].first == UINT64_MAX)
+        valid--;
+
+    const size_t blocks = (valid + block_points - 1) / block_points;
+    std::vector<std::vector<uint8_t>> encoded(blocks);
+    forEachBlock(blocks, [&](size_t b) {
+        const size_t first = b * block_points;
+        encoded[b] = encodeBlock(src, order.data() + first,
+                                 std::min(block_points, valid - first),
+                                 precision);
+    });
+
+    G3PHeader h{};
+    memcpy(h.magic, "G3P", 4);
+    h.version = G3P_VERSION;
+    h.points = valid;
+    h.blocks = blocks;
+    h.color = src.color != nullptr;
+    h.aux_elements = src.aux ? src.aux_elements : 0;
+    memcpy(h.bbmin, &bbmin[0], sizeof(h.bbmin));
+    memcpy(h.bbmax, &bbmax[0], sizeof(h.bbmax));
+
+    size_t total = sizeof(G3PHeader) + blocks * sizeof(G3PBlock);
+    std::vector<G3PBlock> table(blocks);
+    for(size_t b = 0; b < blocks; b++) {
+        table[b] = G3PBlock{total, (uint32_t)encoded[b].size(),
+                            (uint32_t)std::min(block_points,
+                                               valid - b * block_points)};
+        total += encoded[b].size();
+    }
+
+    std::vector<uint8_t> out(total);
+    memcpy(out.data(), &h, sizeof(h));
+    memcpy(out.data() + sizeof(h), table.data(),
+           blocks * sizeof(G3PBlock));
+    for(size_t b = 0; b < blocks; b++)
+        memcpy(out.data() + table[b].offset, encoded[b].data(),
+               encoded[b].size());
+    return out;
+}
+
+void
+savePoints(const char *path, const VertexBuffer &vb, float precision,
+           size_t block_points)
+{
+    const auto data = encodePoints(vb, precision, block_points);
+
+    const std::string tmp = std::string(path) + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if(fp == NULL)
+        throw std::system_error(errno, std::system_category());
+
+    const bool ok = fwrite(data.data(), data.size(), 1, fp) == 1;
+    const int err = errno;
+    if(fclose(fp) || !ok) {
+        unlink(tmp.c_str());
+        throw std::system_error(ok ? errno : err, std::system_category());
+    }
+
+    if(rename(tmp.c_str(), path) == -1)
+        throw std::system_error(errno, std::system_category());
+}
+
+void
+decodePoints(const uint8_t *data, size_t size, const PointBlockFn &fn)
+{
+    const G3PIndex idx = parseIndex(data, size);
+
+    forEachBlock(idx.h.blocks, [&](size_t b) {
+        const G3PBlock &blk = idx.blocks[b];
+        auto buf = std::make_shared<std::vector<float>>(blk.points *
+                                                        idx.stride);
+        decodeBlock(data + blk.offset, blk.size, blk.points, idx.h,
+                    buf->data(), idx.stride);
+        fn(b, idx.h.blocks, makeView(idx.h, blk.points, idx.stride, buf));
+    });
+}
+
+void
+loadPoints(const char *path, const PointBlockFn &fn)
+{
+    MappedFile mf(path);
+    decodePoints(mf.data(), mf.size(), fn);
+}
+
+std::shared_ptr<VertexBuffer>
+loadPoints(const char *path)
+{
+    MappedFile mf(path);
+    const G3PIndex idx = parseIndex(mf.data(), mf.size());
+
+    std::vector<size_t> first(idx.h.blocks);
+    for(size_t b = 1; b < idx.h.blocks; b++)
+        first[b] = first[b - 1] + idx.blocks[b - 1].points;
+
+    // Blocks decode straight into their slice of the final buffer
+    auto buf = std::make_shared<std::vector<float>>(idx.h.points * idx.stride);
+    forEachBlock(idx.h.blocks, [&](size_t b) {
+        const G3PBlock &blk = idx.blocks[b];
+        decodeBlock(mf.data() + blk.offset, blk.size, blk.points, idx.h,
+                    buf->data() + first[b] * idx.stride, idx.stride);
+    });
+
+    return makeView(idx.h, idx.h.points, idx.stride, buf);
+}
+
+std::shared_ptr<AsyncLoad>
+loadPointsAsync(const char *path)
+{
+    auto load = std::make_shared<AsyncLoad>(path);
+    load->start([path = std::string(path)](AsyncLoad &load) {
+        MappedFile mf(path.c_str());
+        load.setExpectedVertices(parseIndex(mf.data(), mf.size()).h.points);
+
+        std::atomic<size_t> done{0};
+        decodePoints(mf.data(), mf.size(),
+                     [&](size_t block, size_t blocks,
+                         const std::shared_ptr<VertexBuffer> &vb) {
+                         load.push(LoadChunk{vb, {}});
+                         load.setProgress((float)++done / blocks);
+                     });
+    });
+    return load;
+}
+
+}  // namespace g3d
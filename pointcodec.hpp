@@ -0,0 +1,51 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "vertexbuffer.hpp"
+
+namespace g3d {
+
+// .g3p: Compressed point cloud
+//
+// Points are grouped into spatially coherent blocks. Within a block
+// positions are quantized to a grid, sorted in Morton order and delta
+// coded. Colors (8 bits per channel) and Aux (lossless) are coded as
+// separate byte planes. Every stream is rANS entropy coded. Blocks are
+// independent and are decoded in parallel.
+//
+// Normals and UVs are not stored. The point order is not preserved, and
+// invalid (NaN) points are left out.
+
+static constexpr uint32_t G3P_VERSION = 1;
+
+// Positions are reproduced to within precision / 2 unless a block is too
+// large for a 21 bit grid, in which case its step is increased to fit
+std::vector<uint8_t> encodePoints(const VertexBuffer &vb,
+                                  float precision = 0.001f,
+                                  size_t block_points = 65536);
+
+void savePoints(const char *path, const VertexBuffer &vb,
+                float precision = 0.001f, size_t block_points = 65536);
+
+// Called once per decoded block, from the decoding threads and in no
+// particular order. Position, Color and Aux are interleaved in the order
+// VertexAttribBuffer::load() uploads without repacking.
+using PointBlockFn = std::function<void(
+    size_t block, size_t blocks, const std::shared_ptr<VertexBuffer> &vb)>;
+
+void decodePoints(const uint8_t *data, size_t size, const PointBlockFn &fn);
+
+void loadPoints(const char *path, const PointBlockFn &fn);
+
+// Decodes all blocks into one VertexBuffer
+std::shared_ptr<VertexBuffer> loadPoints(const char *path);
+
+struct AsyncLoad;
+
+// Delivers each block as a chunk, for makePointCloud()
+std::shared_ptr<AsyncLoad> loadPointsAsync(const char *path);
+
+}  // namespace g3d
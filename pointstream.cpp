@@ -0,0 +1,351 @@
+#include "object.hpp"
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+
+#include "arraybuffer.hpp"
+#include "camera.hpp"
+#include "drawstate.hpp"
+#include "opengl.hpp"
+#include "scene.hpp"
+#include "shader.hpp"
+
+static const char *ps_vertex_shader = R"glsl(
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec4 aCol;
+
+uniform mat4 model;
+uniform vec4 albedo;
+uniform int pointsize;
+uniform float age;  // 0 for the newest scan, towards 1 for the oldest
+
+out vec4 fragmentColor;
+
+void main()
+{
+   gl_Position = PV * model * vec4(aPos.xyz, 1);
+   // Points missing from organized scans are NaN
+   if(any(isnan(aPos)))
+     gl_Position = vec4(0, 0, -2, 1);
+   gl_PointSize = pointsize;
+   fragmentColor = vec4(aCol.rgb, 1.0 - age) * albedo;
+}
+
+)glsl";
+
+static const char *ps_fragment_shader = R"glsl(
+out vec4 FragColor;
+in vec4 fragmentColor;
+
+void main()
+{
+  FragColor = fragmentColor;
+}
+
+)glsl";
+
+namespace g3d {
+
+namespace {
+
+constexpr size_t POSITION_BYTES = 12;  // Float xyz
+constexpr size_t COLOR_BYTES = 4;      // UNorm8 rgba
+
+// Signalled once the GPU is done with everything issued before it
+struct Fence {
+    Fence() : m_sync(glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0)) {}
+
+    ~Fence() { glDeleteSync(m_sync); }
+
+    void wait()
+    {
+        while(!m_done) {
+            const GLenum r = glClientWaitSync(
+                m_sync, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+            m_done = r == GL_ALREADY_SIGNALED ||
+                     r == GL_CONDITION_SATISFIED || r == GL_WAIT_FAILED;
+        }
+    }
+
+    const GLsync m_sync;
+    bool m_done{false};
+};
+
+}  // namespace
+
+// Scans go into a ring of slots, one more than are drawn, so a new scan
+// overwrites the one retired the scan before and the GPU is normally long
+// done with it. Each slot is fenced when drawn and waited on before being
+// written, which only blocks if scans arrive faster than frames finish.
+//
+// With ARB_buffer_storage the ring is mapped once, persistently, and a
+// scan is written straight into it: one memcpy for packed float
+// positions plus one pass converting colors to 8 bits. Without it each
+// slot is mapped unsynchronized for the write.
+//
+// A scan larger than the slots grows the ring to fit it. The scans in the
+// old ring are dropped then, and the growth is shown in the UI.
+struct PointStream : public Object {
+    struct Slot {
+        size_t count{0};
+        bool color{false};
+        std::shared_ptr<Fence> fence;
+    };
+
+    PointStream(size_t scans, size_t max_points)
+      : m_scans(std::max<size_t>(1, scans)),
+        m_max_points(max_points),
+        m_slots(m_scans + 1)
+    {
+        m_name = "Pointstream";
+    }
+
+    ~PointStream() { release(); }
+
+    void release()
+    {
+        if(m_buffer) {
+            if(m_mapped) {
+                glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+                glUnmapBuffer(GL_ARRAY_BUFFER);
+                m_mapped = nullptr;
+            }
+            glDeleteBuffers(1, &m_buffer);
+            m_buffer = 0;
+        }
+    }
+
+    // Reallocates for scans of up to points, after the GPU is done with
+    // the old ring
+    void grow(size_t points)
+    {
+        for(auto &slot : m_slots) {
+            if(slot.fence)
+                slot.fence->wait();
+            slot = Slot{};
+        }
+        release();
+        m_max_points = points + points / 4;
+        m_filled = 0;
+        m_grown++;
+    }
+
+    // May be called from any thread. Scans beyond what the ring holds are
+    // dropped, oldest first, if several arrive between frames.
+    void set(const std::shared_ptr<VertexBuffer> &vb) override
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.push_back(vb);
+        if(m_pending.size() > m_scans)
+            m_pending.pop_front();
+    }
+
+    void allocate()
+    {
+        const size_t slots = m_slots.size();
+        m_color_offset = slots * m_max_points * POSITION_BYTES;
+        const size_t size = m_color_offset + slots * m_max_points * COLOR_BYTES;
+
+        glGenBuffers(1, &m_buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+        if(GLEW_ARB_buffer_storage) {
+            const GLbitfield flags =
+                GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+            m_mapped = (uint8_t *)glMapBufferRange(GL_ARRAY_BUFFER, 0, size,
+                                                   flags);
+        } else {
+            glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+        }
+    }
+
+    // Calls fn with memory for [offset, offset + size) of the buffer
+    template <typename F>
+    void region(size_t offset, size_t size, F &&fn)
+    {
+        if(m_mapped) {
+            fn(m_mapped + offset);
+            return;
+        }
+        // Already fenced, so the driver need not synchronize
+        glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+        void *p = glMapBufferRange(GL_ARRAY_BUFFER, offset, size,
+                                   GL_MAP_WRITE_BIT |
+                                       GL_MAP_INVALIDATE_RANGE_BIT |
+                                       GL_MAP_UNSYNCHRONIZED_BIT);
+        if(p == NULL)
+            return;
+        fn((uint8_t *)p);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+    }
+
+    void write(size_t index, const VertexBuffer &vb)
+    {
+        Slot &slot = m_slots[index];
+        if(slot.fence) {
+            slot.fence->wait();
+            slot.fence.reset();
+        }
+
+        const size_t count = vb.size();
+        const size_t first = index * m_max_points;
+
+        region(first * POSITION_BYTES, count * POSITION_BYTES,
+               [&](uint8_t *dst) {
+                   packAttribute(
+                       VertexFormat::Float,
+                       vb.get_attributes(VertexAttribute::Position),
+                       vb.get_stride(VertexAttribute::Position), 3, count,
+                       dst, POSITION_BYTES);
+               });
+
+        const size_t color_elements =
+            std::min<size_t>(4, vb.get_elements(VertexAttribute::Color));
+        if(color_elements) {
+            region(m_color_offset + first * COLOR_BYTES, count * COLOR_BYTES,
+                   [&](uint8_t *dst) {
+                       packAttribute(VertexFormat::UNorm8,
+                                     vb.get_attributes(VertexAttribute::Color),
+                                     vb.get_stride(VertexAttribute::Color),
+                                     color_elements, count, dst, COLOR_BYTES);
+                   });
+        }
+
+        slot.count = count;
+        slot.color = color_elements != 0;
+    }
+
+    void draw(const Scene &scene, const Camera &cam,
+              const glm::mat4 &pt) override
+    {
+        std::deque<std::shared_ptr<VertexBuffer>> pending;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            pending.swap(m_pending);
+        }
+
+        for(const auto &vb : pending) {
+            if(vb->size() > m_max_points)
+                grow(vb->size());
+        }
+        if(!pending.empty() && !m_buffer)
+            allocate();
+
+        for(const auto &vb : pending) {
+            const size_t index = (m_newest + 1) % m_slots.size();
+            write(index, *vb);
+            m_newest = index;
+            m_filled = std::min(m_filled + 1, m_scans);
+        }
+
+        if(m_filled == 0)
+            return;
+
+        if(!m_shader) {
+            m_shader = Shader::get("pointstream",
+                                   "#version 330 core\n" FRAME_UNIFORMS_GLSL,
+                                   ps_vertex_shader, -1, ps_fragment_shader,
+                                   -1);
+        }
+
+        // Drawn once the driver has compiled it in the background
+        if(!m_shader->ready())
+            return;
+
+        Shader *s = m_shader.get();
+        s->use();
+        DrawState::bindVertexArray(0);
+        s->setMat4("model", pt * m_model_matrix);
+        s->setVec4("albedo", m_color);
+        s->setInt("pointsize", m_pointsize);
+
+        glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void *)0);
+        glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0,
+                              (void *)(intptr_t)m_color_offset);
+        glEnableVertexAttribArray(0);
+        glEnable(GL_PROGRAM_POINT_SIZE);
+
+        // Oldest first, so newer scans blend over older ones
+        for(size_t age = m_filled; age-- > 0;) {
+            const size_t index =
+                (m_newest + m_slots.size() - age) % m_slots.size();
+            Slot &slot = m_slots[index];
+
+            if(slot.color) {
+                glEnableVertexAttribArray(1);
+            } else {
+                glDisableVertexAttribArray(1);
+                glVertexAttrib4f(1, 1, 1, 1, 1);
+            }
+            s->setFloat("age", (float)age / m_scans);
+            glDrawArrays(GL_POINTS, index * m_max_points, slot.count);
+        }
+
+        glDisable(GL_PROGRAM_POINT_SIZE);
+        glDisableVertexAttribArray(0);
+        glDisableVertexAttribArray(1);
+
+        // Issued after the draws, so it covers them
+        auto fence = std::make_shared<Fence>();
+        for(size_t age = 0; age < m_filled; age++)
+            m_slots[(m_newest + m_slots.size() - age) % m_slots.size()].fence =
+                fence;
+    }
+
+    // Older scans fade out
+    bool translucent() const override
+    {
+        return m_filled > 1 || m_color.w < 1;
+    }
+
+    void setColor(const glm::vec4 &ambient, const glm::vec4 &diffuse,
+                  const glm::vec4 &specular) override
+    {
+        m_color = ambient;
+    }
+
+    void set(const std::string &key, float val) override
+    {
+        if(key == "pointsize")
+            m_pointsize = val;
+    }
+
+    void ui(const Scene &scene) override
+    {
+        ImGui::Checkbox("Visible", &m_visible);
+        ImGui::Text("%zd of %zd scans, %s", m_filled, m_scans,
+                    m_mapped ? "persistently mapped" : "mapped per scan");
+        ImGui::Text("Up to %zd points per scan", m_max_points);
+        if(m_grown)
+            ImGui::Text("Grown %zd times for larger scans", m_grown);
+        ImGui::SliderInt("PointSize", &m_pointsize, 1, 10);
+    }
+
+    const size_t m_scans;
+    size_t m_max_points;
+    size_t m_grown{0};
+    std::vector<Slot> m_slots;
+    size_t m_newest{0};
+    size_t m_filled{0};
+
+    GLuint m_buffer{0};
+    uint8_t *m_mapped{nullptr};
+    size_t m_color_offset{0};
+
+    std::mutex m_mutex;
+    std::deque<std::shared_ptr<VertexBuffer>> m_pending;
+
+    std::shared_ptr<Shader> m_shader;
+    glm::vec4 m_color{1};
+    int m_pointsize{1};
+};
+
+std::shared_ptr<Object>
+makePointStream(size_t scans, size_t max_points)
+{
+    return std::make_shared<PointStream>(scans, max_points);
+}
+
+}  // namespace g3d
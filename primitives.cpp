@@ -54,6 +54,6 @@ icosphere(float radius, int order)
         vertices[i] = glm::normalize(vertices[i]) * radius;
     }
 
-    return {VertexBuffer::make(vertices), triangles};
+    return {VertexBuffer::make(std::move(vertices)), triangles};
 }
 };  // namespace g3d
@@ -0,0 +1,527 @@
+#include "scenecache.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include "bvh.hpp"
+#include "mappedfile.hpp"
+#include "parallel.hpp"
+
+namespace g3d {
+
+namespace {
+
+enum {
+    G3D_SECTION_ATTRIBUTE = 1,
+    G3D_SECTION_INDEX = 2,
+    G3D_SECTION_BVH = 3,
+};
+
+struct G3DHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t source_hash;
+    uint64_t vertices;
+    uint64_t triangles;
+    float bbmin[3];
+    float bbmax[3];
+    uint32_t sections;
+    uint32_t grid_width;  // Of organized clouds, else 0
+};
+static_assert(sizeof(G3DHeader) == 64);
+
+struct G3DSection {
+    uint32_t type;
+    uint32_t attribute;  // VertexAttribute, or root node for the BVH
+    uint32_t elements;   // Node size for the BVH
+    uint32_t stride;     // In floats, or BvhKind for the BVH
+    uint64_t offset;     // From start of file
+    uint64_t size;
+};
+static_assert(sizeof(G3DSection) == 32);
+
+constexpr size_t G3D_ALIGN = 64;
+
+size_t
+align(size_t x)
+{
+    return (x + G3D_ALIGN - 1) & ~(G3D_ALIGN - 1);
+}
+
+struct G3DVertexBuffer : public VertexBuffer {
+    size_t size() const override { return m_count; }
+
+    const float *get_attributes(VertexAttribute va) const override
+    {
+        const size_t i = (size_t)va;
+        return i < m_views.size() ? m_views[i].data : nullptr;
+    }
+
+    size_t get_elements(VertexAttribute va) const override
+    {
+        const size_t i = (size_t)va;
+        return i < m_views.size() ? m_views[i].elements : 0;
+    }
+
+    size_t get_stride(VertexAttribute va) const override
+    {
+        const size_t i = (size_t)va;
+        return i < m_views.size() ? m_views[i].stride : 0;
+    }
+
+    const BvhBlob *get_bvh() const override
+    {
+        return m_bvh.nodes ? &m_bvh : nullptr;
+    }
+
+    size_t m_count{0};
+    std::vector<VertexAttribView> m_views;
+    BvhBlob m_bvh{nullptr, 0, -1, 0};
+    std::shared_ptr<MappedFile> m_mf;
+};
+
+inline uint64_t
+rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t
+mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 33);
+}
+
+constexpr uint64_t K1 = 0x9e3779b185ebca87ull;
+constexpr uint64_t K2 = 0xc2b2ae3d27d4eb4full;
+
+// Four independent lanes keep the multiplies from serializing
+uint64_t
+hashBytes(const uint8_t *p, size_t len, uint64_t seed)
+{
+    uint64_t h[4] = {seed, seed ^ K1, seed ^ K2, seed + K1 + K2};
+
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32) {
+        for(int k = 0; k < 4; k++) {
+            uint64_t w;
+            memcpy(&w, p + i + k * 8, 8);
+            h[k] = rotl(h[k] ^ (w * K2), 31) * K1;
+        }
+    }
+
+    uint8_t tail[32] = {0};
+    memcpy(tail, p + i, len - i);
+    for(int k = 0; k < 4; k++) {
+        uint64_t w;
+        memcpy(&w, tail + k * 8, 8);
+        h[k] = rotl(h[k] ^ (w * K2), 31) * K1;
+    }
+
+    return mix(rotl(h[0], 1) + rotl(h[1], 7) + rotl(h[2], 12) +
+               rotl(h[3], 18) + len);
+}
+
+std::string s_cache_dir;
+bool s_cache_bvh;
+
+void
+mkdirs(const std::string &path)
+{
+    for(size_t i = 1; i <= path.size(); i++) {
+        if(i == path.size() || path[i] == '/')
+            mkdir(path.substr(0, i).c_str(), 0777);
+    }
+}
+
+std::string
+hex(uint64_t x)
+{
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)x);
+    return buf;
+}
+
+// Content hash, memoized on file identity so an unchanged file is not
+// read again just to find its hash
+uint64_t
+contentHash(const char *path)
+{
+    struct stat st;
+    if(stat(path, &st) == -1)
+        throw std::system_error(errno, std::system_category());
+
+    char abspath[PATH_MAX];
+    if(realpath(path, abspath) == NULL)
+        throw std::system_error(errno, std::system_category());
+
+    const std::string memo =
+        s_cache_dir + "/" +
+        hex(hashBytes((const uint8_t *)abspath, strlen(abspath), 0)) + ".src";
+
+    unsigned long long ino, size, sec, nsec, hash;
+    FILE *fp = fopen(memo.c_str(), "r");
+    if(fp) {
+        const int n =
+            fscanf(fp, "%llu %llu %llu %llu %llx", &ino, &size, &sec, &nsec,
+                   &hash);
+        fclose(fp);
+        if(n == 5 && ino == (unsigned long long)st.st_ino &&
+           size == (unsigned long long)st.st_size &&
+           sec == (unsigned long long)st.st_mtim.tv_sec &&
+           nsec == (unsigned long long)st.st_mtim.tv_nsec)
+            return hash;
+    }
+
+    hash = hashFile(path);
+
+    fp = fopen(memo.c_str(), "w");
+    if(fp) {
+        fprintf(fp, "%llu %llu %llu %llu %llx\n",
+                (unsigned long long)st.st_ino, (unsigned long long)st.st_size,
+                (unsigned long long)st.st_mtim.tv_sec,
+                (unsigned long long)st.st_mtim.tv_nsec, hash);
+        fclose(fp);
+    }
+    return hash;
+}
+
+struct Writer {
+    FILE *m_fp;
+    size_t m_pos{0};
+
+    void write(const void *p, size_t len)
+    {
+        if(len && fwrite(p, len, 1, m_fp) != 1)
+            throw std::system_error(errno, std::system_category());
+        m_pos += len;
+    }
+
+    void pad()
+    {
+        static const uint8_t zero[G3D_ALIGN] = {0};
+        write(zero, align(m_pos) - m_pos);
+    }
+};
+
+}  // namespace
+
+uint64_t
+hashFile(const char *path)
+{
+    MappedFile mf(path);
+
+    constexpr size_t block = 16 * 1024 * 1024;
+    const size_t blocks = (mf.size() + block - 1) / block;
+    std::vector<uint64_t> hashes(blocks);
+
+    parallelFor(
+        blocks,
+        [&](size_t begin, size_t end, size_t chunk) {
+            for(size_t i = begin; i < end; i++) {
+                const size_t len = std::min(block, mf.size() - i * block);
+                hashes[i] = hashBytes(mf.data() + i * block, len, i);
+            }
+        },
+        1);
+
+    return hashBytes((const uint8_t *)hashes.data(),
+                     hashes.size() * sizeof(uint64_t), mf.size());
+}
+
+uint64_t
+hashData(const void *data, size_t size, uint64_t seed)
+{
+    return hashBytes((const uint8_t *)data, size, seed);
+}
+
+void
+saveG3D(const char *path, const VertexBuffer &vb,
+        const std::vector<glm::ivec3> *ib, Intersector *bvh,
+        uint64_t source_hash)
+{
+    const size_t count = vb.size();
+
+    std::vector<G3DSection> sections;
+    std::vector<std::pair<const float *, size_t>> srcs;  // <data, stride>
+    uint32_t vertex_elements = 0;
+
+    for(uint32_t i = 0; i < 32; i++) {
+        const auto va = (VertexAttribute)i;
+        const float *s = vb.get_attributes(va);
+        if(s == NULL)
+            continue;
+        const uint32_t elements = vb.get_elements(va);
+        sections.push_back(
+            G3DSection{G3D_SECTION_ATTRIBUTE, i, elements, 0,
+                       vertex_elements * sizeof(float), 0});
+        srcs.push_back({s, vb.get_stride(va)});
+        vertex_elements += elements;
+    }
+    for(auto &s : sections)
+        s.stride = vertex_elements;
+
+    G3DHeader h{};
+    memcpy(h.magic, "G3D", 4);
+    h.version = G3D_VERSION;
+    h.source_hash = source_hash;
+    h.vertices = count;
+    h.triangles = ib ? ib->size() : 0;
+    h.grid_width = vb.organized() ? vb.get_grid().x : 0;
+
+    const size_t chunks = parallelChunks(count);
+    std::vector<glm::vec3> mins(chunks, glm::vec3{INFINITY});
+    std::vector<glm::vec3> maxs(chunks, glm::vec3{-INFINITY});
+    parallelFor(count, [&](size_t begin, size_t end, size_t chunk) {
+        for(size_t i = begin; i < end; i++) {
+            const auto p = vb.position(i);
+            mins[chunk] = glm::min(mins[chunk], p);
+            maxs[chunk] = glm::max(maxs[chunk], p);
+        }
+    });
+    glm::vec3 bbmin{INFINITY}, bbmax{-INFINITY};
+    for(size_t i = 0; i < chunks; i++) {
+        bbmin = glm::min(bbmin, mins[i]);
+        bbmax = glm::max(bbmax, maxs[i]);
+    }
+    memcpy(h.bbmin, &bbmin[0], sizeof(h.bbmin));
+    memcpy(h.bbmax, &bbmax[0], sizeof(h.bbmax));
+
+    BvhBlob blob{nullptr, 0, -1, 0};
+    if(bvh) {
+        bvh->wait();
+        blob = bvh->flattened();
+        // Nothing to intersect, as when every point is invalid
+        if(blob.root < 0)
+            blob = BvhBlob{nullptr, 0, -1, 0};
+    }
+
+    const size_t n = sections.size() + (ib ? 1 : 0) + (blob.nodes ? 1 : 0);
+    size_t offset = align(sizeof(G3DHeader) + n * sizeof(G3DSection));
+
+    const size_t vertex_bytes = count * vertex_elements * sizeof(float);
+    for(auto &s : sections) {
+        s.offset += offset;
+        s.size = vertex_bytes;
+    }
+    offset = align(offset + vertex_bytes);
+
+    if(ib) {
+        sections.push_back(G3DSection{G3D_SECTION_INDEX, 0, 3, 3, offset,
+                                      ib->size() * sizeof(glm::ivec3)});
+        offset = align(offset + sections.back().size);
+    }
+    if(blob.nodes) {
+        sections.push_back(G3DSection{G3D_SECTION_BVH, (uint32_t)blob.root,
+                                      blob.node_size, (uint32_t)blob.kind,
+                                      offset, blob.size});
+    }
+    h.sections = sections.size();
+
+    // Unique, as loads of the same key may store at the same time
+    const size_t tid = std::hash<std::thread::id>{}(std::this_thread::get_id());
+    const std::string tmp = std::string(path) + "." +
+                            std::to_string(getpid()) + "." +
+                            std::to_string(tid);
+    Writer w{fopen(tmp.c_str(), "w")};
+    if(w.m_fp == NULL)
+        throw std::system_error(errno, std::system_category());
+
+    try {
+        w.write(&h, sizeof(h));
+        w.write(sections.data(), sections.size() * sizeof(G3DSection));
+        w.pad();
+
+        // Interleave in slices to bound the temporary buffer
+        const size_t slice = 65536;
+        std::vector<float> buf(slice * vertex_elements);
+        for(size_t i = 0; i < count; i += slice) {
+            const size_t c = std::min(slice, count - i);
+            float *dst = buf.data();
+            for(size_t j = i; j < i + c; j++) {
+                for(size_t a = 0; a < srcs.size(); a++) {
+                    const float *s = srcs[a].first + j * srcs[a].second;
+                    for(size_t k = 0; k < sections[a].elements; k++)
+                        *dst++ = s[k];
+                }
+            }
+            w.write(buf.data(), c * vertex_elements * sizeof(float));
+        }
+        w.pad();
+
+        if(ib) {
+            w.write(ib->data(), ib->size() * sizeof(glm::ivec3));
+            w.pad();
+        }
+        if(blob.nodes)
+            w.write(blob.nodes, blob.size);
+
+        FILE *fp = w.m_fp;
+        w.m_fp = NULL;
+        if(fclose(fp))
+            throw std::system_error(errno, std::system_category());
+    } catch(...) {
+        if(w.m_fp)
+            fclose(w.m_fp);
+        unlink(tmp.c_str());
+        throw;
+    }
+
+    if(rename(tmp.c_str(), path) == -1)
+        throw std::system_error(errno, std::system_category());
+}
+
+G3DFile
+loadG3D(const char *path)
+{
+    auto mf = std::make_shared<MappedFile>(path);
+
+    G3DHeader h;
+    if(mf->size() < sizeof(h))
+        throw std::runtime_error{"Short .g3d file"};
+    memcpy(&h, mf->data(), sizeof(h));
+    if(memcmp(h.magic, "G3D", 4))
+        throw std::runtime_error{"Not a .g3d file"};
+    if(h.version != G3D_VERSION)
+        throw std::runtime_error{"Unsupported .g3d version"};
+    if(h.sections > (mf->size() - sizeof(h)) / sizeof(G3DSection))
+        throw std::runtime_error{"Corrupt .g3d section table"};
+
+    auto vb = std::make_shared<G3DVertexBuffer>();
+    vb->m_count = h.vertices;
+    vb->m_mf = mf;
+    if(h.grid_width)
+        vb->set_grid(glm::uvec2{h.grid_width, h.vertices / h.grid_width});
+
+    G3DFile r;
+    r.m_vb = vb;
+    r.m_bbmin = glm::vec3{h.bbmin[0], h.bbmin[1], h.bbmin[2]};
+    r.m_bbmax = glm::vec3{h.bbmax[0], h.bbmax[1], h.bbmax[2]};
+    r.m_source_hash = h.source_hash;
+
+    const G3DSection *sections =
+        (const G3DSection *)(mf->data() + sizeof(G3DHeader));
+
+    for(uint32_t i = 0; i < h.sections; i++) {
+        const G3DSection &s = sections[i];
+        if(s.offset % G3D_ALIGN || s.offset > mf->size() ||
+           s.size > mf->size() - s.offset)
+            throw std::runtime_error{"Corrupt .g3d section"};
+
+        const uint8_t *data = mf->data() + s.offset;
+
+        switch(s.type) {
+        case G3D_SECTION_ATTRIBUTE:
+            if(s.attribute >= 32 || s.elements == 0 || s.stride == 0 ||
+               s.size / sizeof(float) / s.stride < h.vertices)
+                throw std::runtime_error{"Corrupt .g3d attribute"};
+            if(s.attribute >= vb->m_views.size())
+                vb->m_views.resize(s.attribute + 1,
+                                   VertexAttribView{{}, nullptr, 0, 0});
+            vb->m_views[s.attribute] =
+                VertexAttribView{(VertexAttribute)s.attribute,
+                                 (const float *)data, s.stride, s.elements};
+            break;
+
+        case G3D_SECTION_INDEX:
+            if(s.size != h.triangles * sizeof(glm::ivec3))
+                throw std::runtime_error{"Corrupt .g3d index"};
+            r.m_ib = std::make_shared<std::vector<glm::ivec3>>(h.triangles);
+            memcpy(r.m_ib->data(), data, s.size);
+            break;
+
+        case G3D_SECTION_BVH:
+            if((int)s.attribute < 0 || s.size < (s.attribute + 1) * s.elements)
+                throw std::runtime_error{"Corrupt .g3d BVH"};
+            // Nodes are checked by Intersector::make()
+            vb->m_bvh = BvhBlob{data, s.size, (int)s.attribute, s.elements,
+                                (BvhKind)s.stride};
+            break;
+        }
+    }
+
+    if(!vb->get_attributes(VertexAttribute::Position))
+        throw std::runtime_error{".g3d file without positions"};
+    return r;
+}
+
+void
+setSceneCache(const char *dir, bool with_bvh)
+{
+    s_cache_dir = dir ? dir : "";
+    s_cache_bvh = with_bvh;
+    if(dir)
+        mkdirs(s_cache_dir);
+}
+
+std::optional<SceneCacheKey>
+sceneCacheKey(const char *path, const char *loader, const void *args,
+              size_t args_size)
+{
+    if(s_cache_dir.empty())
+        return std::nullopt;
+
+    try {
+        uint64_t h = contentHash(path);
+        h = hashBytes((const uint8_t *)loader, strlen(loader), h);
+        h = hashBytes((const uint8_t *)args, args_size, h);
+        return SceneCacheKey{h};
+    } catch(const std::exception &e) {
+        return std::nullopt;
+    }
+}
+
+std::optional<G3DFile>
+sceneCacheLoad(const SceneCacheKey &key)
+{
+    const std::string path = s_cache_dir + "/" + hex(key.m_hash) + ".g3d";
+    struct stat st;
+    if(stat(path.c_str(), &st) == -1)
+        return std::nullopt;
+
+    try {
+        auto r = loadG3D(path.c_str());
+        if(r.m_source_hash == key.m_hash)
+            return r;
+    } catch(const std::exception &e) {
+        fprintf(stderr, "Ignoring scene cache %s: %s\n", path.c_str(),
+                e.what());
+    }
+    return std::nullopt;
+}
+
+void
+sceneCacheStore(const SceneCacheKey &key,
+                const std::shared_ptr<VertexBuffer> &vb,
+                const std::shared_ptr<std::vector<glm::ivec3>> &ib)
+{
+    const std::string path = s_cache_dir + "/" + hex(key.m_hash) + ".g3d";
+
+    std::shared_ptr<Intersector> bvh;
+    if(s_cache_bvh && vb->size() && (!ib || ib->size())) {
+        bvh = ib ? Intersector::make(vb, ib)
+                 : Intersector::make(vb, IntersectionMode::POINT);
+    }
+
+    try {
+        saveG3D(path.c_str(), *vb, ib.get(), bvh.get(), key.m_hash);
+    } catch(const std::exception &e) {
+        fprintf(stderr, "Unable to write scene cache %s: %s\n", path.c_str(),
+                e.what());
+    }
+}
+
+}  // namespace g3d
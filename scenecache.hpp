@@ -0,0 +1,69 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "vertexbuffer.hpp"
+
+namespace g3d {
+
+struct Intersector;
+
+// .g3d: Memory mappable scene cache
+//
+// A 64 byte header is followed by a section table. Vertex attributes are
+// stored interleaved in one section so they can be uploaded straight from
+// the mapping. Index and BVH sections follow. Every section starts on a
+// 64 byte boundary.
+
+static constexpr uint32_t G3D_VERSION = 1;
+
+struct G3DFile {
+    std::shared_ptr<VertexBuffer> m_vb;
+    std::shared_ptr<std::vector<glm::ivec3>> m_ib;
+    glm::vec3 m_bbmin;
+    glm::vec3 m_bbmax;
+    uint64_t m_source_hash;
+};
+
+// bvh, if given, must have been built over vb (and ib) and be finished
+void saveG3D(const char *path, const VertexBuffer &vb,
+             const std::vector<glm::ivec3> *ib, Intersector *bvh,
+             uint64_t source_hash = 0);
+
+// Vertices (and the BVH, which Intersector::make picks up from the
+// VertexBuffer) are referenced in place in the mapped file
+G3DFile loadG3D(const char *path);
+
+// Enable transparent caching for loadOBJ(), loadPCD(), loadLAS() and
+// loadSTL(). Results are stored in dir keyed on a hash of the source file
+// content and the loader arguments. If with_bvh is set the intersection
+// tree is built and stored too, so interactive objects skip building it.
+// Pass NULL to disable.
+void setSceneCache(const char *dir, bool with_bvh = true);
+
+// Hash of the entire file content
+uint64_t hashFile(const char *path);
+
+// Same hash over memory, chained through seed
+uint64_t hashData(const void *data, size_t size, uint64_t seed = 0);
+
+// Used by the loaders
+struct SceneCacheKey {
+    uint64_t m_hash;
+};
+
+std::optional<SceneCacheKey> sceneCacheKey(const char *path,
+                                           const char *loader,
+                                           const void *args, size_t args_size);
+
+std::optional<G3DFile> sceneCacheLoad(const SceneCacheKey &key);
+
+void sceneCacheStore(const SceneCacheKey &key,
+                     const std::shared_ptr<VertexBuffer> &vb,
+                     const std::shared_ptr<std::vector<glm::ivec3>> &ib);
+
+}  // namespace g3d
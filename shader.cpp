@@ -0,0 +1,328 @@
+#include "shader.hpp"
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <map>
+#include <stdexcept>
+#include <string_view>
+
+#include "scenecache.hpp"
+
+namespace g3d {
+
+namespace {
+
+std::string s_cache_dir;
+
+// Every live program by header and sources
+std::map<std::string, std::weak_ptr<Shader>> s_shaders;
+
+// Binary cache files start with this, then the driver's binary format
+constexpr uint32_t BINARY_MAGIC = 0x31733367;  // "g3s1"
+
+std::string_view
+source(const char *code, int len)
+{
+    return code ? std::string_view(code, len < 0 ? strlen(code) : len)
+                : std::string_view();
+}
+
+// Lets the driver compile on its own threads, if it can. Status queries
+// then block, so they are deferred until ready() or use().
+bool
+parallelCompile()
+{
+    static const bool parallel = [] {
+        if(GLEW_KHR_parallel_shader_compile) {
+            glMaxShaderCompilerThreadsKHR(0xffffffff);
+            return true;
+        }
+        if(GLEW_ARB_parallel_shader_compile) {
+            glMaxShaderCompilerThreadsARB(0xffffffff);
+            return true;
+        }
+        return false;
+    }();
+    return parallel;
+}
+
+const char *
+stageName(GLenum type)
+{
+    switch(type) {
+    case GL_VERTEX_SHADER:
+        return "vertex";
+    case GL_FRAGMENT_SHADER:
+        return "fragment";
+    default:
+        return "geometry";
+    }
+}
+
+std::string
+hex(uint64_t x)
+{
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)x);
+    return buf;
+}
+
+std::string
+binaryPath(uint64_t key)
+{
+    return s_cache_dir + "/" + hex(key) + ".bin";
+}
+
+}  // namespace
+
+Shader::Shader(const char *name, const char *header, const char *vcode,
+               int vcode_len, const char *fcode, int fcode_len,
+               const char *gcode, int gcode_len)
+  : m_name(name)
+{
+    const std::pair<GLenum, std::string_view> stages[3] = {
+        {GL_VERTEX_SHADER, source(vcode, vcode_len)},
+        {GL_FRAGMENT_SHADER, source(fcode, fcode_len)},
+        {GL_GEOMETRY_SHADER, source(gcode, gcode_len)},
+    };
+    header = header ?: "";
+
+    if(!s_cache_dir.empty() && GLEW_ARB_get_program_binary) {
+        // Binaries only work with the driver that made them
+        uint64_t h = 0;
+        for(GLenum e : {GL_VENDOR, GL_RENDERER, GL_VERSION}) {
+            const char *s = (const char *)glGetString(e);
+            h = hashData(s, strlen(s) + 1, h);
+        }
+        h = hashData(header, strlen(header) + 1, h);
+        for(const auto &[type, code] : stages)
+            h = hashData(code.data(), code.size(), h + type);
+        m_key = h;
+    }
+
+    m_id = glCreateProgram();
+
+    try {
+        if(m_key && loadBinary(*m_key)) {
+            introspect();
+            return;
+        }
+
+        for(const auto &[type, code] : stages) {
+            if(code.data() == NULL)
+                continue;
+            const char *codevec[2] = {header, code.data()};
+            const int codelen[2] = {-1, (int)code.size()};
+
+            const GLuint shader = glCreateShader(type);
+            m_stages.push_back(shader);
+            glShaderSource(shader, 2, codevec, codelen);
+            glCompileShader(shader);
+            glAttachShader(m_id, shader);
+        }
+
+        if(m_key)
+            glProgramParameteri(m_id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+                                GL_TRUE);
+        glLinkProgram(m_id);
+        m_pending = true;
+        if(!parallelCompile())
+            finish();
+    } catch(...) {
+        release();
+        throw;
+    }
+}
+
+Shader::~Shader()
+{
+    release();
+}
+
+void
+Shader::release()
+{
+    for(GLuint shader : m_stages)
+        glDeleteShader(shader);
+    m_stages.clear();
+    DrawState::deleteProgram(m_id);
+}
+
+std::shared_ptr<Shader>
+Shader::get(const char *name, const char *header, const char *vcode,
+            int vcode_len, const char *fcode, int fcode_len,
+            const char *gcode, int gcode_len)
+{
+    std::string key(header ?: "");
+    for(auto code : {source(vcode, vcode_len), source(fcode, fcode_len),
+                     source(gcode, gcode_len)}) {
+        key += '\0';
+        key += code;
+    }
+
+    auto it = s_shaders.find(key);
+    if(it != s_shaders.end()) {
+        if(auto s = it->second.lock())
+            return s;
+    }
+
+    auto s = std::make_shared<Shader>(name, header, vcode, vcode_len, fcode,
+                                      fcode_len, gcode, gcode_len);
+
+    // Variants come and go with attribute masks, forget the dead ones
+    for(auto i = s_shaders.begin(); i != s_shaders.end();) {
+        if(i->second.expired())
+            i = s_shaders.erase(i);
+        else
+            ++i;
+    }
+    s_shaders[key] = s;
+    return s;
+}
+
+bool
+Shader::ready()
+{
+    if(!m_pending)
+        return true;
+
+    GLint done = GL_FALSE;
+    glGetProgramiv(m_id, GL_COMPLETION_STATUS_KHR, &done);
+    if(!done)
+        return false;
+
+    finish();
+    return true;
+}
+
+// Stays pending on failure, so every later ready() or use() throws too.
+// drawObject() catches it and hides the object.
+void
+Shader::finish()
+{
+    char err[1024];
+    GLint success;
+
+    glGetProgramiv(m_id, GL_LINK_STATUS, &success);
+    if(!success) {
+        GLenum type[3] = {GL_VERTEX_SHADER, GL_FRAGMENT_SHADER,
+                          GL_GEOMETRY_SHADER};
+        for(size_t i = 0; i < m_stages.size(); i++) {
+            glGetShaderiv(m_stages[i], GL_COMPILE_STATUS, &success);
+            if(!success) {
+                glGetShaderInfoLog(m_stages[i], sizeof(err), NULL, err);
+                throw std::runtime_error{
+                    std::string("Unable to compile ") + stageName(type[i]) +
+                    " shader: " + m_name + ":\n" + err};
+            }
+        }
+        glGetProgramInfoLog(m_id, sizeof(err), NULL, err);
+        throw std::runtime_error{"Unable to link shader: " + m_name + ":\n" +
+                                 err};
+    }
+
+    m_pending = false;
+    for(GLuint shader : m_stages) {
+        glDetachShader(m_id, shader);
+        glDeleteShader(shader);
+    }
+    m_stages.clear();
+
+    if(m_key)
+        saveBinary(*m_key);
+    introspect();
+}
+
+void
+Shader::introspect()
+{
+    const GLuint frame = glGetUniformBlockIndex(m_id, "Frame");
+    if(frame != GL_INVALID_INDEX)
+        glUniformBlockBinding(m_id, frame, FRAME_UNIFORMS_BINDING);
+
+    // Every active uniform is known up front, so lookups are a hash
+    // away and names not found need no GL call either
+    GLint count = 0;
+    glGetProgramiv(m_id, GL_ACTIVE_UNIFORMS, &count);
+    for(GLint i = 0; i < count; i++) {
+        char uname[256];
+        GLint size;
+        GLenum type;
+        glGetActiveUniform(m_id, i, sizeof(uname), NULL, &size, &type, uname);
+        char *bracket = strstr(uname, "[0]");
+        if(bracket)
+            *bracket = 0;
+        const GLint loc = glGetUniformLocation(m_id, uname);
+        if(loc != -1)
+            m_locations.emplace(UniformName::hash(uname),
+                                std::make_pair(std::string(uname), loc));
+    }
+}
+
+// A stale or foreign binary just fails to link, and is then compiled
+// over and saved again
+bool
+Shader::loadBinary(uint64_t key)
+{
+    FILE *fp = fopen(binaryPath(key).c_str(), "rb");
+    if(fp == NULL)
+        return false;
+
+    uint32_t hdr[2];
+    std::vector<uint8_t> blob;
+    if(fread(hdr, sizeof(hdr), 1, fp) == 1 && hdr[0] == BINARY_MAGIC) {
+        uint8_t buf[65536];
+        size_t r;
+        while((r = fread(buf, 1, sizeof(buf), fp)) > 0)
+            blob.insert(blob.end(), buf, buf + r);
+    }
+    fclose(fp);
+    if(blob.empty())
+        return false;
+
+    glProgramBinary(m_id, hdr[1], blob.data(), blob.size());
+    GLint success;
+    glGetProgramiv(m_id, GL_LINK_STATUS, &success);
+    return success;
+}
+
+// Written aside and renamed into place, so another process never reads
+// half a binary. Failing to save is not an error.
+void
+Shader::saveBinary(uint64_t key) const
+{
+    GLint len = 0;
+    glGetProgramiv(m_id, GL_PROGRAM_BINARY_LENGTH, &len);
+    if(len <= 0)
+        return;
+
+    std::vector<uint8_t> blob(len);
+    GLenum format;
+    glGetProgramBinary(m_id, len, &len, &format, blob.data());
+
+    const std::string path = binaryPath(key);
+    const std::string tmp = path + "." + std::to_string(getpid());
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if(fp == NULL)
+        return;
+
+    const uint32_t hdr[2] = {BINARY_MAGIC, format};
+    const bool ok = fwrite(hdr, sizeof(hdr), 1, fp) == 1 &&
+                    fwrite(blob.data(), len, 1, fp) == 1;
+    if(fclose(fp) || !ok || rename(tmp.c_str(), path.c_str()))
+        unlink(tmp.c_str());
+}
+
+void
+setShaderCache(const char *dir)
+{
+    s_cache_dir = dir ? dir : "";
+    for(size_t i = 1; dir && i <= s_cache_dir.size(); i++) {
+        if(i == s_cache_dir.size() || s_cache_dir[i] == '/')
+            mkdir(s_cache_dir.substr(0, i).c_str(), 0777);
+    }
+}
+
+}  // namespace g3d
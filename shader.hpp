@@ -1,177 +1,191 @@
 #pragma once
 
+#include <stdint.h>
+#include <string.h>
+
 #include <iostream>
+#include <memory>
+#include <optional>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
+#include "drawstate.hpp"
 #include "opengl.hpp"
 
 #include <glm/glm.hpp>
 
 namespace g3d {
 
-struct Shader {
-    Shader(const Shader &) = delete;
-    Shader &operator=(const Shader &) = delete;
-
-    Shader(const char *name, const char *header, const char *vcode,
-           int vcode_len, const char *fcode, int fcode_len,
-           const char *gcode = NULL, int gcode_len = 0)
+// A uniform name and its FNV-1a hash, which the compiler works out for
+// string literals
+struct UniformName {
+    constexpr UniformName(const char *name) : m_name(name), m_hash(hash(name))
     {
-        GLint success;
-        char err[1024];
-
-        const char *codevec[2];
-        int codelen[2];
-
-        codevec[0] = header ?: "";
-        codelen[0] = -1;
-
-        codevec[1] = vcode;
-        codelen[1] = vcode_len;
+    }
 
-        uint32_t vertex = glCreateShader(GL_VERTEX_SHADER);
-        glShaderSource(vertex, 2, codevec, codelen);
-        glCompileShader(vertex);
+    UniformName(const std::string &name) : UniformName(name.c_str()) {}
 
-        glGetShaderiv(vertex, GL_COMPILE_STATUS, &success);
-        if(!success) {
-            glGetShaderInfoLog(vertex, sizeof(err), NULL, err);
-            fprintf(stderr, "Unable to compile vertex shader: %s:\n%s\n", name,
-                    err);
-            exit(1);
+    static constexpr uint32_t hash(const char *s)
+    {
+        uint32_t h = 2166136261u;
+        while(*s) {
+            h ^= (uint8_t)*s++;
+            h *= 16777619u;
         }
+        return h;
+    }
 
-        codevec[1] = fcode;
-        codelen[1] = fcode_len;
-
-        uint32_t fragment = glCreateShader(GL_FRAGMENT_SHADER);
-        glShaderSource(fragment, 2, codevec, codelen);
-        glCompileShader(fragment);
+    const char *m_name;
+    uint32_t m_hash;
+};
 
-        glGetShaderiv(fragment, GL_COMPILE_STATUS, &success);
-        if(!success) {
-            glGetShaderInfoLog(fragment, sizeof(err), NULL, err);
-            fprintf(stderr, "Unable to compile fragment shader: %s:\n%s\n",
-                    name, err);
-            exit(1);
-        }
+struct Shader {
+    Shader(const Shader &) = delete;
+    Shader &operator=(const Shader &) = delete;
 
-        m_id = glCreateProgram();
-        glAttachShader(m_id, vertex);
-        glAttachShader(m_id, fragment);
-
-        if(gcode != NULL) {
-            uint32_t geometry = glCreateShader(GL_GEOMETRY_SHADER);
-
-            codevec[1] = gcode;
-            codelen[1] = gcode_len;
-            glShaderSource(geometry, 2, codevec, codelen);
-            glCompileShader(geometry);
-
-            glGetShaderiv(geometry, GL_COMPILE_STATUS, &success);
-            if(!success) {
-                glGetShaderInfoLog(geometry, sizeof(err), NULL, err);
-                fprintf(stderr, "Unable to compile geometry shader: %s:\n%s\n",
-                        name, err);
-                exit(1);
-            }
-            glAttachShader(m_id, geometry);
-        }
+    // The header (#version and defines) goes before each stage's code.
+    // Throws std::runtime_error with the log if compiling or linking
+    // fails, from ready() or use() if the driver compiles in the
+    // background (KHR_parallel_shader_compile), and again from every
+    // later ready() or use(). Objects draw through drawObject(), which
+    // catches this and hides them.
+    Shader(const char *name, const char *header, const char *vcode,
+           int vcode_len, const char *fcode, int fcode_len,
+           const char *gcode = NULL, int gcode_len = 0);
 
-        glLinkProgram(m_id);
-        glGetProgramiv(m_id, GL_LINK_STATUS, &success);
-        if(!success) {
-            glGetProgramInfoLog(m_id, sizeof(err), NULL, err);
-            fprintf(stderr, "Unable to link shader: %s:\n%s\n", name, err);
-            exit(1);
-        }
+    ~Shader();
 
-        glDeleteShader(vertex);
-        glDeleteShader(fragment);
-    }
+    // The program for these sources and header, shared by everyone
+    // asking for the same and released with its last user
+    static std::shared_ptr<Shader> get(const char *name, const char *header,
+                                       const char *vcode, int vcode_len,
+                                       const char *fcode, int fcode_len,
+                                       const char *gcode = NULL,
+                                       int gcode_len = 0);
 
-    ~Shader() { glDeleteProgram(m_id); }
+    // False while the driver is still compiling. Objects skip drawing
+    // until then, use() would wait.
+    bool ready();
 
-    void use() const { glUseProgram(m_id); }
+    void use()
+    {
+        if(m_pending)
+            finish();
+        DrawState::useProgram(m_id);
+    }
 
-    bool has_uniform(const char *name) const
+    bool has_uniform(UniformName name) const
     {
-        return glGetUniformLocation(m_id, name) != -1;
+        return location(name) != -1;
     }
 
-    GLint uniloc(const char *name) const
+    // Reports a missing uniform the first time it is asked for
+    GLint uniloc(UniformName name) const
     {
-        GLint r = glGetUniformLocation(m_id, name);
-        if(r == -1) {
-            fprintf(stderr, "Uniform %s not found\n", name);
-            //      exit(1);
-        }
+        const GLint r = location(name);
+        if(r == -1 && m_missing.emplace(name.m_name).second)
+            fprintf(stderr, "Uniform %s not found\n", name.m_name);
         return r;
     }
 
-    GLint uniloc(const std::string &name) const { return uniloc(name.c_str()); }
-
-    void setBool(const std::string &name, bool value) const
+    void setBool(UniformName name, bool value) const
     {
         glUniform1i(uniloc(name), (int)value);
     }
 
-    void setInt(const std::string &name, int value) const
+    void setInt(UniformName name, int value) const
     {
         glUniform1i(uniloc(name), value);
     }
 
-    void setFloat(const std::string &name, float value) const
+    void setFloat(UniformName name, float value) const
     {
         glUniform1f(uniloc(name), value);
     }
 
-    void setVec2(const std::string &name, const glm::vec2 &value) const
+    void setVec2(UniformName name, const glm::vec2 &value) const
     {
         glUniform2fv(uniloc(name), 1, &value[0]);
     }
 
-    void setVec2(const std::string &name, float x, float y) const
+    void setVec2(UniformName name, float x, float y) const
     {
         glUniform2f(uniloc(name), x, y);
     }
 
-    void setVec3(const std::string &name, const glm::vec3 &value) const
+    void setVec3(UniformName name, const glm::vec3 &value) const
     {
         glUniform3fv(uniloc(name), 1, &value[0]);
     }
 
-    void setVec3(const std::string &name, float x, float y, float z) const
+    void setVec3(UniformName name, float x, float y, float z) const
     {
         glUniform3f(uniloc(name), x, y, z);
     }
 
-    void setVec4(const std::string &name, const glm::vec4 &value) const
+    void setVec4(UniformName name, const glm::vec4 &value) const
     {
         glUniform4fv(uniloc(name), 1, &value[0]);
     }
 
-    void setVec4(const std::string &name, float x, float y, float z, float w)
+    void setVec4(UniformName name, float x, float y, float z, float w)
     {
         glUniform4f(uniloc(name), x, y, z, w);
     }
 
-    void setMat2(const std::string &name, const glm::mat2 &mat) const
+    void setMat2(UniformName name, const glm::mat2 &mat) const
     {
         glUniformMatrix2fv(uniloc(name), 1, GL_FALSE, &mat[0][0]);
     }
 
-    void setMat3(const std::string &name, const glm::mat3 &mat) const
+    void setMat3(UniformName name, const glm::mat3 &mat) const
     {
         glUniformMatrix3fv(uniloc(name), 1, GL_FALSE, &mat[0][0]);
     }
 
-    void setMat4(const std::string &name, const glm::mat4 &mat) const
+    void setMat4(UniformName name, const glm::mat4 &mat) const
     {
         glUniformMatrix4fv(uniloc(name), 1, GL_FALSE, &mat[0][0]);
     }
 
     unsigned int m_id;
+
+private:
+    void finish();
+
+    void introspect();
+
+    void release();
+
+    bool loadBinary(uint64_t key);
+
+    void saveBinary(uint64_t key) const;
+
+    GLint location(UniformName name) const
+    {
+        auto it = m_locations.find(name.m_hash);
+        if(it != m_locations.end() && it->second.first == name.m_name)
+            return it->second.second;
+        if(it == m_locations.end())
+            return -1;
+        // Another name with the same hash
+        return glGetUniformLocation(m_id, name.m_name);
+    }
+
+    const std::string m_name;
+    bool m_pending{false};          // Linked, status not yet checked
+    std::vector<GLuint> m_stages;   // Until then
+    std::optional<uint64_t> m_key;  // In the shader cache
+
+    std::unordered_map<uint32_t, std::pair<std::string, GLint>> m_locations;
+    mutable std::unordered_set<std::string> m_missing;
 };
 
+// Keep linked programs in dir as driver binaries, keyed on their sources
+// and the GL driver, so later runs skip compiling. Pass NULL to disable.
+void setShaderCache(const char *dir);
+
 }  // namespace g3d
@@ -0,0 +1,213 @@
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
+#include <string.h>
+
+#include "object.hpp"
+#include "vertexbuffer.hpp"
+#include "mappedfile.hpp"
+#include "parallel.hpp"
+#include "scenecache.hpp"
+
+namespace g3d {
+
+namespace {
+
+struct WeldKey {
+    int64_t x, y, z;
+
+    bool operator==(const WeldKey &o) const
+    {
+        return x == o.x && y == o.y && z == o.z;
+    }
+};
+
+struct WeldKeyHash {
+    size_t operator()(const WeldKey &k) const
+    {
+        uint64_t h = k.x * 0x9e3779b97f4a7c15ull;
+        h = (h ^ (h >> 31) ^ k.y) * 0xbf58476d1ce4e5b9ull;
+        h = (h ^ (h >> 29) ^ k.z) * 0x94d049bb133111ebull;
+        return h ^ (h >> 32);
+    }
+};
+
+WeldKey
+weldKey(const glm::vec3 &p, float inv_epsilon)
+{
+    if(inv_epsilon == 0) {
+        // Exact match on the bit pattern, with -0 folded into +0
+        int32_t b[3];
+        const glm::vec3 q = p + glm::vec3{0.0f};
+        memcpy(b, &q[0], sizeof(b));
+        return WeldKey{b[0], b[1], b[2]};
+    }
+    return WeldKey{(int64_t)floor(p.x * inv_epsilon),
+                   (int64_t)floor(p.y * inv_epsilon),
+                   (int64_t)floor(p.z * inv_epsilon)};
+}
+
+// Bytes saved over drawing the soup, 0 if the indices cost more
+WeldStats
+weldStats(size_t vertices_in, size_t vertices_out, size_t triangles)
+{
+    const size_t soup_bytes = vertices_in * sizeof(glm::vec3);
+    const size_t indexed_bytes = vertices_out * sizeof(glm::vec3) +
+                                 triangles * sizeof(glm::ivec3);
+    return WeldStats{
+        vertices_in, vertices_out,
+        soup_bytes > indexed_bytes ? soup_bytes - indexed_bytes : 0};
+}
+
+}  // namespace
+
+std::pair<std::shared_ptr<VertexBuffer>,
+          std::shared_ptr<std::vector<glm::ivec3>>>
+loadSTL(const char *path, const glm::mat4 transform, float weld_epsilon,
+        WeldStats *stats)
+{
+    const struct {
+        glm::mat4 transform;
+        float weld_epsilon;
+    } args{transform, weld_epsilon};
+
+    auto key = sceneCacheKey(path, "stl", &args, sizeof(args));
+    if(key) {
+        if(auto c = sceneCacheLoad(*key)) {
+            if(stats) {
+                // The vertices in are counted in the header, which the
+                // cache key has just hashed along with the rest
+                MappedFile mf(path);
+                uint32_t triangles = 0;
+                if(mf.size() >= 84)
+                    memcpy(&triangles, mf.data() + 80, 4);
+                *stats = weldStats((size_t)triangles * 3, c->m_vb->size(),
+                                   c->m_ib->size());
+            }
+            return {c->m_vb, c->m_ib};
+        }
+    }
+
+    MappedFile mf(path);
+
+    if(mf.size() < 84)
+        throw std::runtime_error{"Not a binary STL file"};
+
+    uint32_t triangles;
+    memcpy(&triangles, mf.data() + 80, 4);
+    if(mf.size() < 84 + (size_t)triangles * 50) {
+        if(!memcmp(mf.data(), "solid", 5))
+            throw std::runtime_error{"ASCII STL is not supported"};
+        throw std::runtime_error{"Short STL file"};
+    }
+
+    // Each triangle record is a face normal, three vertices and a
+    // 16 bit attribute count, 50 bytes in total
+    const size_t count = (size_t)triangles * 3;
+    const uint8_t *base = mf.data() + 84;
+    const float inv_epsilon = weld_epsilon > 0 ? 1.0f / weld_epsilon : 0;
+
+    std::vector<glm::vec3> soup(count);
+    std::vector<WeldKey> keys(count);
+    std::vector<size_t> hashes(count);
+
+    parallelFor(count, [&](size_t begin, size_t end, size_t chunk) {
+        for(size_t i = begin; i < end; i++) {
+            float v[3];
+            memcpy(v, base + (i / 3) * 50 + 12 + (i % 3) * 12, sizeof(v));
+            soup[i] = transform * glm::vec4{v[0], v[1], v[2], 1};
+            keys[i] = weldKey(soup[i], inv_epsilon);
+            hashes[i] = WeldKeyHash()(keys[i]);
+        }
+    });
+
+    // Each shard owns the keys hashing to it, so the shards can be
+    // resolved in parallel without locking. Every vertex is mapped to the
+    // first vertex with the same key.
+    const size_t shards = parallelChunks(count, 1 << 16);
+    std::vector<uint32_t> rep(count);
+
+    // Vertices are first bucketed by shard, in order. Each chunk counts
+    // its vertices per shard, then writes them to its own part of every
+    // bucket.
+    const size_t chunks = parallelChunks(count, 1 << 16);
+    std::vector<size_t> offsets(chunks * shards);
+    parallelFor(
+        count,
+        [&](size_t begin, size_t end, size_t chunk) {
+            size_t *n = &offsets[chunk * shards];
+            for(size_t i = begin; i < end; i++)
+                n[hashes[i] % shards]++;
+        },
+        1 << 16);
+
+    std::vector<size_t> buckets(shards + 1);
+    size_t total = 0;
+    for(size_t shard = 0; shard < shards; shard++) {
+        buckets[shard] = total;
+        for(size_t chunk = 0; chunk < chunks; chunk++) {
+            const size_t n = offsets[chunk * shards + shard];
+            offsets[chunk * shards + shard] = total;
+            total += n;
+        }
+    }
+    buckets[shards] = total;
+
+    std::vector<uint32_t> order(count);
+    parallelFor(
+        count,
+        [&](size_t begin, size_t end, size_t chunk) {
+            size_t *o = &offsets[chunk * shards];
+            for(size_t i = begin; i < end; i++)
+                order[o[hashes[i] % shards]++] = i;
+        },
+        1 << 16);
+
+    parallelFor(
+        shards,
+        [&](size_t begin, size_t end, size_t chunk) {
+            for(size_t shard = begin; shard < end; shard++) {
+                std::unordered_map<WeldKey, uint32_t, WeldKeyHash> map;
+                map.reserve(buckets[shard + 1] - buckets[shard]);
+                for(size_t j = buckets[shard]; j < buckets[shard + 1]; j++) {
+                    const uint32_t i = order[j];
+                    rep[i] = map.emplace(keys[i], i).first->second;
+                }
+            }
+        },
+        1);
+
+    order = std::vector<uint32_t>();
+    hashes = std::vector<size_t>();
+    keys = std::vector<WeldKey>();
+
+    // Representatives always precede the vertices mapped to them
+    std::vector<glm::vec3> positions;
+    for(size_t i = 0; i < count; i++) {
+        if(rep[i] == i) {
+            rep[i] = positions.size();
+            positions.push_back(soup[i]);
+        } else {
+            rep[i] = rep[rep[i]];
+        }
+    }
+
+    auto ib = std::make_shared<std::vector<glm::ivec3>>();
+    ib->reserve(triangles);
+    for(size_t i = 0; i < count; i += 3) {
+        const glm::ivec3 t{rep[i], rep[i + 1], rep[i + 2]};
+        // Welding may collapse small triangles
+        if(t.x != t.y && t.y != t.z && t.x != t.z)
+            ib->push_back(t);
+    }
+
+    if(stats)
+        *stats = weldStats(count, positions.size(), ib->size());
+
+    auto vb = VertexBuffer::make(std::move(positions));
+    if(key)
+        sceneCacheStore(*key, vb, ib);
+    return {vb, ib};
+}
+
+}  // namespace g3d
@@ -1,9 +1,42 @@
 #include "texture.hpp"
 
+#include <stdint.h>
 #include <stdlib.h>
 
+#include <algorithm>
+#include <stdexcept>
+
+#include "asyncload.hpp"
+
 namespace g3d {
 
+namespace {
+
+struct TexFormat {
+    GLint internal;
+    GLenum format;
+    GLenum type;
+};
+
+// Depth ends up in the red channel, DEPTH16 normalized to [0, 1]
+TexFormat
+texFormat(PixelFormat pf)
+{
+    switch(pf) {
+    case PixelFormat::RGB8:
+        return {GL_RGB8, GL_RGB, GL_UNSIGNED_BYTE};
+    case PixelFormat::DEPTH16:
+        return {GL_R16, GL_RED, GL_UNSIGNED_SHORT};
+    case PixelFormat::DEPTH32F:
+        return {GL_R32F, GL_RED, GL_FLOAT};
+    }
+    throw std::invalid_argument{"Unsupported texture pixel format"};
+}
+
+}  // namespace
+
+Texture2D::Texture2D() : m_upload_ticket(UploadClock::ticket()) {}
+
 Texture2D::~Texture2D()
 {
     if(m_tex)
@@ -13,20 +46,48 @@ Texture2D::~Texture2D()
 GLuint
 Texture2D::get()
 {
-    if(m_img) {
-        if(!m_tex)
-            glGenTextures(1, &m_tex);
+    if(!m_img)
+        return m_tex;
+
+    const size_t width = m_img->m_width;
+    const size_t height = m_img->m_height;
+    const size_t row_bytes = width * m_img->bytesPerPixel();
+    const TexFormat tf = texFormat(m_img->m_format);
 
-        glBindTexture(GL_TEXTURE_2D, m_tex);
+    if(!m_tex)
+        glGenTextures(1, &m_tex);
+    glBindTexture(GL_TEXTURE_2D, m_tex);
+
+    if(m_rows == 0) {
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D, 0, tf.internal, width, height, 0,
+                     tf.format, tf.type, NULL);
+    }
 
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, m_img->m_width, m_img->m_height,
-                     0, GL_RGB, GL_UNSIGNED_BYTE, m_img->m_data);
-        m_img.reset();
+    // Rows are tightly packed
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    const size_t band =
+        std::max<size_t>(1, UploadClock::SLICE_BYTES / std::max<size_t>(
+                                                           1, row_bytes));
+    for(bool first = true;
+        m_rows < height && (first ? UploadClock::claim(m_upload_ticket)
+                                  : UploadClock::available());
+        first = false) {
+        const size_t n = std::min(band, height - m_rows);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, m_rows, width, n, tf.format,
+                        tf.type,
+                        (const uint8_t *)m_img->m_data + m_rows * row_bytes);
+        m_rows += n;
     }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    if(m_rows < height)
+        return 0;
+    m_img.reset();
+    m_rows = 0;
     return m_tex;
 }
 }  // namespace g3d
@@ -11,16 +11,27 @@ struct Texture2D {
     Texture2D(const Texture2D&) = delete;
     Texture2D& operator=(const Texture2D&) = delete;
 
-    Texture2D() = default;
+    Texture2D();
 
     ~Texture2D();
 
+    // Uploads the image a band of rows at a time, while UploadClock
+    // allows. Returns 0 until it is complete. Depth images go to the red
+    // channel.
     GLuint get();
 
-    void set(const std::shared_ptr<Image2D>& img) { m_img = img; }
+    void set(const std::shared_ptr<Image2D>& img)
+    {
+        m_img = img;
+        m_rows = 0;
+    }
+
+    bool uploading() const { return m_img != nullptr; }
 
 private:
     std::shared_ptr<Image2D> m_img;
+    size_t m_rows{0};  // Of m_img uploaded so far
+    const uint64_t m_upload_ticket;  // See UploadClock
 
     GLuint m_tex{0};
 };
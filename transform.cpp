@@ -0,0 +1,341 @@
+#include "transform.hpp"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "parallel.hpp"
+
+namespace g3d {
+
+namespace {
+
+#ifdef __AVX2__
+
+inline __m256
+madd(__m256 a, __m256 b, __m256 c)
+{
+#ifdef __FMA__
+    return _mm256_fmadd_ps(a, b, c);
+#else
+    return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
+
+struct AVXTransform {
+    explicit AVXTransform(const glm::mat4 &m)
+    {
+        for(int c = 0; c < 4; c++)
+            for(int r = 0; r < 3; r++)
+                e[c][r] = _mm256_set1_ps(m[c][r]);
+    }
+
+    void operator()(__m256 &x, __m256 &y, __m256 &z) const
+    {
+        const __m256 ox = madd(e[0][0], x, madd(e[1][0], y,
+                                                madd(e[2][0], z, e[3][0])));
+        const __m256 oy = madd(e[0][1], x, madd(e[1][1], y,
+                                                madd(e[2][1], z, e[3][1])));
+        const __m256 oz = madd(e[0][2], x, madd(e[1][2], y,
+                                                madd(e[2][2], z, e[3][2])));
+        x = ox;
+        y = oy;
+        z = oz;
+    }
+
+    __m256 e[4][3];
+};
+
+// Bit set for each lane inside the box, NaN counts as inside
+inline int
+insideMask(__m256 x, __m256 y, __m256 z, const __m256 lo[3],
+           const __m256 hi[3])
+{
+    const __m256 o = _mm256_or_ps(
+        _mm256_or_ps(
+            _mm256_or_ps(_mm256_cmp_ps(x, lo[0], _CMP_LT_OQ),
+                         _mm256_cmp_ps(x, hi[0], _CMP_GT_OQ)),
+            _mm256_or_ps(_mm256_cmp_ps(y, lo[1], _CMP_LT_OQ),
+                         _mm256_cmp_ps(y, hi[1], _CMP_GT_OQ))),
+        _mm256_or_ps(_mm256_cmp_ps(z, lo[2], _CMP_LT_OQ),
+                     _mm256_cmp_ps(z, hi[2], _CMP_GT_OQ)));
+    return ~_mm256_movemask_ps(o) & 0xff;
+}
+
+#endif
+
+inline bool
+outside(const glm::vec3 &p, const glm::vec3 &lo, const glm::vec3 &hi)
+{
+    return p.x < lo.x || p.y < lo.y || p.z < lo.z || p.x > hi.x ||
+           p.y > hi.y || p.z > hi.z;
+}
+
+// Transforms src[0, count) into dst, skipping points outside the box if
+// crop is set. Reads always stay ahead of writes so dst may alias src.
+template <bool crop>
+size_t
+aosKernel(const glm::mat4 &m, const glm::vec3 &lo, const glm::vec3 &hi,
+          const float *src, size_t stride, glm::vec3 *dst, size_t count)
+{
+    size_t i = 0;
+    size_t j = 0;
+
+#ifdef __AVX2__
+    const AVXTransform t(m);
+    const __m256 vlo[3] = {_mm256_set1_ps(lo.x), _mm256_set1_ps(lo.y),
+                           _mm256_set1_ps(lo.z)};
+    const __m256 vhi[3] = {_mm256_set1_ps(hi.x), _mm256_set1_ps(hi.y),
+                           _mm256_set1_ps(hi.z)};
+
+    // Other strides are left to the SSE loop below, gathers are slower
+    for(; stride == 3 && i + 8 <= count; i += 8) {
+        __m256 x, y, z;
+        loadXYZ(src + i * 3, x, y, z);
+        t(x, y, z);
+
+        int mask = crop ? insideMask(x, y, z, vlo, vhi) : 0xff;
+        if(mask == 0xff) {
+            storeXYZ(&dst[j][0], x, y, z);
+            j += 8;
+            continue;
+        }
+        alignas(32) float tx[8], ty[8], tz[8];
+        _mm256_store_ps(tx, x);
+        _mm256_store_ps(ty, y);
+        _mm256_store_ps(tz, z);
+        while(mask) {
+            const int k = __builtin_ctz(mask);
+            mask &= mask - 1;
+            dst[j++] = glm::vec3{tx[k], ty[k], tz[k]};
+        }
+    }
+#endif
+
+#ifdef __SSE2__
+    const SSETransform st(m);
+    const SSEBox box(lo, hi);
+    for(; i < count; i++) {
+        const float *s = src + i * stride;
+        const __m128 p = st(_mm_setr_ps(s[0], s[1], s[2], 0));
+        if(crop && box.outside(p))
+            continue;
+        float tmp[4];
+        _mm_storeu_ps(tmp, p);
+        dst[j++] = glm::vec3{tmp[0], tmp[1], tmp[2]};
+    }
+#else
+    for(; i < count; i++) {
+        const float *s = src + i * stride;
+        const glm::vec3 p = m * glm::vec4{s[0], s[1], s[2], 1};
+        if(crop && outside(p, lo, hi))
+            continue;
+        dst[j++] = p;
+    }
+#endif
+    return j;
+}
+
+size_t
+soaKernel(const glm::mat4 &m, const glm::vec3 &lo, const glm::vec3 &hi,
+          const float *x, const float *y, const float *z, float *ox,
+          float *oy, float *oz, size_t count)
+{
+    size_t i = 0;
+    size_t j = 0;
+
+#ifdef __AVX2__
+    const AVXTransform t(m);
+    const __m256 vlo[3] = {_mm256_set1_ps(lo.x), _mm256_set1_ps(lo.y),
+                           _mm256_set1_ps(lo.z)};
+    const __m256 vhi[3] = {_mm256_set1_ps(hi.x), _mm256_set1_ps(hi.y),
+                           _mm256_set1_ps(hi.z)};
+
+    for(; i + 8 <= count; i += 8) {
+        __m256 vx = _mm256_loadu_ps(x + i);
+        __m256 vy = _mm256_loadu_ps(y + i);
+        __m256 vz = _mm256_loadu_ps(z + i);
+        t(vx, vy, vz);
+
+        int mask = insideMask(vx, vy, vz, vlo, vhi);
+        if(mask == 0xff) {
+            _mm256_storeu_ps(ox + j, vx);
+            _mm256_storeu_ps(oy + j, vy);
+            _mm256_storeu_ps(oz + j, vz);
+            j += 8;
+            continue;
+        }
+        alignas(32) float tx[8], ty[8], tz[8];
+        _mm256_store_ps(tx, vx);
+        _mm256_store_ps(ty, vy);
+        _mm256_store_ps(tz, vz);
+        while(mask) {
+            const int k = __builtin_ctz(mask);
+            mask &= mask - 1;
+            ox[j] = tx[k];
+            oy[j] = ty[k];
+            oz[j] = tz[k];
+            j++;
+        }
+    }
+#endif
+
+    for(; i < count; i++) {
+        const glm::vec3 p = m * glm::vec4{x[i], y[i], z[i], 1};
+        if(outside(p, lo, hi))
+            continue;
+        ox[j] = p.x;
+        oy[j] = p.y;
+        oz[j] = p.z;
+        j++;
+    }
+    return j;
+}
+
+// min/max return their second operand if either is NaN, so NaN points
+// leave the accumulators as they were
+void
+boundsKernel(const float *src, size_t stride, size_t count, glm::vec3 &lo,
+             glm::vec3 &hi)
+{
+    size_t i = 0;
+    lo = glm::vec3{INFINITY};
+    hi = glm::vec3{-INFINITY};
+
+#ifdef __AVX2__
+    if(stride == 3 && count >= 8) {
+        __m256 vlo[3], vhi[3];
+        for(int c = 0; c < 3; c++) {
+            vlo[c] = _mm256_set1_ps(INFINITY);
+            vhi[c] = _mm256_set1_ps(-INFINITY);
+        }
+        for(; i + 8 <= count; i += 8) {
+            __m256 p[3];
+            loadXYZ(src + i * 3, p[0], p[1], p[2]);
+            for(int c = 0; c < 3; c++) {
+                vlo[c] = _mm256_min_ps(p[c], vlo[c]);
+                vhi[c] = _mm256_max_ps(p[c], vhi[c]);
+            }
+        }
+        alignas(32) float tlo[8], thi[8];
+        for(int c = 0; c < 3; c++) {
+            _mm256_store_ps(tlo, vlo[c]);
+            _mm256_store_ps(thi, vhi[c]);
+            for(int k = 0; k < 8; k++) {
+                lo[c] = std::min(lo[c], tlo[k]);
+                hi[c] = std::max(hi[c], thi[k]);
+            }
+        }
+    }
+#endif
+
+#ifdef __SSE2__
+    __m128 vlo = _mm_setr_ps(lo.x, lo.y, lo.z, 0);
+    __m128 vhi = _mm_setr_ps(hi.x, hi.y, hi.z, 0);
+    for(; i < count; i++) {
+        const float *s = src + i * stride;
+        const __m128 p = _mm_setr_ps(s[0], s[1], s[2], 0);
+        vlo = _mm_min_ps(p, vlo);
+        vhi = _mm_max_ps(p, vhi);
+    }
+    float tmp[4];
+    _mm_storeu_ps(tmp, vlo);
+    lo = glm::vec3{tmp[0], tmp[1], tmp[2]};
+    _mm_storeu_ps(tmp, vhi);
+    hi = glm::vec3{tmp[0], tmp[1], tmp[2]};
+#else
+    for(; i < count; i++) {
+        const float *s = src + i * stride;
+        for(int c = 0; c < 3; c++) {
+            if(s[c] < lo[c])
+                lo[c] = s[c];
+            if(s[c] > hi[c])
+                hi[c] = s[c];
+        }
+    }
+#endif
+}
+
+// Each chunk compacts into the start of its own range. Close the gaps.
+template <typename T>
+size_t
+gather(T *dst, size_t count, const std::vector<size_t> &kept)
+{
+    size_t j = 0;
+    for(size_t chunk = 0; chunk < kept.size(); chunk++) {
+        const size_t begin = count * chunk / kept.size();
+        if(j != begin)
+            memmove(dst + j, dst + begin, kept[chunk] * sizeof(T));
+        j += kept[chunk];
+    }
+    return j;
+}
+
+}  // namespace
+
+void
+transformPositions(const glm::mat4 &m, const float *src, size_t src_stride,
+                   glm::vec3 *dst, size_t count)
+{
+    parallelFor(count, [&](size_t begin, size_t end, size_t chunk) {
+        aosKernel<false>(m, glm::vec3{0}, glm::vec3{0},
+                         src + begin * src_stride, src_stride, dst + begin,
+                         end - begin);
+    });
+}
+
+size_t
+transformCrop(const glm::mat4 &m, const glm::vec3 &bbmin,
+              const glm::vec3 &bbmax, const float *src, size_t src_stride,
+              glm::vec3 *dst, size_t count)
+{
+    std::vector<size_t> kept(parallelChunks(count));
+    parallelFor(count, [&](size_t begin, size_t end, size_t chunk) {
+        kept[chunk] = aosKernel<true>(m, bbmin, bbmax,
+                                      src + begin * src_stride, src_stride,
+                                      dst + begin, end - begin);
+    });
+    return gather(dst, count, kept);
+}
+
+size_t
+transformCrop(const glm::mat4 &m, const glm::vec3 &bbmin,
+              const glm::vec3 &bbmax, const float *x, const float *y,
+              const float *z, float *ox, float *oy, float *oz, size_t count)
+{
+    std::vector<size_t> kept(parallelChunks(count));
+    parallelFor(count, [&](size_t begin, size_t end, size_t chunk) {
+        kept[chunk] =
+            soaKernel(m, bbmin, bbmax, x + begin, y + begin, z + begin,
+                      ox + begin, oy + begin, oz + begin, end - begin);
+    });
+    gather(ox, count, kept);
+    gather(oy, count, kept);
+    return gather(oz, count, kept);
+}
+
+void
+positionBounds(const float *src, size_t src_stride, size_t count,
+               glm::vec3 &lo, glm::vec3 &hi)
+{
+    const size_t chunks = parallelChunks(count);
+    std::vector<glm::vec3> los(chunks), his(chunks);
+    parallelFor(count, [&](size_t begin, size_t end, size_t chunk) {
+        boundsKernel(src + begin * src_stride, src_stride, end - begin,
+                     los[chunk], his[chunk]);
+    });
+    lo = glm::vec3{INFINITY};
+    hi = glm::vec3{-INFINITY};
+    for(size_t i = 0; i < chunks; i++) {
+        lo = glm::min(lo, los[i]);
+        hi = glm::max(hi, his[i]);
+    }
+}
+
+}  // namespace g3d
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <glm/glm.hpp>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace g3d {
+
+// Bulk transforms of xyz positions. Work is split across threads and
+// vectorized with AVX2 (eight points at a time) or SSE when available.
+// Strides are in floats. dst may be the same memory as src if src_stride
+// is 3, or the same arrays for the SoA variant.
+
+void transformPositions(const glm::mat4 &m, const float *src,
+                        size_t src_stride, glm::vec3 *dst, size_t count);
+
+// Only points outside [bbmin, bbmax] after transformation are dropped,
+// the rest are written in order. Returns the number of points written.
+size_t transformCrop(const glm::mat4 &m, const glm::vec3 &bbmin,
+                     const glm::vec3 &bbmax, const float *src,
+                     size_t src_stride, glm::vec3 *dst, size_t count);
+
+size_t transformCrop(const glm::mat4 &m, const glm::vec3 &bbmin,
+                     const glm::vec3 &bbmax, const float *x, const float *y,
+                     const float *z, float *ox, float *oy, float *oz,
+                     size_t count);
+
+// Bounds of count xyz positions, NaN ones left out. lo > hi if none are
+// left.
+void positionBounds(const float *src, size_t src_stride, size_t count,
+                    glm::vec3 &lo, glm::vec3 &hi);
+
+#ifdef __SSE2__
+
+// Building blocks for loops that fuse the transform with other work
+
+struct SSETransform {
+    explicit SSETransform(const glm::mat4 &m)
+      : c0(_mm_loadu_ps(&m[0][0])),
+        c1(_mm_loadu_ps(&m[1][0])),
+        c2(_mm_loadu_ps(&m[2][0])),
+        c3(_mm_loadu_ps(&m[3][0]))
+    {
+    }
+
+    // m * (v.x, v.y, v.z, 1)
+    __m128 operator()(__m128 v) const
+    {
+        return _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(c0, _mm_shuffle_ps(v, v, 0x00)),
+                       _mm_mul_ps(c1, _mm_shuffle_ps(v, v, 0x55))),
+            _mm_add_ps(_mm_mul_ps(c2, _mm_shuffle_ps(v, v, 0xaa)), c3));
+    }
+
+    __m128 c0, c1, c2, c3;
+};
+
+struct SSEBox {
+    SSEBox(const glm::vec3 &bbmin, const glm::vec3 &bbmax)
+      : lo(_mm_setr_ps(bbmin.x, bbmin.y, bbmin.z, 0)),
+        hi(_mm_setr_ps(bbmax.x, bbmax.y, bbmax.z, 0))
+    {
+    }
+
+    // Considers x, y and z only. NaN is never outside.
+    bool outside(__m128 p) const
+    {
+        const __m128 o = _mm_or_ps(_mm_cmplt_ps(p, lo), _mm_cmpgt_ps(p, hi));
+        return _mm_movemask_ps(o) & 7;
+    }
+
+    __m128 lo, hi;
+};
+
+#endif
+
+#ifdef __AVX2__
+
+// Eight packed xyz points to and from one register per component
+inline void
+loadXYZ(const float *p, __m256 &x, __m256 &y, __m256 &z)
+{
+    const __m256 m03 = _mm256_insertf128_ps(
+        _mm256_castps128_ps256(_mm_loadu_ps(p)), _mm_loadu_ps(p + 12), 1);
+    const __m256 m14 = _mm256_insertf128_ps(
+        _mm256_castps128_ps256(_mm_loadu_ps(p + 4)), _mm_loadu_ps(p + 16), 1);
+    const __m256 m25 = _mm256_insertf128_ps(
+        _mm256_castps128_ps256(_mm_loadu_ps(p + 8)), _mm_loadu_ps(p + 20), 1);
+
+    const __m256 xy = _mm256_shuffle_ps(m14, m25, _MM_SHUFFLE(2, 1, 3, 2));
+    const __m256 yz = _mm256_shuffle_ps(m03, m14, _MM_SHUFFLE(1, 0, 2, 1));
+    x = _mm256_shuffle_ps(m03, xy, _MM_SHUFFLE(2, 0, 3, 0));
+    y = _mm256_shuffle_ps(yz, xy, _MM_SHUFFLE(3, 1, 2, 0));
+    z = _mm256_shuffle_ps(yz, m25, _MM_SHUFFLE(3, 0, 3, 1));
+}
+
+inline void
+storeXYZ(float *p, __m256 x, __m256 y, __m256 z)
+{
+    const __m256 xy = _mm256_shuffle_ps(x, y, _MM_SHUFFLE(2, 0, 2, 0));
+    const __m256 yz = _mm256_shuffle_ps(y, z, _MM_SHUFFLE(3, 1, 3, 1));
+    const __m256 zx = _mm256_shuffle_ps(z, x, _MM_SHUFFLE(3, 1, 2, 0));
+    const __m256 r03 = _mm256_shuffle_ps(xy, zx, _MM_SHUFFLE(2, 0, 2, 0));
+    const __m256 r14 = _mm256_shuffle_ps(yz, xy, _MM_SHUFFLE(3, 1, 2, 0));
+    const __m256 r25 = _mm256_shuffle_ps(zx, yz, _MM_SHUFFLE(3, 1, 3, 1));
+    _mm_storeu_ps(p, _mm256_castps256_ps128(r03));
+    _mm_storeu_ps(p + 4, _mm256_castps256_ps128(r14));
+    _mm_storeu_ps(p + 8, _mm256_castps256_ps128(r25));
+    _mm_storeu_ps(p + 12, _mm256_extractf128_ps(r03, 1));
+    _mm_storeu_ps(p + 16, _mm256_extractf128_ps(r14, 1));
+    _mm_storeu_ps(p + 20, _mm256_extractf128_ps(r25, 1));
+}
+
+#endif
+
+}  // namespace g3d
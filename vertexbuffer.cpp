@@ -1,5 +1,8 @@
 #include "vertexbuffer.hpp"
 
+#include <algorithm>
+#include <stdexcept>
+
 #include <glm/gtc/type_ptr.hpp>
 
 namespace g3d {
@@ -16,6 +19,43 @@ VertexBuffer::get_attribute_mask() const
     return mask;
 }
 
+void
+VertexBuffer::invalidate(VertexAttribute va, size_t first, size_t count)
+{
+    if(count)
+        m_dirty.push_back(VertexRange{va, first, count});
+}
+
+std::vector<VertexRange>
+VertexBuffer::take_dirty()
+{
+    std::vector<VertexRange> r;
+    r.swap(m_dirty);
+    std::sort(r.begin(), r.end(), [](const auto &a, const auto &b) {
+        return a.va < b.va || (a.va == b.va && a.first < b.first);
+    });
+
+    size_t j = 0;
+    for(size_t i = 0; i < r.size(); i++) {
+        if(j && r[j - 1].va == r[i].va &&
+           r[j - 1].first + r[j - 1].count >= r[i].first) {
+            const size_t end = std::max(r[j - 1].first + r[j - 1].count,
+                                        r[i].first + r[i].count);
+            r[j - 1].count = end - r[j - 1].first;
+        } else {
+            r[j++] = r[i];
+        }
+    }
+    r.resize(j);
+    return r;
+}
+
+bool
+VertexBuffer::is_dirty(VertexAttribute va) const
+{
+    return touches(m_dirty, va);
+}
+
 struct VertexBufferCpu : public VertexBuffer {
     size_t size() const override { return m_positions.size(); }
     const float *get_attributes(VertexAttribute va) const override
@@ -25,6 +65,8 @@ struct VertexBufferCpu : public VertexBuffer {
             return (const float *)m_positions.data();
         case VertexAttribute::Color:
             return (const float *)m_colors.data();
+        case VertexAttribute::Aux:
+            return (const float *)m_aux.data();
         default:
             return nullptr;
         }
@@ -37,6 +79,8 @@ struct VertexBufferCpu : public VertexBuffer {
             return 3;
         case VertexAttribute::Color:
             return m_colors.size() ? 4 : 0;
+        case VertexAttribute::Aux:
+            return m_aux.size() ? 2 : 0;
         default:
             return 0;
         }
@@ -49,8 +93,51 @@ struct VertexBufferCpu : public VertexBuffer {
 
     std::vector<glm::vec3> m_positions;
     std::vector<glm::vec4> m_colors;
+    std::vector<glm::vec2> m_aux;
+};
+
+struct VertexBufferView : public VertexBuffer {
+    size_t size() const override { return m_count; }
+
+    const float *get_attributes(VertexAttribute va) const override
+    {
+        const size_t i = (size_t)va;
+        return i < m_views.size() ? m_views[i].data : nullptr;
+    }
+
+    size_t get_elements(VertexAttribute va) const override
+    {
+        const size_t i = (size_t)va;
+        return i < m_views.size() ? m_views[i].elements : 0;
+    }
+
+    size_t get_stride(VertexAttribute va) const override
+    {
+        const size_t i = (size_t)va;
+        return i < m_views.size() ? m_views[i].stride : 0;
+    }
+
+    size_t m_count{0};
+    std::vector<VertexAttribView> m_views;  // Indexed by VertexAttribute
+    std::shared_ptr<const void> m_owner;
 };
 
+std::shared_ptr<VertexBuffer>
+VertexBuffer::make(size_t count, const std::vector<VertexAttribView> &views,
+                   const std::shared_ptr<const void> &owner)
+{
+    auto vbv = std::make_shared<VertexBufferView>();
+    vbv->m_count = count;
+    vbv->m_owner = owner;
+    for(const auto &v : views) {
+        const size_t i = (size_t)v.va;
+        if(i >= vbv->m_views.size())
+            vbv->m_views.resize(i + 1, VertexAttribView{{}, nullptr, 0, 0});
+        vbv->m_views[i] = v;
+    }
+    return vbv;
+}
+
 std::shared_ptr<VertexBuffer>
 VertexBuffer::make(const std::vector<glm::vec3> &positions)
 {
@@ -69,4 +156,91 @@ VertexBuffer::make(const std::vector<glm::vec3> &positions,
     return vbc;
 }
 
+std::shared_ptr<VertexBuffer>
+VertexBuffer::make(const std::vector<glm::vec3> &positions,
+                   const std::vector<glm::vec4> &colors,
+                   const std::vector<glm::vec2> &aux)
+{
+    auto vbc = std::make_shared<VertexBufferCpu>();
+    vbc->m_positions = positions;
+    vbc->m_colors = colors;
+    vbc->m_aux = aux;
+    return vbc;
+}
+
+std::shared_ptr<VertexBuffer>
+VertexBuffer::make(std::vector<glm::vec3> &&positions)
+{
+    auto vbc = std::make_shared<VertexBufferCpu>();
+    vbc->m_positions = std::move(positions);
+    return vbc;
+}
+
+std::shared_ptr<VertexBuffer>
+VertexBuffer::make(std::vector<glm::vec3> &&positions,
+                   std::vector<glm::vec4> &&colors)
+{
+    auto vbc = std::make_shared<VertexBufferCpu>();
+    vbc->m_positions = std::move(positions);
+    vbc->m_colors = std::move(colors);
+    return vbc;
+}
+
+std::shared_ptr<VertexBuffer>
+VertexBuffer::make(std::vector<glm::vec3> &&positions,
+                   std::vector<glm::vec4> &&colors,
+                   std::vector<glm::vec2> &&aux)
+{
+    auto vbc = std::make_shared<VertexBufferCpu>();
+    vbc->m_positions = std::move(positions);
+    vbc->m_colors = std::move(colors);
+    vbc->m_aux = std::move(aux);
+    return vbc;
+}
+
+void
+VertexBufferBuilder::checkSize(size_t size) const
+{
+    if(size != m_count)
+        throw std::invalid_argument{"Attribute size does not match count"};
+}
+
+VertexBufferBuilder &
+VertexBufferBuilder::add(VertexAttribute va, const float *data, size_t stride,
+                         size_t elements, std::function<void()> release)
+{
+    std::shared_ptr<const void> owner;
+    if(release)
+        owner.reset(data, [release = std::move(release)](const void *) {
+            release();
+        });
+    return add(va, data, stride, elements, std::move(owner));
+}
+
+VertexBufferBuilder &
+VertexBufferBuilder::add(VertexAttribute va, const float *data, size_t stride,
+                         size_t elements, std::shared_ptr<const void> owner)
+{
+    for(auto &v : m_views) {
+        if(v.va == va)
+            throw std::invalid_argument{"Attribute added twice"};
+    }
+    m_views.push_back(VertexAttribView{va, data, stride, elements});
+    if(owner)
+        m_owners.push_back(std::move(owner));
+    return *this;
+}
+
+std::shared_ptr<VertexBuffer>
+VertexBufferBuilder::build()
+{
+    std::shared_ptr<const void> owner;
+    if(m_owners.size() == 1)
+        owner = m_owners[0];
+    else if(m_owners.size() > 1)
+        owner = std::make_shared<std::vector<std::shared_ptr<const void>>>(
+            m_owners);
+    return VertexBuffer::make(m_count, m_views, owner);
+}
+
 }  // namespace g3d
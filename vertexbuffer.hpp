@@ -1,13 +1,18 @@
 #pragma once
 
+#include <array>
+#include <functional>
 #include <string>
 #include <memory>
+#include <type_traits>
 #include <vector>
 
 #include <glm/glm.hpp>
 
 namespace g3d {
 
+struct BvhBlob;
+
 enum class VertexAttribute {
     Position,
     Normal,
@@ -16,6 +21,32 @@ enum class VertexAttribute {
     Aux,
 };
 
+// How VertexAttribBuffer stores an attribute on the GPU. Normalized
+// formats map [0, 1] (UNorm) or [-1, 1] (SNorm) to the integer range.
+enum class VertexFormat : uint8_t {
+    Float,
+    Half,
+    UNorm8,
+    UNorm16,
+    SNorm16,
+    SNorm10,  // xyz in one 2_10_10_10 word, for normals
+};
+
+// Strided float attribute in memory not owned by the VertexBuffer
+struct VertexAttribView {
+    VertexAttribute va;
+    const float *data;
+    size_t stride;  // In floats
+    size_t elements;
+};
+
+// Vertices [first, first + count) of one attribute
+struct VertexRange {
+    VertexAttribute va;
+    size_t first;
+    size_t count;
+};
+
 struct VertexBuffer {
     virtual ~VertexBuffer(){};
     virtual size_t size() const = 0;
@@ -25,6 +56,70 @@ struct VertexBuffer {
 
     uint32_t get_attribute_mask() const;
 
+    // GPU storage of each attribute, the data here is always float. Float
+    // unless set otherwise, sources known to be 8 bit (RGB8 images, .g3p)
+    // set Color to UNorm8.
+    VertexFormat get_format(VertexAttribute va) const
+    {
+        const size_t i = (size_t)va;
+        return i < m_formats.size() ? m_formats[i] : VertexFormat::Float;
+    }
+
+    void set_format(VertexAttribute va, VertexFormat format)
+    {
+        m_formats.at((size_t)va) = format;
+    }
+
+    const std::array<VertexFormat, 8> &get_formats() const
+    {
+        return m_formats;
+    }
+
+    void set_formats(const std::array<VertexFormat, 8> &formats)
+    {
+        m_formats = formats;
+    }
+
+    // Marks vertices as changed in place. Handing the VertexBuffer again to
+    // the Object drawing it (Object::set()) then uploads only those.
+    // Call from the thread that calls set().
+    void invalidate(VertexAttribute va, size_t first, size_t count);
+
+    // Ranges marked since the last call, merged and sorted
+    std::vector<VertexRange> take_dirty();
+
+    // Whether any range marked since the last take_dirty() is of va
+    bool is_dirty(VertexAttribute va) const;
+
+    // Prebuilt intersection tree stored alongside the vertices, if any
+    virtual const BvhBlob *get_bvh() const { return nullptr; }
+
+    // Organized clouds (depth cameras, scanning lidars) keep their sensor
+    // grid. Vertex x + y * width is at column x and row y, invalid points
+    // are NaN. {0, 0} if not organized. See organized.hpp.
+    glm::uvec2 get_grid() const { return m_grid; }
+
+    void set_grid(const glm::uvec2 &grid) { m_grid = grid; }
+
+    bool organized() const
+    {
+        return m_grid.x && (size_t)m_grid.x * m_grid.y == size();
+    }
+
+    // Set by progressiveOrder(): any prefix is a uniform subsample
+    bool progressive() const { return m_progressive; }
+
+    void set_progressive(bool progressive) { m_progressive = progressive; }
+
+    // Formats, grid and progressive order of src, for a VertexBuffer made
+    // from src's vertices in the same order. Dirty ranges are not copied.
+    void copy_properties(const VertexBuffer &src)
+    {
+        m_formats = src.m_formats;
+        m_grid = src.m_grid;
+        m_progressive = src.m_progressive;
+    }
+
     static std::shared_ptr<VertexBuffer> make(
         const std::vector<glm::vec3> &pos);
 
@@ -32,6 +127,29 @@ struct VertexBuffer {
         const std::vector<glm::vec3> &positions,
         const std::vector<glm::vec4> &colors);
 
+    static std::shared_ptr<VertexBuffer> make(
+        const std::vector<glm::vec3> &positions,
+        const std::vector<glm::vec4> &colors,
+        const std::vector<glm::vec2> &aux);
+
+    // The vectors are adopted rather than copied
+    static std::shared_ptr<VertexBuffer> make(
+        std::vector<glm::vec3> &&positions);
+
+    static std::shared_ptr<VertexBuffer> make(
+        std::vector<glm::vec3> &&positions,
+        std::vector<glm::vec4> &&colors);
+
+    static std::shared_ptr<VertexBuffer> make(
+        std::vector<glm::vec3> &&positions,
+        std::vector<glm::vec4> &&colors,
+        std::vector<glm::vec2> &&aux);
+
+    // No copy is made, owner is kept alive for as long as the VertexBuffer
+    static std::shared_ptr<VertexBuffer> make(
+        size_t count, const std::vector<VertexAttribView> &views,
+        const std::shared_ptr<const void> &owner);
+
     glm::vec3 position(int index) const
     {
         const float* pos = get_attributes(VertexAttribute::Position);
@@ -39,6 +157,73 @@ struct VertexBuffer {
         return glm::vec3{pos[0], pos[1], pos[2]};
     }
 
+private:
+    glm::uvec2 m_grid{0, 0};
+
+    std::vector<VertexRange> m_dirty;
+
+    bool m_progressive{false};
+
+    std::array<VertexFormat, 8> m_formats{
+        VertexFormat::Float, VertexFormat::Float, VertexFormat::Float,
+        VertexFormat::Float, VertexFormat::Float, VertexFormat::Float,
+        VertexFormat::Float, VertexFormat::Float};
+};
+
+inline bool
+touches(const std::vector<VertexRange> &ranges, VertexAttribute va)
+{
+    for(const auto &r : ranges) {
+        if(r.va == va)
+            return true;
+    }
+    return false;
+}
+
+// Assembles a VertexBuffer with any set of attributes without copying.
+// Vectors are adopted, external memory is referenced until release() is
+// called, which happens once the VertexBuffer (and the builder) are gone.
+//
+//   auto vb = VertexBufferBuilder(n)
+//                 .add(VertexAttribute::Position, std::move(positions))
+//                 .add(VertexAttribute::Normal, std::move(normals))
+//                 .build();
+//
+// Throws std::invalid_argument if a vector does not hold count elements.
+struct VertexBufferBuilder {
+    explicit VertexBufferBuilder(size_t count) : m_count(count) {}
+
+    // T is float or a glm vector of floats
+    template <typename T>
+    VertexBufferBuilder &add(VertexAttribute va, std::vector<T> &&data)
+    {
+        static_assert(std::is_trivially_copyable<T>::value &&
+                          sizeof(T) % sizeof(float) == 0,
+                      "Attributes are made of floats");
+        checkSize(data.size());
+        const size_t elements = sizeof(T) / sizeof(float);
+        auto v = std::make_shared<std::vector<T>>(std::move(data));
+        return add(va, (const float *)v->data(), elements, elements,
+                   std::shared_ptr<const void>(v));
+    }
+
+    // count elements at data, stride floats apart
+    VertexBufferBuilder &add(VertexAttribute va, const float *data,
+                             size_t stride, size_t elements,
+                             std::function<void()> release);
+
+    VertexBufferBuilder &add(VertexAttribute va, const float *data,
+                             size_t stride, size_t elements,
+                             std::shared_ptr<const void> owner);
+
+    std::shared_ptr<VertexBuffer> build();
+
+private:
+    void checkSize(size_t size) const;
+
+    const size_t m_count;
+    std::vector<VertexAttribView> m_views;
+    std::vector<std::shared_ptr<const void>> m_owners;
 };
 
 }  // namespace g3d